@@ -14,7 +14,6 @@ buildah run $bc -- bash -c 'pacman -Sy && \
         opencv \
         hdf5 \
         netcdf-cxx \
-        imagemagick \
         qt6-base \
         fmt \
         glew \
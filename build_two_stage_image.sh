@@ -14,7 +14,6 @@ buildah run $bc -- bash -c 'pacman -Sy && \
         opencv \
         hdf5 \
         netcdf-cxx \
-        imagemagick \
         qt6-base \
         fmt \
         glew \
@@ -42,7 +41,6 @@ buildah run $rc -- bash -c 'pacman -Sy && \
         opencv \
         hdf5 \
         netcdf-cxx \
-        imagemagick \
         qt6-base \
         fmt \
         glew \
@@ -52,7 +50,7 @@ buildah run $rc -- bash -c 'pacman -Sy && \
     pacman -Scc --noconfirm'
 
 buildah copy --from=$bc $rc /metno_gifs_cpp/src/metno_gif /usr/local/bin/metno_gif
-buildah copy --from=$bc $rc /metno_gifs_cpp/infinite_run.sh /usr/local/bin/infinite_run
+buildah config --cmd '["/usr/local/bin/metno_gif", "--daemon"]' $rc
 
 
 # Commit and remove the container
@@ -0,0 +1,105 @@
+#!/bin/bash
+set -euo pipefail
+
+# Serves a synthetic file from a local stand-in for the THREDDS server (byte
+# ranges, ETag, Last-Modified, 304 on If-None-Match, throttled), kills a
+# download partway, resumes it and checks that the result matches the source,
+# that the finished chunks were not fetched again and that a third run is
+# answered with 304.
+#   scripts/download_test.sh [build_dir]
+# The build needs the benchmarks for make_synthetic: cmake -DBUILD_BENCHMARKS=ON . in src
+build=${1:-src}
+port=${PORT:-18089}
+
+work=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null || true; rm -rf "$work"' EXIT
+
+# Uncompressed, so there are a few dozen 1 MiB ranges to fetch
+"$build/make_synthetic" "$work/source.nc" --time 48 --y 200 --x 200 --deflate 0 > /dev/null
+size=$(stat -c %s "$work/source.nc")
+
+cat > "$work/server.py" << 'EOF'
+import email.utils, http.server, os, sys, time
+
+path, port, log = sys.argv[1], int(sys.argv[2]), sys.argv[3]
+size = os.path.getsize(path)
+etag = '"%x-%x"' % (size, int(os.path.getmtime(path)))
+last_modified = email.utils.formatdate(os.path.getmtime(path), usegmt=True)
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        if self.headers.get("If-None-Match") == etag:
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        first, last = 0, size - 1
+        ranged = self.headers.get("Range", "").startswith("bytes=")
+        if ranged:
+            a, b = self.headers["Range"][6:].split("-")
+            first, last = int(a), min(int(b) if b else size - 1, size - 1)
+        self.send_response(206 if ranged else 200)
+        if ranged:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (first, last, size))
+        self.send_header("Content-Length", str(last - first + 1))
+        self.send_header("ETag", etag)
+        self.send_header("Last-Modified", last_modified)
+        self.end_headers()
+        with open(path, "rb") as f:
+            f.seek(first)
+            left = last - first + 1
+            while left > 0:
+                data = f.read(min(65536, left))
+                # Slow enough for the download to be killed halfway
+                time.sleep(0.02)
+                try:
+                    self.wfile.write(data)
+                except OSError:
+                    return
+                left -= len(data)
+                with open(log, "a") as out:
+                    out.write("%d\n" % len(data))
+
+http.server.ThreadingHTTPServer(("127.0.0.1", port), Handler).serve_forever()
+EOF
+python3 "$work/server.py" "$work/source.nc" "$port" "$work/served.log" &
+sleep 1
+
+client=("$build/metno_gif" --input "$work/input.nc" --output "$work/out" --var temperature --no_gif --no_progress
+        --download --url "http://127.0.0.1:$port/source.nc" --chunk_mb 1 --connections 4)
+
+echo "Downloading $size bytes, killed partway"
+"${client[@]}" > "$work/first.log" 2>&1 &
+pid=$!
+until [ "$(grep -c '^done' "$work/input.nc.progress" 2>/dev/null || true)" -ge 8 ]; do
+    sleep 0.1
+done
+kill -9 $pid
+wait $pid 2>/dev/null || true
+done_before=$(grep -c '^done' "$work/input.nc.progress")
+echo "Killed with $done_before chunks done"
+[ ! -e "$work/input.nc" ] || { echo "FAILED: the partial download replaced the input"; exit 1; }
+
+echo "Resuming"
+: > "$work/served.log"
+"${client[@]}" > "$work/second.log" 2>&1 || true
+cmp "$work/source.nc" "$work/input.nc" || { echo "FAILED: the resumed download differs from the source"; exit 1; }
+served=$(awk '{ n += $1 } END { print n + 0 }' "$work/served.log")
+# The finished chunks must not be fetched again
+if [ "$served" -gt $((size - (done_before - 1) * 1024 * 1024)) ]; then
+    echo "FAILED: the resumed download fetched $served bytes, more than the chunks that were still missing"
+    exit 1
+fi
+echo "Resumed with $served bytes"
+
+echo "Checking again"
+"${client[@]}" > "$work/third.log" 2>&1 || true
+grep -q "already up-to-date" "$work/third.log" || { echo "FAILED: an unchanged file was not answered with 304"; exit 1; }
+
+echo "OK: the download resumed and matches the source"
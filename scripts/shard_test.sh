@@ -0,0 +1,50 @@
+#!/bin/bash
+set -euo pipefail
+
+# Renders a synthetic file once in a single process and once with --shard plan,
+# several background workers (one of them killed partway) and merge, then checks
+# that both runs wrote the same files.
+#   scripts/shard_test.sh [build_dir] [workers]
+# The build needs the benchmarks for make_synthetic: cmake -DBUILD_BENCHMARKS=ON . in src
+build=${1:-src}
+workers=${2:-4}
+
+work=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null || true; rm -rf "$work"' EXIT
+
+"$build/make_synthetic" "$work/input.nc" --time 48 --y 240 --x 200
+common=(--input "$work/input.nc" --no_download --no_progress)
+
+echo "Single process"
+"$build/metno_gif" "${common[@]}" --output "$work/single" > "$work/single.log"
+
+echo "Sharded, $workers workers"
+sharded=("${common[@]}" --output "$work/sharded" --shard_workers "$workers" --shard_steps 6 --shard_lease 2)
+"$build/metno_gif" "${sharded[@]}" --shard plan > "$work/plan.log"
+pids=()
+for ((i = 0; i < workers; i++)); do
+    "$build/metno_gif" "${sharded[@]}" --shard work --shard_id $i > "$work/worker$i.log" 2>&1 &
+    pids+=($!)
+done
+
+# The units worker 0 holds when it dies go back into its queue once the lease runs out
+sleep 1
+kill -9 "${pids[0]}" 2>/dev/null || true
+wait "${pids[0]}" || true
+for ((i = 1; i < workers; i++)); do
+    if ! wait "${pids[$i]}"; then
+        echo "Worker $i failed:"
+        cat "$work/worker$i.log"
+        exit 1
+    fi
+done
+grep -h "Re-queued" "$work"/worker*.log || true
+
+"$build/metno_gif" "${sharded[@]}" --shard merge > "$work/merge.log"
+
+if diff -r --exclude=.shards "$work/single" "$work/sharded"; then
+    echo "OK: the sharded run wrote the same files as the single process"
+else
+    echo "FAILED: the outputs differ"
+    exit 1
+fi
@@ -0,0 +1,130 @@
+#pragma once
+
+// Shared by the benchmarks: the synthetic field, timing, and saving results
+// to or comparing them with a baseline file.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// A smooth field with fronts and a few missing patches, moving with t, so the
+// values compress and colour like a forecast rather than noise. The same
+// (t, ny, nx) always gives the same values.
+inline void synthetic_field(size_t t, size_t ny, size_t nx, float* dst) {
+  const double phase = 0.15 * t;
+  for (size_t y = 0; y < ny; y++) {
+    double fy = static_cast<double>(y) / ny;
+    for (size_t x = 0; x < nx; x++) {
+      double fx = static_cast<double>(x) / nx;
+      double v = 10.0 * std::sin(6.0 * fx + phase) * std::cos(4.0 * fy - 0.5 * phase) + 5.0 * std::sin(25.0 * (fx + fy) + phase) +
+                 3.0 * std::tanh(20.0 * (fx - 0.5 - 0.1 * std::sin(phase)));
+      // Missing values over a corner, as over the sea for some variables
+      bool missing = fx > 0.9 && fy > 0.9;
+      dst[y * nx + x] = missing ? NAN : static_cast<float>(v);
+    }
+  }
+}
+
+// Seconds per call of fn, the best of several rounds of at least min_seconds
+// each, so a stray context switch does not count
+template <typename Fn>
+double time_per_call(Fn&& fn, double min_seconds = 0.2, int rounds = 3) {
+  double best = 1e30;
+  for (int r = 0; r < rounds; r++) {
+    size_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    do {
+      fn();
+      calls++;
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    best = std::min(best, elapsed / calls);
+  }
+  return best;
+}
+
+// One reported number. Throughputs are better higher, times lower.
+struct BenchResult {
+  std::string name;
+  double value;
+  std::string unit;
+  bool higher_is_better;
+};
+
+// Prints the results and, with a baseline, how each moved against it. With
+// save_path the results are written as the next baseline ("<name> <value>"
+// per line). Returns 1 when a result is worse than the baseline by more than
+// tolerance (a fraction), 0 otherwise.
+inline int report_results(const std::vector<BenchResult>& results, const std::string& baseline_path,
+                          const std::string& save_path, double tolerance) {
+  std::map<std::string, double> baseline;
+  if (!baseline_path.empty()) {
+    std::ifstream file(baseline_path);
+    if (!file) {
+      std::cerr << "Error: Could not read baseline " << baseline_path << std::endl;
+      return 1;
+    }
+    std::string name;
+    double value;
+    while (file >> name >> value) {
+      baseline[name] = value;
+    }
+  }
+
+  int rc = 0;
+  for (const BenchResult& result : results) {
+    std::cout << std::left << std::setw(36) << result.name << std::right << std::fixed << std::setprecision(3)
+              << std::setw(14) << result.value << " " << std::left << std::setw(10) << result.unit << std::right;
+    auto it = baseline.find(result.name);
+    if (it != baseline.end() && it->second > 0.0) {
+      // Positive change is an improvement either way
+      double change = result.higher_is_better ? result.value / it->second - 1.0 : it->second / result.value - 1.0;
+      std::cout << std::showpos << std::setw(8) << std::setprecision(1) << 100.0 * change << std::noshowpos << " %";
+      if (change < -tolerance) {
+        std::cout << "  REGRESSION";
+        rc = 1;
+      }
+    }
+    std::cout << std::endl;
+  }
+
+  if (!save_path.empty()) {
+    std::ofstream file(save_path, std::ios::trunc);
+    for (const BenchResult& result : results) {
+      file << result.name << " " << std::setprecision(9) << result.value << "\n";
+    }
+    if (!file) {
+      std::cerr << "Error: Could not write " << save_path << std::endl;
+      return 1;
+    }
+  }
+  return rc;
+}
+
+// --baseline <file>, --save <file> and --tolerance <percent>, shared by the
+// benchmarks; returns false on an argument it does not know
+inline bool parse_baseline_argument(int argc, char* argv[], int& i, std::string& baseline_path, std::string& save_path,
+                                    double& tolerance) {
+  std::string arg = argv[i];
+  if (i + 1 >= argc) {
+    return false;
+  }
+  if (arg == "--baseline") {
+    baseline_path = argv[++i];
+  } else if (arg == "--save") {
+    save_path = argv[++i];
+  } else if (arg == "--tolerance") {
+    tolerance = std::stod(argv[++i]) / 100.0;
+  } else {
+    return false;
+  }
+  return true;
+}
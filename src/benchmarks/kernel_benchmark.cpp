@@ -0,0 +1,103 @@
+// Microbenchmarks of the per-pixel kernels on a synthetic slice, no input
+// file needed.
+//
+//   kernel_benchmark [--y n] [--x n] [--baseline file] [--save file] [--tolerance percent]
+//
+// --save writes the results as a baseline; a later run with --baseline
+// prints the change against it and exits with 1 when a kernel got slower by
+// more than the tolerance (default 10 %).
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../create_images.h"
+#include "bench_common.h"
+
+int main(int argc, char* argv[]) {
+  size_t nLat = 2321;
+  size_t nLon = 1796;
+  std::string baseline_path, save_path;
+  double tolerance = 0.10;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (parse_baseline_argument(argc, argv, i, baseline_path, save_path, tolerance)) {
+      continue;
+    }
+    if (arg == "--y" && i + 1 < argc) {
+      nLat = std::stoull(argv[++i]);
+    } else if (arg == "--x" && i + 1 < argc) {
+      nLon = std::stoull(argv[++i]);
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--y n] [--x n] [--baseline file] [--save file] [--tolerance percent]" << std::endl;
+      return 1;
+    }
+  }
+
+  const size_t n_steps = 8;
+  const size_t slice_size = nLat * nLon;
+  const double slice_mb = slice_size * sizeof(float) / 1048576.0;
+  const double slice_mpx = slice_size / 1e6;
+  std::vector<float> cube(n_steps * slice_size);
+  for (size_t t = 0; t < n_steps; t++) {
+    synthetic_field(t, nLat, nLon, cube.data() + t * slice_size);
+  }
+  const float* slice = cube.data();
+  const float minVar = -20.0f;
+  const float maxVar = 20.0f;
+  const double scale = 0.5;
+
+  std::vector<BenchResult> results;
+  auto add = [&](const std::string& name, double value, const std::string& unit, bool higher_is_better = true) {
+    results.push_back({name, value, unit, higher_is_better});
+  };
+
+  const std::vector<ColorStop> base = builtin_palette("temperature");
+  double s = time_per_call([&] { generate_colormap(base, 256); });
+  add("generate_colormap_256", s * 1e6, "us", false);
+  s = time_per_call([&] { generate_colormap(base, 4096); });
+  add("generate_colormap_4096", s * 1e6, "us", false);
+  const ColorLUT lut = generate_colormap(base, 256);
+  const ColorLUT fine_lut = generate_colormap(base, 4096);
+
+  s = time_per_call([&] { get_slice_range(slice, slice_size, -1e10f, 1e10f); });
+  add("get_slice_range", slice_mb / s, "MB/s");
+  s = time_per_call([&] { get_variable_range(cube.data(), n_steps, nLat, nLon, -1e10f, 1e10f); });
+  add("get_variable_range", n_steps * slice_mb / s, "MB/s");
+  s = time_per_call([&] {
+    RangeHistogram histogram;
+    histogram.add(slice, slice_size, -1e10f, 1e10f);
+  });
+  add("range_histogram_add", slice_mb / s, "MB/s");
+
+  Mat img;
+  s = time_per_call([&] { colorize(slice, nLat, nLon, lut, minVar, maxVar, img); });
+  add("colorize_full_resolution", slice_mpx / s, "Mpx/s");
+  s = time_per_call([&] { colorize_scaled(slice, nLat, nLon, lut, minVar, maxVar, scale, img); });
+  add("colorize_scaled_0.5", slice_mpx / s, "Mpx/s");
+  s = time_per_call([&] { colorize_scaled(slice, nLat, nLon, fine_lut, minVar, maxVar, scale, img); });
+  add("colorize_scaled_0.5_lut4096", slice_mpx / s, "Mpx/s");
+  Mat indices;
+  s = time_per_call([&] { index_scaled(slice, nLat, nLon, lut, minVar, maxVar, scale, indices); });
+  add("index_scaled_0.5", slice_mpx / s, "Mpx/s");
+  const double frame_mpx = indices.total() / 1e6;
+  s = time_per_call([&] { expand_indices(indices, lut, img); });
+  add("expand_indices", frame_mpx / s, "Mpx/s");
+
+  s = time_per_call([&] { encode_indexed_png(indices.data, indices.cols, indices.rows, indices.step, lut, 1); });
+  add("encode_indexed_png", frame_mpx / s, "Mpx/s");
+  std::vector<uint8_t> lzw;
+  s = time_per_call([&] {
+    lzw.clear();
+    lzw_compress(indices.data, indices.total(), lzw);
+  });
+  add("lzw_compress", frame_mpx / s, "Mpx/s");
+
+  s = time_per_call([&] { fnv1a_hash(slice, slice_size * sizeof(float)); });
+  add("fnv1a_hash", slice_mb / s, "MB/s");
+  TileLevel level = full_resolution_level(slice, nLat, nLon);
+  s = time_per_call([&] { reduce_level(level); });
+  add("tile_reduce_level", slice_mpx / s, "Mpx/s");
+
+  std::cout << "Grid " << nLat << " x " << nLon << std::endl;
+  return report_results(results, baseline_path, save_path, tolerance);
+}
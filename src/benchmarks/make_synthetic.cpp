@@ -0,0 +1,149 @@
+// Writes a synthetic forecast file laid out like the MET Nordic product:
+// time, y and x coordinates and (time, y, x) float variables under the same
+// names, chunked and compressed the same way, at any size. Lets the
+// benchmarks and the renderer run without downloading the real file.
+//
+//   make_synthetic <out.nc> [--time n] [--y n] [--x n] [--chunk_time n] [--deflate level] [--no_shuffle]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <netcdf>
+#include "bench_common.h"
+
+using namespace netCDF;
+
+// NetCDF name, and the offset and scale that put the synthetic field in the
+// variable's usual range
+struct SyntheticVariable {
+  const char* name;
+  const char* units;
+  float offset;
+  float scale;
+  bool non_negative;
+};
+
+static const SyntheticVariable kVariables[] = {
+    {"air_temperature_2m", "K", 275.0f, 1.0f, false},
+    {"integral_of_surface_downwelling_shortwave_flux_in_air_wrt_time", "W s/m^2", 2.0e6f, 1.0e5f, true},
+    {"wind_direction_10m", "degree", 180.0f, 9.0f, false},
+    {"wind_speed_10m", "m/s", 6.0f, 0.4f, true},
+    {"wind_speed_of_gust", "m/s", 10.0f, 0.6f, true},
+    {"cloud_area_fraction", "1", 0.5f, 0.03f, true},
+    {"air_pressure_at_sea_level", "Pa", 101325.0f, 150.0f, false},
+    {"relative_humidity_2m", "1", 0.7f, 0.015f, true},
+    {"precipitation_amount", "kg/m^2", -2.0f, 0.2f, true},
+};
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " <out.nc> [--time n] [--y n] [--x n] [--chunk_time n] [--deflate level] [--no_shuffle]" << std::endl;
+    return 1;
+  }
+  std::string filename = argv[1];
+  // The full 1 km grid and forecast length by default
+  size_t nTime = 62;
+  size_t nY = 2321;
+  size_t nX = 1796;
+  size_t chunk_time = 1;
+  int deflate_level = 1;
+  bool shuffle = true;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--no_shuffle") {
+      shuffle = false;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "Error: Missing value for argument " << arg << std::endl;
+      return 1;
+    }
+    size_t value = std::stoull(argv[++i]);
+    if (arg == "--time") {
+      nTime = value;
+    } else if (arg == "--y") {
+      nY = value;
+    } else if (arg == "--x") {
+      nX = value;
+    } else if (arg == "--chunk_time") {
+      chunk_time = std::max<size_t>(value, 1);
+    } else if (arg == "--deflate") {
+      deflate_level = static_cast<int>(value);
+    } else {
+      std::cerr << "Error: Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+  if (nTime == 0 || nY == 0 || nX == 0) {
+    std::cerr << "Error: Every dimension needs at least one point" << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  try {
+    NcFile file(filename, NcFile::replace);
+    NcDim timeDim = file.addDim("time", nTime);
+    NcDim yDim = file.addDim("y", nY);
+    NcDim xDim = file.addDim("x", nX);
+
+    // Hourly steps from a fixed date, and a 1 km projected grid
+    NcVar timeVar = file.addVar("time", ncDouble, timeDim);
+    timeVar.putAtt("units", "seconds since 1970-01-01 00:00:00 +00:00");
+    std::vector<double> times(nTime);
+    for (size_t t = 0; t < nTime; t++) {
+      times[t] = 1704067200.0 + 3600.0 * t;
+    }
+    timeVar.putVar(times.data());
+
+    NcVar yVar = file.addVar("y", ncDouble, yDim);
+    NcVar xVar = file.addVar("x", ncDouble, xDim);
+    yVar.putAtt("units", "m");
+    xVar.putAtt("units", "m");
+    std::vector<double> ys(nY), xs(nX);
+    for (size_t y = 0; y < nY; y++) {
+      ys[y] = -1.0e6 + 1000.0 * y;
+    }
+    for (size_t x = 0; x < nX; x++) {
+      xs[x] = -5.0e5 + 1000.0 * x;
+    }
+    yVar.putVar(ys.data());
+    xVar.putVar(xs.data());
+
+    std::vector<NcDim> dims = {timeDim, yDim, xDim};
+    std::vector<size_t> chunks = {std::min(chunk_time, nTime), nY, nX};
+    std::vector<float> block(chunks[0] * nY * nX);
+    for (const SyntheticVariable& spec : kVariables) {
+      NcVar var = file.addVar(spec.name, ncFloat, dims);
+      var.putAtt("units", spec.units);
+      var.setChunking(NcVar::nc_CHUNKED, chunks);
+      if (deflate_level > 0 || shuffle) {
+        var.setCompression(shuffle, deflate_level > 0, deflate_level);
+      }
+      // One chunk row at a time, so the file is written in the order it is laid out
+      for (size_t t0 = 0; t0 < nTime; t0 += chunks[0]) {
+        size_t nt = std::min(chunks[0], nTime - t0);
+        for (size_t i = 0; i < nt; i++) {
+          float* slice = block.data() + i * nY * nX;
+          synthetic_field(t0 + i, nY, nX, slice);
+          for (size_t p = 0; p < nY * nX; p++) {
+            float v = spec.offset + spec.scale * slice[p];
+            slice[p] = spec.non_negative ? std::max(v, 0.0f) : v;
+          }
+        }
+        var.putVar({t0, 0, 0}, {nt, nY, nX}, block.data());
+      }
+      std::cout << "Wrote " << spec.name << std::endl;
+    }
+  } catch (const exceptions::NcException& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::cout << "Wrote " << filename << " (" << nTime << " x " << nY << " x " << nX << ") in " << seconds << " s" << std::endl;
+  return 0;
+}
@@ -0,0 +1,123 @@
+// End-to-end throughput of the render pipeline on a local file, typically one
+// written by make_synthetic: reads, colorizes and encodes every frame of the
+// chosen variables and reports frames/s and MB/s of input.
+//
+//   pipeline_benchmark <file.nc> [--var alias] [--format jpg|png|gif] [--scale f] [--memory_limit MiB]
+//                      [--gif] [--runs n] [--baseline file] [--save file] [--tolerance percent]
+//
+// Frames go to a scratch folder under the system temp directory. Every run
+// renders from scratch (no incremental skipping), the best run counts.
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../create_images.h"
+#include "bench_common.h"
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <file.nc> [--var alias] [--format jpg|png|gif] [--scale f] [--memory_limit MiB]"
+              << " [--gif] [--runs n] [--baseline file] [--save file] [--tolerance percent]" << std::endl;
+    return 1;
+  }
+  std::string filename = argv[1];
+  std::string only_alias;
+  int runs = 3;
+  std::string baseline_path, save_path;
+  double tolerance = 0.10;
+  RenderOptions options;
+  options.write_gif = false;
+  options.incremental = false;
+  options.show_progress = false;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (parse_baseline_argument(argc, argv, i, baseline_path, save_path, tolerance)) {
+      continue;
+    }
+    if (arg == "--gif") {
+      options.write_gif = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "Error: Missing value for argument " << arg << std::endl;
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--var") {
+      only_alias = value;
+    } else if (arg == "--format") {
+      if (value == "jpg") {
+        options.frame_format = FrameFormat::jpg;
+      } else if (value == "png") {
+        options.frame_format = FrameFormat::png;
+      } else if (value == "gif") {
+        options.frame_format = FrameFormat::gif;
+      } else {
+        std::cerr << "Error: Unknown frame format " << value << std::endl;
+        return 1;
+      }
+    } else if (arg == "--scale") {
+      options.scale_factor = std::stod(value);
+    } else if (arg == "--memory_limit") {
+      options.memory_limit_bytes = std::stoull(value) * 1024 * 1024;
+    } else if (arg == "--runs") {
+      runs = std::max(1, std::stoi(value));
+    } else {
+      std::cerr << "Error: Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+
+  std::filesystem::path scratch = std::filesystem::temp_directory_path() / "metno_gif_benchmark";
+  std::vector<VariableJob> jobs;
+  for (const auto& [alias, name] : variable_aliases()) {
+    if (only_alias.empty() || only_alias == alias) {
+      std::filesystem::path folder = scratch / alias;
+      std::filesystem::create_directories(folder);
+      jobs.push_back(VariableJob{name, alias, folder.string(), {}});
+    }
+  }
+  if (jobs.empty()) {
+    std::cerr << "Error: Unknown variable " << only_alias << std::endl;
+    return 1;
+  }
+
+  size_t frames = 0;
+  size_t bytes = 0;
+  try {
+    NcFile file(filename, NcFile::read);
+    for (const VariableJob& job : jobs) {
+      NcVar var;
+      size_t nTime, nLat, nLon;
+      std::tie(var, nTime, nLat, nLon) = load_netcdf_variable(file, job.variable_name);
+      frames += nTime;
+      bytes += nTime * nLat * nLon * sizeof(float);
+    }
+  } catch (const NcException& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  // One context for all runs, as in daemon mode, so the pool is warm after the first
+  RenderContext context(options);
+  double best = 1e30;
+  for (int r = 0; r < runs; r++) {
+    auto start = std::chrono::steady_clock::now();
+    if (!create_images(filename, jobs, context)) {
+      std::cerr << "Error: Render failed" << std::endl;
+      return 1;
+    }
+    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::filesystem::remove_all(scratch);
+
+  std::string prefix = "pipeline_" + std::string(frame_extension(options.frame_format) + 1) + "_";
+  std::vector<BenchResult> results = {
+      {prefix + "seconds", best, "s", false},
+      {prefix + "frames_per_s", frames / best, "frames/s", true},
+      {prefix + "input_mb_per_s", bytes / 1048576.0 / best, "MB/s", true},
+  };
+  std::cout << frames << " frames, " << bytes / 1048576.0 << " MB of input, best of " << runs << " runs" << std::endl;
+  return report_results(results, baseline_path, save_path, tolerance);
+}
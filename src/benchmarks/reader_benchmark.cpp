@@ -0,0 +1,75 @@
+// Compares ways of reading a variable time step by time step: how long each
+// takes and how many bytes of chunks HDF5 decompresses for the bytes used.
+//
+//   reader_benchmark <file.nc> <variable> [block_steps]
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <netcdf>
+#include "../netcdf_reader.h"
+
+using namespace netCDF;
+
+struct Strategy {
+  const char* name;
+  bool size_cache;
+  bool aligned_blocks;
+};
+
+static void run(const std::string& filename, const std::string& variable, const Strategy& strategy, size_t block_steps) {
+  // A fresh file handle per strategy so no chunk cache carries over
+  NcFile file(filename, NcFile::read);
+  NcVar var = file.getVar(variable);
+  size_t n_dims = var.getDimCount();
+  size_t nTime = var.getDim(0).getSize();
+  size_t nLat = var.getDim(n_dims - 2).getSize();
+  size_t nLon = var.getDim(n_dims - 1).getSize();
+
+  VariableReader reader(var, nTime, full_window(nLat, nLon), strategy.size_cache);
+  size_t steps = strategy.aligned_blocks ? reader.aligned_block_steps(block_steps) : 1;
+  std::vector<float> buffer(steps * nLat * nLon);
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t t0 = 0; t0 < nTime; t0 += steps) {
+    reader.read(t0, std::min(steps, nTime - t0), buffer.data());
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  const ReadStats& stats = reader.stats();
+  std::cout << std::left << std::setw(28) << strategy.name << std::right << std::fixed << std::setprecision(3)
+            << std::setw(9) << seconds << " s" << std::setw(10) << std::setprecision(1) << stats.bytes_used / 1048576.0
+            << " MiB used" << std::setw(10) << stats.bytes_decompressed_estimated / 1048576.0 << " MiB decompressed (est.)"
+            << std::setw(7) << std::setprecision(2) << static_cast<double>(stats.bytes_decompressed_estimated) / stats.bytes_used
+            << "x  (" << steps << " steps/read, cache " << reader.cache_bytes() / 1048576.0 << " MiB)" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <file.nc> <variable> [block_steps]" << std::endl;
+    return 1;
+  }
+  std::string filename = argv[1];
+  std::string variable = argv[2];
+  size_t block_steps = argc > 3 ? std::stoull(argv[3]) : 8;
+
+  try {
+    NcFile file(filename, NcFile::read);
+    std::cout << variable << ": " << describe_layout(query_variable_layout(file.getVar(variable))) << std::endl;
+  } catch (const exceptions::NcException& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  const Strategy strategies[] = {
+      {"per step, default cache", false, false},
+      {"per step, sized cache", true, false},
+      {"chunk-aligned blocks", true, true},
+  };
+  for (const Strategy& strategy : strategies) {
+    run(filename, variable, strategy, block_steps);
+  }
+  return 0;
+}
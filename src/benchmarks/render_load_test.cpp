@@ -0,0 +1,179 @@
+// Load test of a running render server (metno_gif --serve): a number of
+// clients on keep-alive connections send requests for the given paths in
+// turn, and the latency percentiles and throughput are reported.
+//
+//   render_load_test <port> [--clients n] [--requests n] [--baseline file] [--save file] [--tolerance percent]
+//                    <path> [path...]
+//
+// e.g. render_load_test 8080 --clients 8 --requests 2000 "/render?var=temperature&t=0" "/render?var=wind&t=3"
+// Every path is requested about as often; with few distinct paths most
+// requests are answered from the frame cache, with many they are rendered.
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "bench_common.h"
+
+static int connect_local(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(static_cast<uint16_t>(port));
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+// Sends one GET and reads the response, returns its status or -1 when the connection failed.
+// closed is set when the server closes the connection after the response.
+static int request(int fd, const std::string& path, std::string& buffer, bool& closed) {
+  std::string text = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  if (send(fd, text.data(), text.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(text.size())) {
+    return -1;
+  }
+  char chunk[65536];
+  size_t end;
+  while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return -1;
+    }
+    buffer.append(chunk, static_cast<size_t>(n));
+  }
+  int status = 0;
+  sscanf(buffer.c_str(), "HTTP/%*s %d", &status);
+  size_t length = 0;
+  const char* field = strcasestr(buffer.c_str(), "content-length:");
+  if (field && static_cast<size_t>(field - buffer.c_str()) < end) {
+    length = std::stoull(field + 15);
+  }
+  const char* connection = strcasestr(buffer.c_str(), "connection: close");
+  closed = connection && static_cast<size_t>(connection - buffer.c_str()) < end;
+  while (buffer.size() < end + 4 + length) {
+    ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return -1;
+    }
+    buffer.append(chunk, static_cast<size_t>(n));
+  }
+  buffer.erase(0, end + 4 + length);
+  return status;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <port> [--clients n] [--requests n] [--baseline file] [--save file]"
+              << " [--tolerance percent] <path> [path...]" << std::endl;
+    return 1;
+  }
+  int port = std::stoi(argv[1]);
+  size_t clients = 4;
+  size_t total = 1000;
+  std::string baseline_path, save_path;
+  double tolerance = 0.10;
+  std::vector<std::string> paths;
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (parse_baseline_argument(argc, argv, i, baseline_path, save_path, tolerance)) {
+      continue;
+    }
+    if (arg.rfind("--", 0) != 0) {
+      paths.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "Error: Missing value for argument " << arg << std::endl;
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--clients") {
+      clients = std::max<size_t>(1, std::stoull(value));
+    } else if (arg == "--requests") {
+      total = std::max<size_t>(1, std::stoull(value));
+    } else {
+      std::cerr << "Error: Unknown argument " << arg << std::endl;
+      return 1;
+    }
+  }
+  if (paths.empty()) {
+    std::cerr << "Error: No paths to request" << std::endl;
+    return 1;
+  }
+
+  // Each client takes the next request number, so the paths are spread over all of them
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> failed{0};
+  std::vector<std::vector<double>> latencies(clients);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t c = 0; c < clients; c++) {
+    threads.emplace_back([&, c] {
+      int fd = connect_local(port);
+      std::string buffer;
+      for (size_t n = next++; n < total; n = next++) {
+        if (fd < 0) {
+          failed++;
+          fd = connect_local(port);
+          continue;
+        }
+        auto sent = std::chrono::steady_clock::now();
+        bool closed = false;
+        int status = request(fd, paths[n % paths.size()], buffer, closed);
+        if (status < 0 || closed) {
+          // The server lets kept-alive connections go when others are waiting for a worker
+          close(fd);
+          buffer.clear();
+          fd = connect_local(port);
+        }
+        if (status != 200) {
+          failed++;
+          continue;
+        }
+        latencies[c].push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - sent).count());
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<double> all;
+  for (const std::vector<double>& client : latencies) {
+    all.insert(all.end(), client.begin(), client.end());
+  }
+  if (all.empty()) {
+    std::cerr << "Error: No request succeeded" << std::endl;
+    return 1;
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile = [&](double p) { return all[std::min(all.size() - 1, static_cast<size_t>(p / 100.0 * all.size()))] * 1e3; };
+
+  std::cout << all.size() << " requests over " << clients << " clients, " << failed << " failed" << std::endl;
+  std::vector<BenchResult> results = {
+      {"server_p50_ms", percentile(50), "ms", false},
+      {"server_p90_ms", percentile(90), "ms", false},
+      {"server_p99_ms", percentile(99), "ms", false},
+      {"server_max_ms", all.back() * 1e3, "ms", false},
+      {"server_requests_per_s", all.size() / seconds, "req/s", true},
+  };
+  int status = report_results(results, baseline_path, save_path, tolerance);
+  return failed > 0 ? 1 : status;
+}
@@ -0,0 +1,194 @@
+#include "colorize.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Pixels handled per quantise/gather round, small enough for the index buffer to stay in L1
+static constexpr size_t kRowBlock = 256;
+
+static void quantize_row_scalar(const float* src, int32_t* indices, size_t n, float minVar, float normFactor, float maxIndex) {
+  for (size_t i = 0; i < n; i++) {
+    float v = ((src[i] - minVar) * normFactor) * maxIndex;
+    // Written so that NaN fails both comparisons and lands on 0, like the SIMD paths
+    v = v > 0.0f ? v : 0.0f;
+    v = v < maxIndex ? v : maxIndex;
+    indices[i] = static_cast<int32_t>(v + 0.5f);
+  }
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of the x86-64 baseline, so this path needs no runtime check
+static void quantize_row_sse2(const float* src, int32_t* indices, size_t n, float minVar, float normFactor, float maxIndex) {
+  const __m128 vmin = _mm_set1_ps(minVar);
+  const __m128 vnorm = _mm_set1_ps(normFactor);
+  const __m128 vmaxIndex = _mm_set1_ps(maxIndex);
+  const __m128 vzero = _mm_setzero_ps();
+  const __m128 vhalf = _mm_set1_ps(0.5f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i), vmin), vnorm), vmaxIndex);
+    // max returns its second operand for NaN
+    v = _mm_min_ps(_mm_max_ps(v, vzero), vmaxIndex);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + i), _mm_cvttps_epi32(_mm_add_ps(v, vhalf)));
+  }
+  quantize_row_scalar(src + i, indices + i, n - i, minVar, normFactor, maxIndex);
+}
+
+__attribute__((target("avx2")))
+static void quantize_row_avx2(const float* src, int32_t* indices, size_t n, float minVar, float normFactor, float maxIndex) {
+  const __m256 vmin = _mm256_set1_ps(minVar);
+  const __m256 vnorm = _mm256_set1_ps(normFactor);
+  const __m256 vmaxIndex = _mm256_set1_ps(maxIndex);
+  const __m256 vzero = _mm256_setzero_ps();
+  const __m256 vhalf = _mm256_set1_ps(0.5f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(src + i), vmin), vnorm), vmaxIndex);
+    v = _mm256_min_ps(_mm256_max_ps(v, vzero), vmaxIndex);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(indices + i), _mm256_cvttps_epi32(_mm256_add_ps(v, vhalf)));
+  }
+  quantize_row_scalar(src + i, indices + i, n - i, minVar, normFactor, maxIndex);
+}
+#endif
+
+using QuantizeKernel = void (*)(const float*, int32_t*, size_t, float, float, float);
+
+static QuantizeKernel select_quantize_kernel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    return quantize_row_avx2;
+  }
+  return quantize_row_sse2;
+#else
+  return quantize_row_scalar;
+#endif
+}
+
+static const QuantizeKernel quantize_kernel = select_quantize_kernel();
+
+void quantize_row(const float* src, int32_t* indices, size_t n, float minVar, float maxVar, int lut_size) {
+  float normFactor = 1.0f / (maxVar - minVar);
+  quantize_kernel(src, indices, n, minVar, normFactor, static_cast<float>(lut_size - 1));
+}
+
+void colorize_row(const float* src, uint8_t* dst, size_t n, const ColorLUT& lut, float minVar, float maxVar) {
+  int32_t indices[kRowBlock];
+  const uint8_t* table = lut.bgr.data();
+  for (size_t i0 = 0; i0 < n; i0 += kRowBlock) {
+    size_t len = std::min(kRowBlock, n - i0);
+    quantize_row(src + i0, indices, len, minVar, maxVar, lut.size);
+    uint8_t* out = dst + 3 * i0;
+    for (size_t i = 0; i < len; i++) {
+      std::memcpy(out + 3 * i, table + 3 * indices[i], 3);
+    }
+  }
+}
+
+void index_row(const float* src, uint8_t* dst, size_t n, const ColorLUT& lut, float minVar, float maxVar) {
+  int32_t indices[kRowBlock];
+  for (size_t i0 = 0; i0 < n; i0 += kRowBlock) {
+    size_t len = std::min(kRowBlock, n - i0);
+    quantize_row(src + i0, indices, len, minVar, maxVar, lut.size);
+    for (size_t i = 0; i < len; i++) {
+      dst[i0 + i] = static_cast<uint8_t>(indices[i]);
+    }
+  }
+}
+
+void colorize(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar, cv::Mat& img) {
+  img.create(nLat, nLon, CV_8UC3);
+  ImageFillParallel imageFillParallel(slice, lut, minVar, maxVar, img, nLat, nLon);
+  cv::parallel_for_(cv::Range(0, nLat), imageFillParallel);
+}
+
+std::vector<ResampleTap> resample_taps(int src_size, int dst_size) {
+  // Same sample positions as cv::resize with INTER_LINEAR: pixel centres are
+  // aligned and samples past the edge are clamped to the border pixel
+  std::vector<ResampleTap> taps(dst_size);
+  double scale = static_cast<double>(src_size) / dst_size;
+  for (int d = 0; d < dst_size; d++) {
+    double f = (d + 0.5) * scale - 0.5;
+    int i0 = static_cast<int>(std::floor(f));
+    float weight = static_cast<float>(f - i0);
+    if (i0 < 0) {
+      i0 = 0;
+      weight = 0.0f;
+    }
+    if (i0 >= src_size - 1) {
+      i0 = src_size - 1;
+      weight = 0.0f;
+    }
+    taps[d] = ResampleTap{i0, std::min(i0 + 1, src_size - 1), weight};
+  }
+  return taps;
+}
+
+void ScaledImageFillParallel::operator()(const cv::Range& range) const {
+  std::vector<float> row(cols_.size());
+  for (int y = range.start; y < range.end; y++) {
+    // Taps are in image rows, which run north to south, the slice runs south to north
+    const ResampleTap& ty = rows_[y];
+    const float* r0 = tempSlice_ + (nLat_ - 1 - ty.i0) * nLon_;
+    const float* r1 = tempSlice_ + (nLat_ - 1 - ty.i1) * nLon_;
+    for (size_t x = 0; x < cols_.size(); x++) {
+      const ResampleTap& tx = cols_[x];
+      float top = r0[tx.i0] + tx.weight * (r0[tx.i1] - r0[tx.i0]);
+      float bottom = r1[tx.i0] + tx.weight * (r1[tx.i1] - r1[tx.i0]);
+      row[x] = top + ty.weight * (bottom - top);
+    }
+    if (indexed_) {
+      index_row(row.data(), img_.ptr<uint8_t>(y), row.size(), lut_, minVar_, maxVar_);
+    } else {
+      colorize_row(row.data(), img_.ptr<uint8_t>(y), row.size(), lut_, minVar_, maxVar_);
+    }
+  }
+}
+
+void colorize_scaled(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar, double scale_factor, cv::Mat& img) {
+  if (scale_factor == 1.0) {
+    colorize(slice, nLat, nLon, lut, minVar, maxVar, img);
+    return;
+  }
+  int new_width = std::max(1, static_cast<int>(nLon * scale_factor));
+  int new_height = std::max(1, static_cast<int>(nLat * scale_factor));
+  std::vector<ResampleTap> rows = resample_taps(nLat, new_height);
+  std::vector<ResampleTap> cols = resample_taps(nLon, new_width);
+
+  img.create(new_height, new_width, CV_8UC3);
+  ScaledImageFillParallel scaledImageFillParallel(slice, lut, minVar, maxVar, img, nLat, nLon, rows, cols);
+  cv::parallel_for_(cv::Range(0, new_height), scaledImageFillParallel);
+}
+
+void index_scaled(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar, double scale_factor, cv::Mat& indices) {
+  if (scale_factor == 1.0) {
+    indices.create(nLat, nLon, CV_8UC1);
+    ImageFillParallel imageFillParallel(slice, lut, minVar, maxVar, indices, nLat, nLon, true);
+    cv::parallel_for_(cv::Range(0, nLat), imageFillParallel);
+    return;
+  }
+  int new_width = std::max(1, static_cast<int>(nLon * scale_factor));
+  int new_height = std::max(1, static_cast<int>(nLat * scale_factor));
+  std::vector<ResampleTap> rows = resample_taps(nLat, new_height);
+  std::vector<ResampleTap> cols = resample_taps(nLon, new_width);
+
+  indices.create(new_height, new_width, CV_8UC1);
+  ScaledImageFillParallel scaledImageFillParallel(slice, lut, minVar, maxVar, indices, nLat, nLon, rows, cols, true);
+  cv::parallel_for_(cv::Range(0, new_height), scaledImageFillParallel);
+}
+
+void expand_indices(const cv::Mat& indices, const ColorLUT& lut, cv::Mat& img) {
+  img.create(indices.rows, indices.cols, CV_8UC3);
+  const uint8_t* table = lut.bgr.data();
+  for (int y = 0; y < indices.rows; y++) {
+    const uint8_t* src = indices.ptr<uint8_t>(y);
+    uint8_t* dst = img.ptr<uint8_t>(y);
+    for (int x = 0; x < indices.cols; x++) {
+      std::memcpy(dst + 3 * x, table + 3 * src[x], 3);
+    }
+  }
+}
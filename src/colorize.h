@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// Hands out storage starting on a cache line, so a 256 entry table spans 12
+// lines rather than 13 and no two tables share one
+template <typename T>
+struct CacheAlignedAllocator {
+  using value_type = T;
+  static constexpr std::align_val_t kAlignment{64};
+
+  CacheAlignedAllocator() = default;
+  template <typename U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(::operator new(n * sizeof(T), kAlignment)); }
+  void deallocate(T* p, size_t) { ::operator delete(p, kAlignment); }
+  template <typename U>
+  bool operator==(const CacheAlignedAllocator<U>&) const { return true; }
+};
+
+// Colormap baked into a packed lookup table, entry i is the B, G, R bytes at
+// 3 * i. Baked once per palette and size so the per-pixel work is a single gather.
+struct ColorLUT {
+  std::vector<uint8_t, CacheAlignedAllocator<uint8_t>> bgr;
+  int size = 0;
+};
+
+// Normalises src to [minVar, maxVar] and quantises it to LUT indices in [0, lut_size - 1].
+// Values outside the range are clamped, NaN maps to index 0.
+void quantize_row(const float* src, int32_t* indices, size_t n, float minVar, float maxVar, int lut_size);
+// Colorizes n values into n packed BGR pixels
+void colorize_row(const float* src, uint8_t* dst, size_t n, const ColorLUT& lut, float minVar, float maxVar);
+// Quantises n values into n 8-bit LUT indices, for LUTs of at most 256 entries
+void index_row(const float* src, uint8_t* dst, size_t n, const ColorLUT& lut, float minVar, float maxVar);
+// Colorizes a south-to-north nLat x nLon slice into img (CV_8UC3), drawn north up
+void colorize(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar, cv::Mat& img);
+// Same as colorize followed by a bilinear resize by scale_factor, but the field is
+// resampled before colorizing so the full resolution frame is never built
+void colorize_scaled(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar, double scale_factor, cv::Mat& img);
+// Same as colorize_scaled, but writes the LUT indices into a CV_8UC1 frame
+void index_scaled(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar, double scale_factor, cv::Mat& indices);
+// Looks up a CV_8UC1 index frame in the LUT, giving the CV_8UC3 frame colorize_scaled would have made
+void expand_indices(const cv::Mat& indices, const ColorLUT& lut, cv::Mat& img);
+
+// Source sample for one destination row or column of a bilinear resize:
+// the value is (1 - weight) * src[i0] + weight * src[i1]
+struct ResampleTap {
+  int i0;
+  int i1;
+  float weight;
+};
+std::vector<ResampleTap> resample_taps(int src_size, int dst_size);
+
+class ImageFillParallel : public cv::ParallelLoopBody {
+public:
+  ImageFillParallel(const float* tempSlice, const ColorLUT& lut,
+                    float minVar, float maxVar, cv::Mat& img, size_t nLat, size_t nLon, bool indexed = false)
+      : tempSlice_(tempSlice), lut_(lut), minVar_(minVar), maxVar_(maxVar), img_(img), nLat_(nLat), nLon_(nLon), indexed_(indexed) {}
+
+  virtual void operator()(const cv::Range& range) const {
+    for (int y = range.start; y < range.end; y++) {
+      if (indexed_) {
+        index_row(tempSlice_ + y * nLon_, img_.ptr<uint8_t>(nLat_ - y - 1), nLon_, lut_, minVar_, maxVar_);
+      } else {
+        colorize_row(tempSlice_ + y * nLon_, img_.ptr<uint8_t>(nLat_ - y - 1), nLon_, lut_, minVar_, maxVar_);
+      }
+    }
+  }
+
+private:
+  const float* tempSlice_;
+  const ColorLUT& lut_;
+  float minVar_;
+  float maxVar_;
+  cv::Mat& img_;
+  size_t nLat_;
+  size_t nLon_;
+  bool indexed_;
+};
+
+class ScaledImageFillParallel : public cv::ParallelLoopBody {
+public:
+  ScaledImageFillParallel(const float* tempSlice, const ColorLUT& lut, float minVar, float maxVar, cv::Mat& img,
+                          size_t nLat, size_t nLon, const std::vector<ResampleTap>& rows, const std::vector<ResampleTap>& cols, bool indexed = false)
+      : tempSlice_(tempSlice), lut_(lut), minVar_(minVar), maxVar_(maxVar), img_(img), nLat_(nLat), nLon_(nLon), rows_(rows), cols_(cols), indexed_(indexed) {}
+
+  virtual void operator()(const cv::Range& range) const;
+
+private:
+  const float* tempSlice_;
+  const ColorLUT& lut_;
+  float minVar_;
+  float maxVar_;
+  cv::Mat& img_;
+  size_t nLat_;
+  size_t nLon_;
+  const std::vector<ResampleTap>& rows_;
+  const std::vector<ResampleTap>& cols_;
+  bool indexed_;
+};
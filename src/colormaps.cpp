@@ -0,0 +1,183 @@
+#include "colormaps.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+constexpr std::array<ColorStop, 9> kBlues = {{
+    {247, 251, 255}, {221, 234, 246}, {197, 218, 238}, {157, 201, 224}, {106, 173, 213},
+    {65, 145, 197}, {32, 112, 180}, {8, 80, 154}, {8, 48, 107},
+}};
+
+// Red to blue, reversed so low values are blue
+constexpr std::array<ColorStop, 9> kRdBu = {{
+    {5, 48, 97}, {41, 113, 177}, {107, 172, 208}, {194, 221, 235}, {247, 246, 246},
+    {250, 204, 180}, {228, 128, 101}, {185, 39, 50}, {103, 0, 31},
+}};
+
+// Cyclic, for directions
+constexpr std::array<ColorStop, 9> kTwilight = {{
+    {225, 216, 226}, {148, 180, 198}, {97, 117, 186}, {89, 42, 143}, {47, 20, 54},
+    {115, 29, 78}, {178, 86, 82}, {204, 163, 137}, {225, 216, 225},
+}};
+
+// White to black
+constexpr std::array<ColorStop, 9> kGreys = {{
+    {255, 255, 255}, {223, 223, 223}, {191, 191, 191}, {159, 159, 159}, {127, 127, 127},
+    {95, 95, 95}, {63, 63, 63}, {31, 31, 31}, {0, 0, 0},
+}};
+
+constexpr std::array<ColorStop, 9> kSpectral = {{
+    {94, 79, 162}, {63, 150, 182}, {137, 207, 164}, {216, 239, 154}, {254, 254, 189},
+    {253, 210, 127}, {248, 139, 81}, {219, 72, 76}, {158, 1, 66},
+}};
+
+constexpr std::array<ColorStop, 11> kViridis = {{
+    {68, 1, 84}, {72, 34, 115}, {64, 67, 135}, {52, 94, 141}, {41, 120, 142}, {32, 144, 140},
+    {34, 167, 132}, {68, 190, 112}, {121, 209, 81}, {189, 222, 38}, {253, 231, 36},
+}};
+
+// Baked by the compiler, the registry only copies them
+constexpr auto kBluesLut = bake_colormap<256>(kBlues);
+constexpr auto kRdBuLut = bake_colormap<256>(kRdBu);
+constexpr auto kTwilightLut = bake_colormap<256>(kTwilight);
+constexpr auto kGreysLut = bake_colormap<256>(kGreys);
+constexpr auto kSpectralLut = bake_colormap<256>(kSpectral);
+constexpr auto kViridisLut = bake_colormap<256>(kViridis);
+static_assert(kViridisLut[0] == 84 && kViridisLut[1] == 1 && kViridisLut[2] == 68, "LUTs are BGR");
+static_assert(kGreysLut[0] == 255 && kGreysLut[3 * 255] == 0, "stops span the whole LUT");
+
+struct BuiltinPalette {
+  const char* name;
+  const ColorStop* stops;
+  int n_stops;
+  const uint8_t* lut;
+};
+
+template <size_t N>
+constexpr BuiltinPalette builtin(const char* name, const std::array<ColorStop, N>& stops, const std::array<uint8_t, 768>& lut) {
+  return {name, stops.data(), static_cast<int>(N), lut.data()};
+}
+
+// Variable aliases first, then the palettes under their own names
+constexpr BuiltinPalette kBuiltins[] = {
+    builtin("relative_humidity", kBlues, kBluesLut),
+    builtin("precipitation", kBlues, kBluesLut),
+    builtin("cloud_cover", kBlues, kBluesLut),
+    builtin("air_pressure", kRdBu, kRdBuLut),
+    builtin("radiation", kRdBu, kRdBuLut),
+    builtin("wind_direction", kTwilight, kTwilightLut),
+    builtin("wind_speed", kGreys, kGreysLut),
+    builtin("wind_gust", kGreys, kGreysLut),
+    builtin("temperature", kSpectral, kSpectralLut),
+    builtin("viridis", kViridis, kViridisLut),
+    builtin("blues", kBlues, kBluesLut),
+    builtin("greys", kGreys, kGreysLut),
+    builtin("spectral", kSpectral, kSpectralLut),
+    builtin("rdbu", kRdBu, kRdBuLut),
+    builtin("twilight", kTwilight, kTwilightLut),
+};
+
+const BuiltinPalette* find_builtin(const std::string& name) {
+  for (const BuiltinPalette& palette : kBuiltins) {
+    if (name == palette.name) {
+      return &palette;
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+ColorLUT generate_colormap(const std::vector<ColorStop>& stops, int size) {
+  ColorLUT lut;
+  lut.size = size;
+  lut.bgr.resize(3 * size);
+  for (int i = 0; i < size; ++i) {
+    bake_entry(stops.data(), static_cast<int>(stops.size()), size, i, lut.bgr.data() + 3 * i);
+  }
+  return lut;
+}
+
+std::vector<ColorStop> builtin_palette(const std::string& name) {
+  const BuiltinPalette* palette = find_builtin(name);
+  return palette ? std::vector<ColorStop>(palette->stops, palette->stops + palette->n_stops) : std::vector<ColorStop>();
+}
+
+bool load_palettes(const std::string& filename, std::map<std::string, std::vector<ColorStop>>& palettes) {
+  std::ifstream file(filename);
+  if (!file) {
+    std::cerr << "Error: Could not open colormap file " << filename << std::endl;
+    return false;
+  }
+
+  std::string line;
+  int line_number = 0;
+  while (std::getline(file, line)) {
+    line_number++;
+    std::istringstream ss(line);
+    std::string name, word;
+    if (!(ss >> name) || name[0] == '#') {
+      continue;
+    }
+    std::vector<ColorStop> stops;
+    bool ok = true;
+    while (ok && ss >> word) {
+      unsigned r, g, b;
+      char end;
+      if (word[0] == '#' && word.size() == 7 && sscanf(word.c_str(), "#%2x%2x%2x%c", &r, &g, &b, &end) == 3) {
+        stops.push_back({static_cast<uint8_t>(r), static_cast<uint8_t>(g), static_cast<uint8_t>(b)});
+      } else if (stops.empty() && !(ss >> std::ws).good()) {
+        // A single word names a palette defined earlier in the file or built in
+        auto it = palettes.find(word);
+        stops = it != palettes.end() ? it->second : builtin_palette(word);
+        ok = !stops.empty();
+      } else {
+        ok = false;
+      }
+    }
+    if (!ok || stops.size() < 2) {
+      std::cerr << "Error: " << filename << ":" << line_number << ": Invalid palette: " << line << std::endl;
+      return false;
+    }
+    palettes[name] = stops;
+  }
+  return true;
+}
+
+ColormapRegistry::ColormapRegistry(const std::map<std::string, std::vector<ColorStop>>& palettes) : palettes_(palettes) {
+  for (const BuiltinPalette& palette : kBuiltins) {
+    if (palettes_.count(palette.name) == 0) {
+      ColorLUT& lut = luts_[{palette.name, 256}];
+      lut.size = 256;
+      lut.bgr.assign(palette.lut, palette.lut + 3 * 256);
+    }
+  }
+  for (const auto& [name, stops] : palettes_) {
+    luts_[{name, 256}] = generate_colormap(stops, 256);
+  }
+}
+
+bool ColormapRegistry::has(const std::string& name) const {
+  return palettes_.count(name) > 0 || !builtin_palette(name).empty();
+}
+
+const ColorLUT& ColormapRegistry::lut(const std::string& name, int size) {
+  if (size < 2 || size > kMaxColormapSize) {
+    throw std::invalid_argument("colormap size out of range: " + std::to_string(size));
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = luts_.find({name, size});
+  if (it != luts_.end()) {
+    return it->second;
+  }
+  auto user = palettes_.find(name);
+  std::vector<ColorStop> stops = user != palettes_.end() ? user->second : builtin_palette(name);
+  if (stops.empty()) {
+    stops = builtin_palette("viridis");
+  }
+  return luts_.emplace(std::make_pair(name, size), generate_colormap(stops, size)).first->second;
+}
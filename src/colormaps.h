@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "colorize.h"
+
+// One colour of a palette, RGB as palettes are usually published
+struct ColorStop {
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+};
+
+// Largest LUT the registry bakes. Palette indices (png and gif frames, tiles)
+// stay within 256 entries, BGR frames can use up to this many.
+const int kMaxColormapSize = 4096;
+
+// Writes entry i of a size entry LUT into bgr[0..2]: the stops spread evenly
+// over the table and linearly interpolated, in OpenCV's BGR order
+constexpr void bake_entry(const ColorStop* stops, int n_stops, int size, int i, uint8_t* bgr) {
+  double t = static_cast<double>(i) / (size - 1);
+  int idx = static_cast<int>(t * (n_stops - 1));
+  double t_col = (t * (n_stops - 1)) - idx;
+  const uint8_t a[3] = {stops[idx].r, stops[idx].g, stops[idx].b};
+  for (int j = 0; j < 3; ++j) {
+    int value = a[j];
+    if (idx + 1 < n_stops) {
+      const uint8_t b[3] = {stops[idx + 1].r, stops[idx + 1].g, stops[idx + 1].b};
+      value = static_cast<int>(a[j] * (1 - t_col) + b[j] * t_col);
+    }
+    bgr[2 - j] = static_cast<uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
+  }
+}
+
+// The whole LUT, at compile time for the built-in palettes
+template <int Size, size_t N>
+constexpr std::array<uint8_t, 3 * Size> bake_colormap(const std::array<ColorStop, N>& stops) {
+  std::array<uint8_t, 3 * Size> bgr{};
+  for (int i = 0; i < Size; ++i) {
+    bake_entry(stops.data(), static_cast<int>(N), Size, i, bgr.data() + 3 * i);
+  }
+  return bgr;
+}
+
+// Same as bake_colormap, at run time
+ColorLUT generate_colormap(const std::vector<ColorStop>& stops, int size);
+
+// Stops of a built-in palette, by variable alias or palette name (viridis,
+// blues, greys, spectral, rdbu, twilight); empty when there is none
+std::vector<ColorStop> builtin_palette(const std::string& name);
+
+// One palette per line: <name> #rrggbb #rrggbb [...], at least two colours,
+// or <name> <palette> to use another palette under this name. Names are
+// variable aliases or new palette names. Blank lines and lines starting
+// with # are ignored.
+bool load_palettes(const std::string& filename, std::map<std::string, std::vector<ColorStop>>& palettes);
+
+// Palettes by name, baked into LUTs once per size. The built-ins come baked
+// at 256 entries from compile time; user palettes override them. Unknown
+// names get viridis. LUTs stay at the same address for the registry's
+// lifetime. Thread safe.
+class ColormapRegistry {
+public:
+  explicit ColormapRegistry(const std::map<std::string, std::vector<ColorStop>>& palettes = {});
+
+  // size in [2, kMaxColormapSize]
+  const ColorLUT& lut(const std::string& name, int size);
+  // True for user palettes and names with a built-in one
+  bool has(const std::string& name) const;
+
+private:
+  std::map<std::string, std::vector<ColorStop>> palettes_;
+  std::map<std::pair<std::string, int>, ColorLUT> luts_;
+  std::mutex mutex_;
+};
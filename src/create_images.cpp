@@ -1,10 +1,5 @@
 #include "create_images.h"
 
-// Linear interpolation 
-double lerp(double a, double b, double t){
-  return a*(1-t) + b*t;
-}
-
 void print_progress(size_t current, size_t total, int bar_width = 50) {
   double progress = static_cast<double>(current) / total;
   int pos = static_cast<int>(bar_width * progress);
@@ -23,222 +18,92 @@ void print_progress(size_t current, size_t total, int bar_width = 50) {
   std::cout.flush();
 }
 
-std::vector<std::vector<int>> generate_colormap(const std::vector<std::vector<int>> &base_colormap, int size){
-  std::vector<std::vector<int>> colormap(size);
-  int base_size = base_colormap.size();
-  for (int i = 0; i < size; ++i){
-    double t = static_cast<double>(i) / (size - 1);
-    int idx = static_cast<int>(t * (base_size - 1));
-    double t_col = (t * (base_size - 1)) - idx;
-
-    std::vector<int> color(3);
-    for (int j = 0; j < 3; ++j){
-      if (idx + 1 < base_size) {
-        color[j] = static_cast<int>(lerp(base_colormap[idx][j], base_colormap[idx + 1][j], t_col));
-      } else {
-        color[j] = static_cast<int>(base_colormap[idx][j]);
-      }
-    }
-    colormap[i] = color;
-  }
-  return colormap;
-}
+std::vector<float> load_variable_data(FieldReader &reader, size_t nTime, size_t nLat, size_t nLon) {
+  std::vector<float> data(nTime * nLat * nLon);
 
-std::vector<std::vector<int>> get_base_colormap(const std::string& variable_alias) {
-  if (variable_alias == "relative_humidity") {
-    return {
-      { 247, 251, 255 },
-      { 221, 234, 246 },
-      { 197, 218, 238 },
-      { 157, 201, 224 },
-      { 106, 173, 213 },
-      { 65, 145, 197 },
-      { 32, 112, 180 },
-      { 8, 80, 154 },
-      { 8, 48, 107 },
-    };
-
-  } else if (variable_alias == "precipitatoin") {
-    return {
-      { 247, 251, 255 },
-      { 221, 234, 246 },
-      { 197, 218, 238 },
-      { 157, 201, 224 },
-      { 106, 173, 213 },
-      { 65, 145, 197 },
-      { 32, 112, 180 },
-      { 8, 80, 154 },
-      { 8, 48, 107 },
-    };
-
-  }else if(variable_alias == "air_pressure") {
-    return {
-      { 5, 48, 97 },
-      { 41, 113, 177 },
-      { 107, 172, 208 },
-      { 194, 221, 235 },
-      { 247, 246, 246 },
-      { 250, 204, 180 },
-      { 228, 128, 101 },
-      { 185, 39, 50 },
-      { 103, 0, 31 },
-    };
-  } else if (variable_alias == "radiation") {
-    return {
-      { 5, 48, 97 },
-      { 41, 113, 177 },
-      { 107, 172, 208 },
-      { 194, 221, 235 },
-      { 247, 246, 246 },
-      { 250, 204, 180 },
-      { 228, 128, 101 },
-      { 185, 39, 50 },
-      { 103, 0, 31 },
-    };
-
-  } else if (variable_alias == "wind_direction") {
-      return {
-        { 225, 216, 226 },
-        { 148, 180, 198 },
-        { 97, 117, 186 },
-        { 89, 42, 143 },
-        { 47, 20, 54 },
-        { 115, 29, 78 },
-        { 178, 86, 82 },
-        { 204, 163, 137 },
-        { 225, 216, 225 },
-      };
-
-  } else if (variable_alias == "wind_speed") {
-      return {
-        { 255, 255, 255 },
-        { 223, 223, 223 },
-        { 191, 191, 191 },
-        { 159, 159, 159 },
-        { 127, 127, 127 },
-        { 95, 95, 95 },
-        { 63, 63, 63 },
-        { 31, 31, 31 },
-        { 0, 0, 0 },
-      };
-  } else if (variable_alias == "wind_gust") {
-      return {
-        { 255, 255, 255 },
-        { 223, 223, 223 },
-        { 191, 191, 191 },
-        { 159, 159, 159 },
-        { 127, 127, 127 },
-        { 95, 95, 95 },
-        { 63, 63, 63 },
-        { 31, 31, 31 },
-        { 0, 0, 0 },
-      };
-  } else if (variable_alias == "temperature") {
-      return {
-        { 94, 79, 162 },
-        { 63, 150, 182 },
-        { 137, 207, 164 },
-        { 216, 239, 154 },
-        { 254, 254, 189 },
-        { 253, 210, 127 },
-        { 248, 139, 81 },
-        { 219, 72, 76 },
-        { 158, 1, 66 },
-      };
-  } else if (variable_alias == "cloud_cover"){
-    return {
-      { 247, 251, 255 },
-      { 221, 234, 246 },
-      { 197, 218, 238 },
-      { 157, 201, 224 },
-      { 106, 173, 213 },
-      { 65, 145, 197 },
-      { 32, 112, 180 },
-      { 8, 80, 154 },
-      { 8, 48, 107 },
-    };
-  }
-  // default color map: "viridis"
-  return  {
-    {68, 1, 84},
-    {72, 34, 115},
-    {64, 67, 135},
-    {52, 94, 141},
-    {41, 120, 142},
-    {32, 144, 140},
-    {34, 167, 132},
-    {68, 190, 112},
-    {121, 209, 81},
-    {189, 222, 38},
-    {253, 231, 36}
-  };
+  // Load the entire variable into memory, the same buffer feeds both the range scan and the time loop
+  reader.read(0, nTime, data.data());
+  return data;
 }
 
+std::pair<float, float> get_slice_range(const float* slice, size_t size, float min_threshold, float max_threshold) {
+  float sliceMin = max_threshold;
+  float sliceMax = min_threshold;
+  for (size_t i = 0; i < size; i++) {
+    float value = slice[i];
 
-std::pair<float, float> get_variable_range(const NcVar &var, size_t nTime, size_t nLat, size_t nLon, float min_threshold = -1e-10, float max_threshold = 1e20) {
-  std::vector<size_t> start(var.getDimCount(), 0);
-  std::vector<size_t> count = {nTime, nLat, nLon};
-  std::vector<float> data(nTime * nLat * nLon);
-
-  // Load the entire variable into memory
-  var.getVar(start, count, data.data());
+    if (value >= min_threshold && value <= max_threshold) {
+      sliceMin = std::min(sliceMin, value);
+      sliceMax = std::max(sliceMax, value);
+    }
+  }
+  return std::make_pair(sliceMin, sliceMax);
+}
 
+std::pair<float, float> combine_ranges(const std::vector<std::pair<float, float>>& slice_ranges, float min_threshold, float max_threshold) {
+  // Folding the per-slice extremes in time order gives exactly the same result as one scan over the cube
   float globalMin = max_threshold;
   float globalMax = min_threshold;
+  for (const auto& range : slice_ranges) {
+    globalMin = std::min(globalMin, range.first);
+    globalMax = std::max(globalMax, range.second);
+  }
+  return std::make_pair(globalMin, globalMax);
+}
+
+std::pair<float, float> get_variable_range(const float* data, size_t nTime, size_t nLat, size_t nLon, float min_threshold = -1e-10, float max_threshold = 1e20) {
+  std::vector<std::pair<float, float>> slice_ranges(nTime);
 
   std::cout << "Finding min/max values" << std::endl;
   for (size_t t = 0; t < nTime; t++) {
-    for (size_t lat = 0; lat < nLat; lat++) {
-      for (size_t lon = 0; lon < nLon; lon++) {
-        float value = data[t * nLat * nLon + lat * nLon + lon];
-
-        if (value >= min_threshold && value <= max_threshold) {
-          globalMin = std::min(globalMin, value);
-          globalMax = std::max(globalMax, value);
-        }
-      }
-    }
+    slice_ranges[t] = get_slice_range(data + t * nLat * nLon, nLat * nLon, min_threshold, max_threshold);
     print_progress(t + 1, nTime);
   }
   std::cout << std::endl;
 
-  return std::make_pair(globalMin, globalMax);
+  return combine_ranges(slice_ranges, min_threshold, max_threshold);
 }
 
-void create_gif(const std::string &input_pattern, const std::string &output_filename, int delay) {
-  std::ostringstream command;
-  std::cout << "Converting to GIF" << std::endl;
-  command << "convert -delay " << delay << " -loop 0 " << input_pattern << " " << output_filename;
+std::pair<float, float> get_variable_range_streaming(FieldReader &reader, size_t nTime, size_t nLat, size_t nLon, std::vector<float>& buffer, size_t block_steps, float min_threshold, float max_threshold) {
+  std::vector<std::pair<float, float>> slice_ranges(nTime);
 
-  int result = system(command.str().c_str());
-  if (result != 0) {
-    std::cerr << "Error: Could not create the output GIF file: " << output_filename << std::endl;
-  } else {
-    std::cout << "GIF created successfully: " << output_filename << std::endl;
+  std::cout << "Finding min/max values (streaming " << block_steps << " time steps per block)" << std::endl;
+  for (size_t t0 = 0; t0 < nTime; t0 += block_steps) {
+    size_t nt = std::min(block_steps, nTime - t0);
+    reader.read(t0, nt, buffer.data());
+    for (size_t i = 0; i < nt; i++) {
+      slice_ranges[t0 + i] = get_slice_range(buffer.data() + i * nLat * nLon, nLat * nLon, min_threshold, max_threshold);
+    }
+    print_progress(t0 + nt, nTime);
   }
-}
+  std::cout << std::endl;
 
-std::vector<std::vector<int>> load_colormap(const std::vector<std::vector<int>> &base_colormap, int size) {
-  return generate_colormap(base_colormap, size);
+  return combine_ranges(slice_ranges, min_threshold, max_threshold);
 }
 
-Mat create_image_for_time_step(const NcVar &var, size_t t, size_t nLat, size_t nLon, const std::vector<std::vector<int>> &colormap, float minVar, float maxVar) {
-  std::vector<size_t> start(var.getDimCount(), 0);
-  std::vector<size_t> count = {1, nLat, nLon};
-  std::vector<float> tempSlice(nLat * nLon);
-
-  start[0] = t;
-  start[1] = 0;
-  start[2] = 0;
-  count[0] = 1;
-  count[1] = nLat;
-  count[2] = nLon;
-  var.getVar(start, count, tempSlice.data());
-  // float normFactor = 1.0f/(maxVar - minVar);
-  Mat img(nLat, nLon, CV_8UC3);
-  ImageFillParallel imageFillParallel(tempSlice, colormap, minVar, maxVar, img, nLat, nLon);
-  cv::parallel_for_(cv::Range(0, nLat), imageFillParallel);
+std::pair<float, float> get_variable_percentile_range(FieldReader &reader, const float* data, size_t nTime, size_t nLat, size_t nLon, std::vector<float>& buffer, size_t block_steps, const RangePolicy &policy) {
+  RangeHistogram histogram;
+  size_t slice_size = nLat * nLon;
+
+  std::cout << "Finding " << policy.lower_percentile << "th/" << policy.upper_percentile << "th percentile values" << std::endl;
+  for (size_t t0 = 0; t0 < nTime; t0 += block_steps) {
+    size_t nt = std::min(block_steps, nTime - t0);
+    const float* block = data ? data + t0 * slice_size : buffer.data();
+    if (!data) {
+      reader.read(t0, nt, buffer.data());
+    }
+    histogram.add(block, nt * slice_size, policy.min_threshold, policy.max_threshold);
+    print_progress(t0 + nt, nTime);
+  }
+  std::cout << std::endl;
+
+  auto range = histogram.percentile_range(policy.lower_percentile, policy.upper_percentile);
+  return range ? *range : std::make_pair(policy.max_threshold, policy.min_threshold);
+}
 
+Mat create_image_for_time_step(const float* slice, size_t nLat, size_t nLon, const ColorLUT &colormap, float minVar, float maxVar, double scale_factor) {
+  Mat img;
+  colorize_scaled(slice, nLat, nLon, colormap, minVar, maxVar, scale_factor, img);
   return img;
 }
 
@@ -255,60 +120,801 @@ std::tuple<NcVar, size_t, size_t, size_t> load_netcdf_variable(NcFile &dataFile,
   return std::make_tuple(var, nTime, nLat, nLon);
 }
 
-void create_images(const std::string &filename, const std::string &variable_name, const std::string &variable_alias, const std::string &output_folder) {
+// First and last index of coords within [lo, hi], for coordinates that run either way
+static std::pair<size_t, size_t> coordinate_span(const std::vector<double> &coords, double lo, double hi) {
+  size_t first = coords.size();
+  size_t last = 0;
+  for (size_t i = 0; i < coords.size(); i++) {
+    if (coords[i] >= lo && coords[i] <= hi) {
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+  return {first, last};
+}
+
+GridWindow resolve_region(const NcFile &dataFile, const NcVar &var, const GridRegion &region, size_t nLat, size_t nLon) {
+  GridWindow window = full_window(nLat, nLon);
+  window.stride = std::max<size_t>(region.stride, 1);
+  if (!region.set) {
+    return window;
+  }
 
-  std::cout << "Creating images for " << variable_alias << std::endl;
+  size_t x0, x1, y0, y1;
+  if (region.projected) {
+    // The coordinate variables share the names of the variable's two grid dimensions, the last ones
+    const int nDims = var.getDimCount();
+    if (nDims < 2) {
+      throw std::invalid_argument("--bbox_xy needs a variable on a two-dimensional grid");
+    }
+    NcVar xVar = dataFile.getVar(var.getDim(nDims - 1).getName());
+    NcVar yVar = dataFile.getVar(var.getDim(nDims - 2).getName());
+    if (xVar.isNull() || yVar.isNull() || xVar.getDim(0).getSize() != nLon || yVar.getDim(0).getSize() != nLat) {
+      throw std::invalid_argument("--bbox_xy needs coordinate variables along the grid dimensions of " + var.getName());
+    }
+    std::vector<double> xs(nLon), ys(nLat);
+    xVar.getVar(xs.data());
+    yVar.getVar(ys.data());
+    std::tie(x0, x1) = coordinate_span(xs, std::min(region.x_min, region.x_max), std::max(region.x_min, region.x_max));
+    std::tie(y0, y1) = coordinate_span(ys, std::min(region.y_min, region.y_max), std::max(region.y_min, region.y_max));
+  } else {
+    // Clamping a negative upper edge to 0 would quietly draw the first row or column
+    if (region.x_max < 0.0 || region.y_max < 0.0) {
+      throw std::invalid_argument("--bbox does not cover any point of the grid");
+    }
+    x0 = static_cast<size_t>(std::max(region.x_min, 0.0));
+    y0 = static_cast<size_t>(std::max(region.y_min, 0.0));
+    x1 = static_cast<size_t>(std::clamp(region.x_max, 0.0, static_cast<double>(nLon - 1)));
+    y1 = static_cast<size_t>(std::clamp(region.y_max, 0.0, static_cast<double>(nLat - 1)));
+  }
+  if (x0 > x1 || y0 > y1 || x0 >= nLon || y0 >= nLat) {
+    throw std::invalid_argument("--bbox does not cover any point of the grid");
+  }
+  window.x0 = x0;
+  window.y0 = y0;
+  window.nx = x1 - x0 + 1;
+  window.ny = y1 - y0 + 1;
+  return window;
+}
 
-  try {
-    NcFile dataFile(filename, NcFile::read);
-    NcVar var, timeVar;
-    size_t nTime, nLat, nLon;
-    std::tie(var, nTime, nLat, nLon) = load_netcdf_variable(dataFile, variable_name);
-
-    timeVar = dataFile.getVar("time");
-    int colormap_size = 256;
-    std::vector<std::vector<int>> base_colormap = get_base_colormap(variable_alias);
-    std::vector<std::vector<int>> viridis = load_colormap(base_colormap, colormap_size);
-    float min_threshold = -1e10;
-    float max_threshold = 1e10;
-    if (variable_alias == "precipitation"){
-        min_threshold = -0.01;
-    }
-    std::pair<float, float> varRange = get_variable_range(var, nTime, nLat, nLon, min_threshold, max_threshold);
-    std::cout << "Found value range of (" << varRange.first << ", " << varRange.second << ")" << std::endl;
-    float minVar = varRange.first;
-    float maxVar = varRange.second;
-
-    std::cout << "Time loop" << std::endl;
+const char* frame_extension(FrameFormat format) {
+  switch (format) {
+    case FrameFormat::png:
+      return ".png";
+    case FrameFormat::gif:
+      return ".gif";
+    case FrameFormat::jpg:
+      break;
+  }
+  return ".jpg";
+}
+
+const std::map<std::string, std::string>& variable_aliases() {
+  static const std::map<std::string, std::string> aliases = {
+    {"temperature", "air_temperature_2m"},
+    {"radiation", "integral_of_surface_downwelling_shortwave_flux_in_air_wrt_time"},
+    {"wind_direction", "wind_direction_10m"},
+    {"wind_speed", "wind_speed_10m"},
+    {"wind_gust", "wind_speed_of_gust"},
+    {"cloud_cover", "cloud_area_fraction"},
+    {"air_pressure", "air_pressure_at_sea_level"},
+    {"relative_humidity", "relative_humidity_2m"},
+    {"precipitation", "precipitation_amount"}
+  };
+  return aliases;
+}
+
+std::vector<std::string> load_time_labels(const NcFile &dataFile, size_t nTime) {
+  NcVar timeVar = dataFile.getVar("time");
+  std::vector<double> timestamps(nTime);
+  timeVar.getVar(timestamps.data());
+
+  std::vector<std::string> time_labels(nTime);
+  for (size_t t = 0; t < nTime; t++) {
+    // Convert the timestamp into a string
+    std::time_t time = static_cast<std::time_t>(timestamps[t]);
+    std::tm local;
+    localtime_r(&time, &local);
+    char label[32];
+    size_t length = std::strftime(label, sizeof(label), "%Y%m%d_%H", &local); // formats as: YYYYMMDD_HH
+    time_labels[t].assign(label, length);
+  }
+  return time_labels;
+}
+
+const ColorLUT& cached_colormap(RenderContext &context, const std::string& variable_alias, int size) {
+  return context.colormaps.lut(variable_alias, size);
+}
+
+// What one job of a group keeps while the group is rendered
+struct FieldRender {
+  const VariableJob *job = nullptr;
+  const ColorLUT *viridis = nullptr;
+  std::string colormap_alias;
+  RangePolicy policy;
+  std::optional<std::pair<float, float>> known_range;
+  float minVar = 0.0f;
+  float maxVar = 0.0f;
+  bool measure_range = false;
+  std::vector<std::pair<float, float>> slice_ranges;
+  std::unique_ptr<GifWriter> gif;
+  const ColorLUT *frame_lut = nullptr;
+  const ColorLUT *tile_lut = nullptr;
+  std::unique_ptr<RenderManifest> manifest;
+  uint64_t style_hash = 0;
+  std::vector<uint64_t> slice_hashes;
+  std::vector<std::string> frame_names;
+  std::atomic<size_t> frames_skipped{0};
+  std::atomic<size_t> tiles_written{0};
+  // The first error of any of its frames
+  std::exception_ptr error;
+};
+
+// The aliases of a group, as its metrics and log lines name it
+static std::string group_label(const std::vector<const VariableJob *> &jobs) {
+  std::string label;
+  for (const VariableJob *job : jobs) {
+    label += (label.empty() ? "" : "+") + job->variable_alias;
+  }
+  return label;
+}
+
+// The colour ranges of the fields that need a scan, in one streaming pass
+// over the set, so each stored variable is read once for all of them
+static void scan_field_ranges(FieldSet &fields, std::vector<std::unique_ptr<FieldRender>> &renders, size_t nTime, size_t slice_size,
+                              std::vector<float> &buffer, size_t block_steps) {
+  std::vector<RangeHistogram> histograms(renders.size());
+  std::vector<std::vector<std::pair<float, float>>> slice_ranges(renders.size());
+  std::vector<float *> dst(renders.size());
+  for (size_t k = 0; k < renders.size(); k++) {
+    dst[k] = buffer.data() + k * block_steps * slice_size;
+    if (!renders[k]->known_range && renders[k]->policy.mode != RangeMode::percentile) {
+      slice_ranges[k].resize(nTime);
+    }
+  }
+
+  std::cout << "Finding value ranges (streaming " << block_steps << " time steps per block)" << std::endl;
+  for (size_t t0 = 0; t0 < nTime; t0 += block_steps) {
+    size_t nt = std::min(block_steps, nTime - t0);
+    fields.read(t0, nt, dst);
+    for (size_t k = 0; k < renders.size(); k++) {
+      const RangePolicy &policy = renders[k]->policy;
+      if (renders[k]->known_range) {
+        continue;
+      }
+      if (policy.mode == RangeMode::percentile) {
+        histograms[k].add(dst[k], nt * slice_size, policy.min_threshold, policy.max_threshold);
+        continue;
+      }
+      for (size_t i = 0; i < nt; i++) {
+        slice_ranges[k][t0 + i] = get_slice_range(dst[k] + i * slice_size, slice_size, policy.min_threshold, policy.max_threshold);
+      }
+    }
+    print_progress(t0 + nt, nTime);
+  }
+  std::cout << std::endl;
+
+  for (size_t k = 0; k < renders.size(); k++) {
+    FieldRender &render = *renders[k];
+    const RangePolicy &policy = render.policy;
+    if (render.known_range) {
+      continue;
+    }
+    std::pair<float, float> range;
+    if (policy.mode == RangeMode::percentile) {
+      auto percentiles = histograms[k].percentile_range(policy.lower_percentile, policy.upper_percentile);
+      range = percentiles ? *percentiles : std::make_pair(policy.max_threshold, policy.min_threshold);
+    } else {
+      range = combine_ranges(slice_ranges[k], policy.min_threshold, policy.max_threshold);
+    }
+    render.minVar = range.first;
+    render.maxVar = range.second;
+  }
+}
+
+// Writes what a field leaves behind once all its frames are: the shard result
+// of a unit, otherwise the range cache, the animation and the manifest
+static void finish_field(FieldRender &render, RenderContext &context, const ShardUnit *unit, size_t t_begin, size_t t_end) {
+  const RenderOptions &options = context.options;
+  const VariableJob &job = *render.job;
+  const RangePolicy &policy = render.policy;
+  const std::pair<float, float> range(render.minVar, render.maxVar);
+  if (unit) {
+    // The merge writes the animation, the range cache and the manifest from every unit's result
+    ShardResult result;
+    result.t0 = t_begin;
+    result.t1 = t_end;
+    result.range = range;
+    result.measured = render.measure_range ? combine_ranges({render.slice_ranges.begin() + t_begin, render.slice_ranges.begin() + t_end},
+                                                           policy.min_threshold, policy.max_threshold)
+                                           : range;
+    result.style_hash = render.style_hash;
+    result.slice_hashes.assign(render.slice_hashes.begin() + t_begin, render.slice_hashes.begin() + t_end);
+    for (size_t t = t_begin; render.gif && t < t_end; t++) {
+      result.frames.push_back(render.gif->frame(t));
+    }
+    if (!write_shard_result(unit->result_prefix + ".result", result) || !render.manifest->save_updates(unit->result_prefix + ".manifest")) {
+      throw std::runtime_error("Could not write the shard result " + unit->result_prefix);
+    }
+    return;
+  }
+
+  if (render.measure_range) {
+    std::pair<float, float> measured = combine_ranges(render.slice_ranges, policy.min_threshold, policy.max_threshold);
+    std::pair<float, float> next = measured;
+    if (render.known_range) {
+      float w = policy.rolling_weight;
+      next = std::make_pair(range.first + w * (measured.first - range.first), range.second + w * (measured.second - range.second));
+    }
+    if (next.first < next.second && !write_range_cache(job.output_folder, next)) {
+      std::cerr << "Error: Could not write the range cache in " << job.output_folder << std::endl;
+    }
+  }
+
+  if (render.gif) {
+    // The animation is current when every one of its frames is
+    std::string gif_name = job.variable_alias + ".gif";
+    std::string gif_filename = job.output_folder + "/" + gif_name;
+    FrameRecord gif_record{fnv1a_hash(render.slice_hashes.data(), render.slice_hashes.size() * sizeof(uint64_t)), range.first, range.second,
+                           fnv1a_hash(&options.gif_delay, sizeof(options.gif_delay), render.style_hash)};
+    if (options.incremental && render.manifest->is_current(gif_name, gif_record)) {
+      std::cout << "Animation is up to date: " << gif_filename << std::endl;
+    } else {
+      std::cout << "Writing animation" << std::endl;
+      ScopedTimer timer(context.metrics, "gif", job.variable_alias);
+      if (render.gif->write(gif_filename)) {
+        render.manifest->set(gif_name, gif_record);
+        std::cout << "GIF created successfully: " << gif_filename << std::endl;
+      } else {
+        std::cerr << "Error: Could not create the output GIF file: " << gif_filename << std::endl;
+      }
+    }
+  }
+
+  if (!render.manifest->save()) {
+    std::cerr << "Error: Could not write the render manifest in " << job.output_folder << std::endl;
+  }
+}
+
+std::vector<std::exception_ptr> render_variables(NcFile &dataFile, const std::vector<const VariableJob *> &jobs, const std::vector<std::string> &time_labels,
+                                                 RenderContext &context, const SliceCacheLocation &cache_location, const ShardUnit *unit) {
+  const RenderOptions &options = context.options;
+  ctpl::thread_pool &pool = context.pool;
+  const size_t n_fields = jobs.size();
+  const std::string label = group_label(jobs);
+
+  std::cout << "Creating images for " << label;
+  if (unit) {
+    std::cout << ", time steps " << unit->t0 << "-" << unit->t1 - 1;
+  }
+  std::cout << std::endl;
+
+  NcVar var;
+  size_t nTime, nLat, nLon;
+  std::tie(var, nTime, nLat, nLon) = load_netcdf_variable(dataFile, jobs[0]->variable_name);
+  // A shard unit only draws its own time steps
+  const size_t t_begin = unit ? std::min(unit->t0, nTime) : 0;
+  const size_t t_end = unit ? std::clamp(unit->t1, t_begin, nTime) : nTime;
+  const size_t n_steps = t_end - t_begin;
+  // The fields of a group are on the same grid and share the first one's window
+  const GridWindow window = resolve_region(dataFile, var, options.region, nLat, nLon);
+  std::vector<FieldSpec> specs;
+  for (const VariableJob *job : jobs) {
+    specs.push_back(FieldSpec{job->variable_name, job->derived});
+  }
+  FieldSet fields(dataFile, specs, nTime, window, cache_location);
+  const VariableReader &input = fields.field(0).input();
+  std::cout << "Storage: " << describe_layout(input.layout()) << ", chunk cache " << input.cache_bytes() / 1048576.0 << " MiB" << std::endl;
+  for (size_t k = 0; k < n_fields; k++) {
+    if (fields.field(k).lag_steps() > 0) {
+      std::cout << "Difference over " << fields.field(k).lag_steps() << " time steps for " << jobs[k]->variable_alias << std::endl;
+    }
+  }
+  if (window != full_window(nLat, nLon)) {
+    std::cout << "Region: x " << window.x0 << "-" << window.x0 + window.nx - 1 << ", y " << window.y0 << "-"
+              << window.y0 + window.ny - 1 << ", stride " << window.stride << std::endl;
+  }
+  // From here on the grid is the window
+  nLat = window.rows();
+  nLon = window.cols();
+
+  int colormap_size = 256;
+  // Frames in flight: the frame queue plus one per worker of each stage
+  const size_t slice_size = nLat * nLon;
+  const size_t slice_bytes = slice_size * sizeof(float);
+  const size_t scaled_size = static_cast<size_t>(nLat * options.scale_factor) * static_cast<size_t>(nLon * options.scale_factor);
+  const bool indexed = options.frame_format != FrameFormat::jpg;
+  size_t frame_bytes = (options.frame_queue_depth + options.colorize_threads + options.encode_threads) * scaled_size * (indexed ? 1 : 3);
+  if (options.write_gif) {
+    // Each animation holds one index frame per time step until it is written
+    frame_bytes += n_fields * n_steps * scaled_size;
+  }
+  // A difference keeps the stored slices it still needs from the previous block
+  frame_bytes += fields.history_bytes();
+
+  // A fixed range, or the range cached by the previous run, is known before
+  // any data is read, so there is no pre-pass to wait for
+  std::vector<std::unique_ptr<FieldRender>> renders;
+  bool all_known = true;
+  for (const VariableJob *job : jobs) {
+    auto render = std::make_unique<FieldRender>();
+    render->job = job;
+    render->colormap_alias = job->derived.colormap.empty() ? job->variable_alias : job->derived.colormap;
+    render->viridis = &cached_colormap(context, render->colormap_alias, colormap_size);
+    render->policy = range_policy_for(options.range_policies, job->variable_alias);
+    if (unit) {
+      render->known_range = unit->range;
+    } else if (render->policy.mode == RangeMode::fixed) {
+      render->known_range = std::make_pair(render->policy.min, render->policy.max);
+    } else if (render->policy.mode == RangeMode::rolling) {
+      render->known_range = read_range_cache(job->output_folder);
+    }
+    all_known = all_known && render->known_range;
+    renders.push_back(std::move(render));
+  }
+
+  // Field k's time steps in a block of steps time steps, the fields one after the other
+  auto field_blocks = [&](float *block, size_t steps) {
+    std::vector<float *> dst(n_fields);
+    for (size_t k = 0; k < n_fields; k++) {
+      dst[k] = block + k * steps * slice_size;
+    }
+    return dst;
+  };
+
+  // Stream the fields through two fixed blocks of time steps when the whole
+  // cubes do not fit in the memory limit, otherwise keep them resident. With two
+  // blocks the reader fills one while the workers are still colorizing the other.
+  // With every range known up front the cubes are streamed as well, in eighths, so
+  // the first frame is drawn as soon as its block has been read. A complete
+  // slice cache of a lone field is mapped instead and counts as resident, the
+  // page cache holds it rather than the process. A block holds every field of
+  // the group, so each stored variable is read once for all of them.
+  const float *cube = n_fields == 1 ? fields.field(0).cached_field() : nullptr;
+  const bool mapped = cube != nullptr;
+  const size_t step_bytes = n_fields * slice_bytes;
+  bool streaming = !cube && options.memory_limit_bytes > 0 && n_steps * step_bytes + frame_bytes > options.memory_limit_bytes;
+  size_t block_steps = nTime;
+  std::vector<std::vector<float>> blocks(1);
+  if (cube) {
+    std::cout << "Reading from the slice cache" << std::endl;
+  } else if (streaming) {
+    size_t budget = options.memory_limit_bytes > frame_bytes ? options.memory_limit_bytes - frame_bytes : 0;
+    size_t n_blocks = budget >= 2 * step_bytes ? 2 : 1;
+    // Blocks that end on chunk boundaries along time never split a chunk between two reads. An
+    // empty time dimension or shard unit still gets a block of one step, clamp needs lo <= hi.
+    block_steps = fields.aligned_block_steps(std::clamp<size_t>(budget / n_blocks / step_bytes, 1, std::max<size_t>(n_steps, 1)));
+    blocks.assign(n_blocks, std::vector<float>(n_fields * block_steps * slice_size));
+  } else if (all_known) {
+    streaming = true;
+    block_steps = fields.aligned_block_steps(std::max<size_t>(1, (n_steps + 7) / 8));
+    blocks.assign(std::min<size_t>(2, (n_steps + block_steps - 1) / block_steps), std::vector<float>(n_fields * block_steps * slice_size));
+  } else {
+    // The entire fields in memory, the same buffer feeds both the range scan and the time loop
+    blocks[0].resize(n_fields * nTime * slice_size);
+    fields.read(0, nTime, field_blocks(blocks[0].data(), nTime));
+    cube = blocks[0].data();
+  }
+
+  auto range_start = std::chrono::steady_clock::now();
+  if (streaming && !all_known) {
+    scan_field_ranges(fields, renders, nTime, slice_size, blocks[0], block_steps);
+  }
+  for (size_t k = 0; k < n_fields; k++) {
+    FieldRender &render = *renders[k];
+    std::pair<float, float> range(render.minVar, render.maxVar);
+    if (render.known_range) {
+      range = *render.known_range;
+    } else if (!streaming && render.policy.mode == RangeMode::percentile) {
+      std::vector<float> unused;
+      range = get_variable_percentile_range(fields.field(k), cube + k * nTime * slice_size, nTime, nLat, nLon, unused, block_steps, render.policy);
+    } else if (!streaming) {
+      range = get_variable_range(cube + k * nTime * slice_size, nTime, nLat, nLon, render.policy.min_threshold, render.policy.max_threshold);
+    }
+    render.minVar = range.first;
+    render.maxVar = range.second;
+    std::cout << "Found value range of (" << render.minVar << ", " << render.maxVar << ") for " << render.job->variable_alias << std::endl;
+  }
+  // Includes the reads of a streaming pre-pass, which count towards getvar as well
+  context.metrics.add_time("range_scan", label, std::chrono::duration<double>(std::chrono::steady_clock::now() - range_start).count());
+
+  for (const auto &render : renders) {
+    const VariableJob &job = *render->job;
+    // The rolling range is measured from the slices as they are drawn and folded
+    // into the cache for the next run
+    render->measure_range = render->policy.mode == RangeMode::rolling;
+    render->slice_ranges.resize(render->measure_range ? nTime : 0);
+    if (options.write_gif) {
+      render->gif = std::make_unique<GifWriter>(nTime, *render->viridis, options.gif_delay);
+    }
+    // jpg frames colorized straight from the field may use a finer LUT, palette indices stay at 256 entries
+    render->frame_lut = render->gif || indexed ? render->viridis : &cached_colormap(context, render->colormap_alias, options.colormap_size);
+
+    // A frame is only encoded again when its slice, range or style changed since
+    // the file was last written. The animation needs every index frame, so with
+    // a GIF the unchanged frames are still colorized, just not encoded.
+    render->manifest = std::make_unique<RenderManifest>(job.output_folder);
+    uint64_t style_hash = fnv1a_hash(render->frame_lut->bgr.data(), render->frame_lut->bgr.size());
+    style_hash = fnv1a_hash(&options.scale_factor, sizeof(options.scale_factor), style_hash);
+    style_hash = fnv1a_hash(&options.frame_format, sizeof(options.frame_format), style_hash);
+    style_hash = fnv1a_hash(&options.tile_size, sizeof(options.tile_size), style_hash);
+    render->style_hash = fnv1a_hash(&window, sizeof(window), style_hash);
+    render->slice_hashes.resize(nTime);
+    // Tiles keep the last palette entry free for transparency
+    render->tile_lut = options.tile_size > 0 ? &cached_colormap(context, render->colormap_alias, kTileTransparent) : nullptr;
+    // Built once up front rather than per lookup in the workers
+    render->frame_names.resize(nTime);
     for (size_t t = 0; t < nTime; t++) {
-      Mat img = create_image_for_time_step(var, t, nLat, nLon, viridis, minVar, maxVar);
-
-      // Downscale the image
-      double scale_factor = 0.5; // Change this value to adjust the scaling factor
-      int new_width = static_cast<int>(img.cols * scale_factor);
-      int new_height = static_cast<int>(img.rows * scale_factor);
-      Size new_size(new_width, new_height);
-      Mat downscaled_img;
-      resize(img, downscaled_img, new_size, 0, 0, INTER_LINEAR);
-
-      // Save image to disk
-      double timestamp;
-      timeVar.getVar({t}, &timestamp);
-
-      // Convert the timestamp into a string
-      std::time_t time = static_cast<std::time_t>(timestamp);
-      std::stringstream time_ss;
-      time_ss << std::put_time(std::localtime(&time), "%Y%m%d_%H"); // formats as: YYYYMMDD_HH
-      
-      std::ostringstream filenameStream;
-      filenameStream << output_folder << "/" << variable_alias << "_" << time_ss.str() << ".jpg";
-      std::string output_filename = filenameStream.str();
-      imwrite(output_filename, downscaled_img);
-
-      print_progress(t + 1, nTime);
+      std::string &name = render->frame_names[t];
+      name.reserve(job.variable_alias.size() + time_labels[t].size() + 5);
+      name.append(job.variable_alias).append("_").append(time_labels[t]).append(frame_extension(options.frame_format));
+    }
+  }
+  const size_t buffers_reused = context.frame_pool.reused();
+  const size_t buffers_allocated = context.frame_pool.allocated();
+
+  // Reader (this thread) -> colorize workers -> encode workers. NetCDF is not
+  // thread safe, so every read stays on this thread; frames finish out of order.
+  BoundedQueue<size_t> free_blocks(blocks.size());
+  BoundedQueue<SliceTask> slice_queue(options.slice_queue_depth);
+  BoundedQueue<FrameTask> frame_queue(options.frame_queue_depth);
+  for (size_t b = 0; b < blocks.size(); b++) {
+    free_blocks.push(b);
+  }
+
+  std::mutex progress_mutex;
+  size_t frames_done = 0;
+  auto frame_done = [&]() {
+    std::lock_guard<std::mutex> lock(progress_mutex);
+    ++frames_done;
+    if (options.show_progress) {
+      print_progress(frames_done, n_fields * n_steps);
+    }
+  };
+
+  // The first error of a field's frames, which fails that field once the
+  // pipeline has drained; the workers keep taking tasks so the reader is never
+  // left waiting on a queue
+  std::mutex error_mutex;
+  auto frame_failed = [&](FieldRender &render, std::exception_ptr error) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (!render.error) {
+      render.error = error;
+    }
+  };
+
+  // Palette indices of a frame, with the arrows drawn in when the field has them
+  auto index_frame = [&](size_t field, size_t t, const float *slice, Mat &indices) {
+    const FieldRender &render = *renders[field];
+    const FieldReader &reader = fields.field(field);
+    index_scaled(slice, nLat, nLon, *render.viridis, render.minVar, render.maxVar, options.scale_factor, indices);
+    if (reader.has_arrows()) {
+      draw_arrows(indices, reader.arrow_directions(t), reader.arrow_window(), window, options.scale_factor, *render.viridis);
+    }
+  };
+
+  std::vector<std::future<void>> colorize_workers;
+  for (size_t i = 0; i < options.colorize_threads; i++) {
+    colorize_workers.push_back(pool.push([&](int) {
+      while (std::optional<SliceTask> task = slice_queue.pop()) {
+        FieldRender &render = *renders[task->field];
+        const FieldReader &reader = fields.field(task->field);
+        const std::string &alias = render.job->variable_alias;
+        try {
+          if (render.measure_range) {
+            render.slice_ranges[task->t] = get_slice_range(task->slice, slice_size, render.policy.min_threshold, render.policy.max_threshold);
+          }
+          FrameRecord record{fnv1a_hash(task->slice, slice_bytes), render.minVar, render.maxVar, render.style_hash};
+          if (reader.has_arrows()) {
+            const GridWindow &arrow_window = reader.arrow_window();
+            record.slice_hash = fnv1a_hash(reader.arrow_directions(task->t), arrow_window.rows() * arrow_window.cols() * sizeof(float), record.slice_hash);
+          }
+          render.slice_hashes[task->t] = record.slice_hash;
+          bool current = options.incremental && render.manifest->is_current(render.frame_names[task->t], record);
+          if (current) {
+            if (render.gif) {
+              ScopedTimer timer(context.metrics, "colorize", alias);
+              Mat indices;
+              indices.allocator = &context.frame_pool;
+              index_frame(task->field, task->t, task->slice, indices);
+              render.gif->set_frame(task->t, indices);
+            }
+            render.frames_skipped++;
+            frame_done();
+            continue;
+          }
+
+          // Frame buffers come back from the pool once the encoder and the animation are done with them
+          Mat img;
+          img.allocator = &context.frame_pool;
+          // Resizing is folded into colorizing, the field is resampled before the lookup
+          std::optional<ScopedTimer> colorize_timer(std::in_place, context.metrics, "colorize", alias);
+          if (render.gif || indexed) {
+            // The animation and paletted frames keep the palette indices, a JPEG frame is looked up from them
+            Mat indices;
+            indices.allocator = &context.frame_pool;
+            index_frame(task->field, task->t, task->slice, indices);
+            if (render.gif) {
+              render.gif->set_frame(task->t, indices);
+            }
+            if (indexed) {
+              img = indices;
+            } else {
+              expand_indices(indices, *render.viridis, img);
+            }
+          } else {
+            colorize_scaled(task->slice, nLat, nLon, *render.frame_lut, render.minVar, render.maxVar, options.scale_factor, img);
+            if (reader.has_arrows()) {
+              draw_arrows(img, reader.arrow_directions(task->t), reader.arrow_window(), window, options.scale_factor, *render.frame_lut);
+            }
+          }
+          colorize_timer.reset();
+          if (render.tile_lut) {
+            ScopedTimer timer(context.metrics, "tiles", alias);
+            std::string tiles = "tiles/" + time_labels[task->t];
+            render.tiles_written += write_tile_pyramid(task->slice, nLat, nLon, *render.tile_lut, render.minVar, render.maxVar, options.tile_size,
+                                                       render.job->output_folder + "/" + tiles, tiles + "/", *render.manifest);
+          }
+          // Dropping the task releases its block back to the reader
+          size_t t = task->t;
+          size_t field = task->field;
+          task.reset();
+          frame_queue.push(FrameTask{t, img, record, field});
+        } catch (...) {
+          frame_failed(render, std::current_exception());
+          frame_done();
+        }
+      }
+    }));
+  }
+
+  std::vector<std::future<void>> encode_workers;
+  for (size_t i = 0; i < options.encode_threads; i++) {
+    encode_workers.push_back(pool.push([&](int) {
+      while (std::optional<FrameTask> frame = frame_queue.pop()) {
+        FieldRender &render = *renders[frame->field];
+        const std::string &alias = render.job->variable_alias;
+        try {
+          // Save image to disk
+          const std::string &file_name = render.frame_names[frame->t];
+          const std::string &output_folder = render.job->output_folder;
+          std::string output_filename;
+          output_filename.reserve(output_folder.size() + 1 + file_name.size());
+          output_filename.append(output_folder).append("/").append(file_name);
+          bool written = false;
+          ScopedTimer timer(context.metrics, "imwrite", alias);
+          switch (options.frame_format) {
+            case FrameFormat::jpg:
+              written = imwrite(output_filename, frame->img);
+              break;
+            case FrameFormat::png:
+              written = write_indexed_png(output_filename, frame->img, *render.viridis);
+              break;
+            case FrameFormat::gif:
+              written = write_gif_frame(output_filename, frame->img, *render.viridis);
+              break;
+          }
+          if (written) {
+            render.manifest->set(file_name, frame->record);
+            std::error_code ec;
+            uintmax_t size = std::filesystem::file_size(output_filename, ec);
+            context.metrics.add_count("frames_written", alias, 1);
+            context.metrics.add_count("bytes_written", alias, ec ? 0 : size);
+          } else {
+            frame_failed(render, std::make_exception_ptr(std::runtime_error("Could not write " + output_filename)));
+          }
+        } catch (...) {
+          frame_failed(render, std::current_exception());
+        }
+        frame_done();
+      }
+    }));
+  }
+
+  // Let each stage run dry in order so no worker is left waiting on a queue
+  auto drain_pipeline = [&]() {
+    slice_queue.close();
+    for (auto &worker : colorize_workers) {
+      worker.get();
+    }
+    frame_queue.close();
+    for (auto &worker : encode_workers) {
+      worker.get();
+    }
+  };
+
+  std::cout << "Time loop" << std::endl;
+  try {
+    for (size_t t0 = t_begin; t0 < t_end; t0 += block_steps) {
+      size_t nt = std::min(block_steps, t_end - t0);
+      // Field k's slice of time step t is at block + (k * steps + t - first) * slice_size
+      const float *block = cube;
+      size_t steps = nTime;
+      size_t first = 0;
+      std::shared_ptr<void> hold;
+      if (streaming) {
+        // Wait until every slice of a previous block has been colorized, then refill it
+        size_t b = *free_blocks.pop();
+        fields.read(t0, nt, field_blocks(blocks[b].data(), block_steps));
+        block = blocks[b].data();
+        steps = block_steps;
+        first = t0;
+        hold = std::shared_ptr<void>(nullptr, [&free_blocks, b](void*) { free_blocks.push(b); });
+      } else if (mapped) {
+        // Arrows are read here too, NetCDF stays on this thread
+        fields.field(0).read_arrows(t0, nt);
+      }
+
+      for (size_t t = t0; t < t0 + nt; t++) {
+        for (size_t k = 0; k < n_fields; k++) {
+          slice_queue.push(SliceTask{t, block + (k * steps + t - first) * slice_size, hold, k});
+        }
+      }
     }
+  } catch (...) {
+    drain_pipeline();
+    throw;
+  }
+  drain_pipeline();
+  if (options.show_progress) {
     std::cout << std::endl;
+  }
+
+  // Reads are counted for the group, each stored variable was read once for all its fields
+  ReadStats read_stats;
+  size_t cache_bytes_read = mapped ? n_steps * slice_bytes : 0;
+  for (size_t k = 0; k < n_fields; k++) {
+    const ReadStats &stats = fields.field(k).input().stats();
+    read_stats.seconds += stats.seconds;
+    read_stats.reads += stats.reads;
+    read_stats.bytes_used += stats.bytes_used;
+    read_stats.bytes_decompressed_estimated += stats.bytes_decompressed_estimated;
+    cache_bytes_read += fields.field(k).cache_bytes_read();
+  }
+  context.metrics.add_time("getvar", label, read_stats.seconds, read_stats.reads);
+  context.metrics.add_count("bytes_read", label, read_stats.bytes_used);
+  context.metrics.add_count("bytes_decompressed_estimated", label, read_stats.bytes_decompressed_estimated);
+  context.metrics.add_count("bytes_from_slice_cache", label, cache_bytes_read);
+  context.metrics.add_count("frame_buffers_reused", label, context.frame_pool.reused() - buffers_reused);
+  context.metrics.add_count("frame_buffers_allocated", label, context.frame_pool.allocated() - buffers_allocated);
+  std::cout << "Read " << read_stats.bytes_used / 1048576.0 << " MiB in " << read_stats.reads << " reads, "
+            << read_stats.bytes_decompressed_estimated / 1048576.0 << " MiB of chunks decompressed (estimated)" << std::endl;
+
+  std::vector<std::exception_ptr> errors(n_fields);
+  for (size_t k = 0; k < n_fields; k++) {
+    FieldRender &render = *renders[k];
+    const VariableJob &job = *render.job;
+    context.metrics.add_count("frames_skipped", job.variable_alias, render.frames_skipped);
+    context.metrics.add_count("tiles_written", job.variable_alias, render.tiles_written);
+    if (render.tile_lut) {
+      std::cout << "Wrote " << render.tiles_written << " changed tiles of " << job.variable_alias << std::endl;
+    }
+    if (render.frames_skipped > 0) {
+      std::cout << "Skipped " << render.frames_skipped << " unchanged frames of " << job.variable_alias << std::endl;
+    }
+    // A missing frame fails the field, before the animation and the manifest take the run as complete
+    if (render.error) {
+      errors[k] = render.error;
+      continue;
+    }
+    try {
+      finish_field(render, context, unit, t_begin, t_end);
+    } catch (...) {
+      errors[k] = std::current_exception();
+    }
+  }
+  return errors;
+}
+
+void render_variable(NcFile &dataFile, const VariableJob &job, const std::vector<std::string> &time_labels, RenderContext &context,
+                     const SliceCacheLocation &cache_location, const ShardUnit *unit) {
+  std::vector<std::exception_ptr> errors = render_variables(dataFile, {&job}, time_labels, context, cache_location, unit);
+  if (errors[0]) {
+    std::rethrow_exception(errors[0]);
+  }
+}
+
+static RenderOptions resolve_thread_defaults(const RenderOptions &options) {
+  RenderOptions resolved = options;
+  size_t n_cores = std::max(1u, std::thread::hardware_concurrency());
+  if (resolved.encode_threads == 0) {
+    resolved.encode_threads = n_cores;
+  }
+  resolved.colorize_threads = std::max<size_t>(resolved.colorize_threads, 1);
+  if (resolved.frame_queue_depth == 0) {
+    resolved.frame_queue_depth = 2 * resolved.encode_threads;
+  }
+  return resolved;
+}
+
+// The same workers serve the colorize and encode stages of every variable
+RenderContext::RenderContext(const RenderOptions &options)
+    : options(resolve_thread_defaults(options)),
+      pool(static_cast<int>(this->options.colorize_threads + this->options.encode_threads)),
+      colormaps(this->options.palettes) {}
+
+bool create_images(const std::string &filename, const std::vector<VariableJob> &jobs, const RenderOptions &options) {
+  RenderContext context(options);
+  return create_images(filename, jobs, context);
+}
+
+// Jobs that read a stored variable in common, as their field or their arrows,
+// each group in the order of its first job
+static std::vector<std::vector<const VariableJob *>> group_jobs(const std::vector<VariableJob> &jobs) {
+  auto reads = [](const VariableJob &job, const std::string &variable) {
+    return job.variable_name == variable || job.derived.arrow_variable == variable;
+  };
+  auto shares_input = [&](const VariableJob &a, const VariableJob &b) {
+    return reads(b, a.variable_name) || (!a.derived.arrow_variable.empty() && reads(b, a.derived.arrow_variable));
+  };
+  std::vector<size_t> group_of(jobs.size());
+  for (size_t i = 0; i < jobs.size(); i++) {
+    group_of[i] = i;
+    for (size_t j = 0; j < i; j++) {
+      if (group_of[j] != group_of[i] && shares_input(jobs[i], jobs[j])) {
+        size_t from = std::max(group_of[i], group_of[j]);
+        size_t to = std::min(group_of[i], group_of[j]);
+        std::replace(group_of.begin(), group_of.begin() + i + 1, from, to);
+      }
+    }
+  }
+  std::vector<std::vector<const VariableJob *>> groups;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (group_of[i] == i) {
+      groups.emplace_back();
+      for (size_t j = i; j < jobs.size(); j++) {
+        if (group_of[j] == i) {
+          groups.back().push_back(&jobs[j]);
+        }
+      }
+    }
+  }
+  return groups;
+}
+
+bool create_images(const std::string &filename, const std::vector<VariableJob> &jobs, RenderContext &context) {
+  bool ok = true;
+  try {
+    // Open the file and parse its metadata once for the whole batch
+    auto open_start = std::chrono::steady_clock::now();
+    NcFile dataFile(filename, NcFile::read);
+    size_t nTime = dataFile.getVar("time").getDim(0).getSize();
+    std::vector<std::string> time_labels = load_time_labels(dataFile, nTime);
+    context.metrics.add_time("open", "", std::chrono::duration<double>(std::chrono::steady_clock::now() - open_start).count());
+    const SliceCacheLocation cache_location = context.options.slice_cache ? slice_cache_location(filename) : SliceCacheLocation{};
+
+    for (const std::vector<const VariableJob *> &group : group_jobs(jobs)) {
+      if (context.cancel && *context.cancel) {
+        break;
+      }
+      auto start_time = std::chrono::high_resolution_clock::now();
+      std::vector<std::exception_ptr> errors;
+      try {
+        errors = render_variables(dataFile, group, time_labels, context, cache_location);
+      } catch (...) {
+        errors.assign(group.size(), std::current_exception());
+      }
+      for (size_t k = 0; k < group.size(); k++) {
+        if (!errors[k]) {
+          continue;
+        }
+        ok = false;
+        try {
+          std::rethrow_exception(errors[k]);
+        } catch (const std::exception &e) {
+          std::cerr << "Error: " << group[k]->variable_alias << ": " << e.what() << std::endl;
+        } catch (...) {
+          std::cerr << "Error: " << group[k]->variable_alias << ": unknown error" << std::endl;
+        }
+      }
+      auto end_time = std::chrono::high_resolution_clock::now();
+      auto duration = std::chrono::duration<double>(end_time - start_time).count();
+      context.metrics.add_time("variable", group_label(group), duration);
+      std::cout << std::fixed << std::setprecision(3) << "Execution time: " << duration << " s" << std::endl;
+    }
   } catch (const NcException &e) {
     std::cerr << "Error: " << e.what() << std::endl;
+    ok = false;
   }
+  return ok;
 }
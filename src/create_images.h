@@ -1,10 +1,12 @@
 #pragma once
 
+#include <algorithm>
 #include <regex>
 #include <string>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
+#include <stdexcept>
 #include <netcdf>
 #include <vector>
 #include <cstdlib>
@@ -13,47 +15,168 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 #include <filesystem>
+#include <chrono>
+#include <ctime>
+#include <map>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "external_h/CTPL/ctpl_stl.h"
+#include "pipeline.h"
+#include "colorize.h"
+#include "colormaps.h"
+#include "gif_encoder.h"
+#include "png_encoder.h"
+#include "render_manifest.h"
+#include "range_policy.h"
+#include "netcdf_reader.h"
+#include "derived_fields.h"
+#include "tiles.h"
+#include "metrics.h"
+#include "frame_pool.h"
+#include "shard_result.h"
 
 using namespace cv;
 using namespace netCDF;
 using namespace netCDF::exceptions;
 
-double lerp(double v0, double v1, double t);
+// One variable of a batch render: the NetCDF variable to read, the alias used
+// for colormaps, range policies and file names, and the folder its frames are
+// written to.
+struct VariableJob {
+  std::string variable_name;
+  std::string variable_alias;
+  std::string output_folder;
+  // How the rendered field is derived from variable_name, the stored values by default
+  DerivedField derived;
+};
+
+// The stored variables that can be rendered, NetCDF variable name by alias
+const std::map<std::string, std::string>& variable_aliases();
+
+// File format of the per time step frames. png and gif are written with the
+// colormap as their palette straight from the 8-bit indices, jpg is RGB.
+enum class FrameFormat { jpg, png, gif };
+
+// Part of the grid to render, --bbox and --stride. The box is given as
+// x_min y_min x_max y_max, either in grid indices (inclusive) or, when
+// projected, in the units of the file's x and y coordinate variables. Unset
+// means the whole grid. Every stride-th row and column of the box is read.
+struct GridRegion {
+  bool set = false;
+  bool projected = false;
+  double x_min = 0.0;
+  double y_min = 0.0;
+  double x_max = 0.0;
+  double y_max = 0.0;
+  size_t stride = 1;
+};
+
+// Settings shared by every variable of a render run.
+struct RenderOptions {
+  // Upper bound on the variable data kept in memory, 0 keeps whole variables resident
+  size_t memory_limit_bytes = 0;
+  // Output frames are this fraction of the grid size in each direction
+  double scale_factor = 0.5;
+  FrameFormat frame_format = FrameFormat::jpg;
+  // Write an animated GIF of all frames next to them, delay in 1/100 s
+  bool write_gif = true;
+  int gif_delay = 10;
+  // Workers per pipeline stage, 0 encode threads means one per core
+  size_t colorize_threads = 1;
+  size_t encode_threads = 0;
+  // Capacity of the queues between the reader, colorize and encode stages,
+  // 0 frame queue depth means two frames per encode thread
+  size_t slice_queue_depth = 4;
+  size_t frame_queue_depth = 0;
+  // Also write each time step as a pyramid of tiles this many pixels square
+  // under <output_folder>/<variable>/tiles/<time>/<z>/<x>/<y>.png (the job's
+  // output folder, then tiles/...), 0 for none
+  int tile_size = 0;
+  // Region of interest, read as a hyperslab so the rest of the grid is never decompressed
+  GridRegion region;
+  // Keep every variable read as uncompressed slices in <input>.slices and map
+  // them on later runs over the same file, whatever the style
+  bool slice_cache = false;
+  // Draw a progress bar per variable, off for logs
+  bool show_progress = true;
+  // Skip frames the output folder's render manifest shows are already up to date
+  bool incremental = true;
+  // How each variable's colour range is chosen, by alias
+  std::map<std::string, RangePolicy> range_policies = default_range_policies();
+  // Palettes from --colormaps, by alias or palette name, over the built-ins
+  std::map<std::string, std::vector<ColorStop>> palettes;
+  // Entries of the LUT jpg frames are looked up in when they are colorized
+  // straight from the field; palette indices always use 256
+  int colormap_size = 256;
+};
+
+// Everything that can be reused from one render run to the next: the options
+// with thread defaults resolved, the worker pool, frame buffers and the
+// colormap tables. A long-running process keeps one so later runs start with
+// warm workers.
+struct RenderContext {
+  explicit RenderContext(const RenderOptions& options);
+
+  RenderOptions options;
+  // Frame buffers, reused across time steps, variables and runs; declared
+  // ahead of the workers so it outlives any frame they still hold
+  FramePool frame_pool;
+  ctpl::thread_pool pool;
+  // LUTs by palette and size, baked once
+  ColormapRegistry colormaps;
+  // When set, variables that have not started yet are skipped once it turns true
+  const std::atomic<bool>* cancel = nullptr;
+  // Stage timings and counters of every run made with this context
+  Metrics metrics;
+};
+
+// A time step read from the file and waiting to be colorized. hold keeps the
+// streaming block the slice points into checked out until it is released.
+struct SliceTask {
+  size_t t;
+  const float* slice;
+  std::shared_ptr<void> hold;
+  // Which field of the group being rendered
+  size_t field = 0;
+};
+
+// A frame at output size waiting to be written: BGR for jpg, palette indices
+// otherwise. record goes into the render manifest once the file is written.
+struct FrameTask {
+  size_t t;
+  Mat img;
+  FrameRecord record;
+  size_t field = 0;
+};
+
 void print_progress(unsigned long current, unsigned long total, int bar_width);
-std::vector<std::vector<int>> generate_colormap(const std::vector<std::vector<double>>& data, int num_colors);
-std::pair<float, float> get_variable_range(const netCDF::NcVar& variable, unsigned long start, unsigned long count, unsigned long stride, float min_threshold, float max_threshold);
-void create_gif(const std::string& input_filename, const std::string& output_filename, int delay);
-void create_images(const std::string& input_filename, const std::string& variable_name, const std::string& output_dir, const std::string& output_format);
+std::vector<float> load_variable_data(FieldReader &reader, size_t nTime, size_t nLat, size_t nLon);
+std::pair<float, float> get_slice_range(const float* slice, size_t size, float min_threshold, float max_threshold);
+std::pair<float, float> combine_ranges(const std::vector<std::pair<float, float>>& slice_ranges, float min_threshold, float max_threshold);
+std::pair<float, float> get_variable_range_streaming(FieldReader &reader, size_t nTime, size_t nLat, size_t nLon, std::vector<float>& buffer, size_t block_steps, float min_threshold, float max_threshold);
+// data is the resident cube, or null to stream the variable through buffer
+std::pair<float, float> get_variable_percentile_range(FieldReader &reader, const float* data, size_t nTime, size_t nLat, size_t nLon, std::vector<float>& buffer, size_t block_steps, const RangePolicy &policy);
+std::pair<float, float> get_variable_range(const float* data, size_t nTime, size_t nLat, size_t nLon, float min_threshold, float max_threshold);
+// Both return false when the file could not be read or a variable failed
+bool create_images(const std::string& input_filename, const std::vector<VariableJob>& jobs, const RenderOptions& options);
+bool create_images(const std::string& input_filename, const std::vector<VariableJob>& jobs, RenderContext& context);
+const char* frame_extension(FrameFormat format);
+std::vector<std::string> load_time_labels(const NcFile &dataFile, size_t nTime);
+// Renders jobs that read the same stored variables together, every stored
+// slice read once for all of them; the error each job failed with, if any.
+// With a shard unit only its time steps are drawn, see ShardUnit
+std::vector<std::exception_ptr> render_variables(NcFile &dataFile, const std::vector<const VariableJob*> &jobs, const std::vector<std::string> &time_labels,
+                                                 RenderContext &context, const SliceCacheLocation &cache_location = {}, const ShardUnit *unit = nullptr);
+// A single job, throwing what it failed with
+void render_variable(NcFile &dataFile, const VariableJob &job, const std::vector<std::string> &time_labels, RenderContext &context,
+                     const SliceCacheLocation &cache_location = {}, const ShardUnit *unit = nullptr);
 std::tuple<NcVar, size_t, size_t, size_t> load_netcdf_variable(NcFile &dataFile, const std::string &variable_name);
-std::vector<std::vector<int>> load_colormap(const std::vector<std::vector<double>> &base_colormap, int size);
-Mat create_image_for_time_step(const NcVar &var, size_t t, size_t nLat, size_t nLon, const std::vector<std::vector<int>> &colormap, float minVar, float maxVar);
-std::vector<std::vector<int>> get_base_colormap(const std::string& variable_alias);
-
-class ImageFillParallel : public cv::ParallelLoopBody {
-public:
-  ImageFillParallel(const std::vector<float>& tempSlice, const std::vector<std::vector<int>>& colormap,
-                    float minVar, float maxVar, cv::Mat& img, size_t nLat, size_t nLon)
-      : tempSlice_(tempSlice), colormap_(colormap), minVar_(minVar), maxVar_(maxVar), img_(img), nLat_(nLat), nLon_(nLon) {}
-
-  virtual void operator()(const cv::Range& range) const {
-    float normFactor = 1.0f / (maxVar_ - minVar_);
-    for (int y = range.start; y < range.end; y++) {
-      for (size_t x = 0; x < nLon_; x++) {
-        float normValue = (tempSlice_[y * nLon_ + x] - minVar_) * normFactor;
-        int colorIndex = static_cast<int>(std::round(normValue * (colormap_.size() - 1)));
-        colorIndex = std::clamp(colorIndex, 0, static_cast<int>(colormap_.size() - 1));
-        cv::Vec3b color(colormap_[colorIndex][2], colormap_[colorIndex][1], colormap_[colorIndex][0]);
-        img_.at<cv::Vec3b>(nLat_ - y - 1, x) = color;
-      }
-    }
-  }
-
-private:
-  const std::vector<float>& tempSlice_;
-  const std::vector<std::vector<int>>& colormap_;
-  float minVar_;
-  float maxVar_;
-  cv::Mat& img_;
-  size_t nLat_;
-  size_t nLon_;
-};
\ No newline at end of file
+// Throws std::invalid_argument when the region holds no grid point; projected
+// regions are looked up in the coordinate variables of var's grid dimensions
+GridWindow resolve_region(const NcFile &dataFile, const NcVar &var, const GridRegion &region, size_t nLat, size_t nLon);
+const ColorLUT& cached_colormap(RenderContext &context, const std::string& variable_alias, int size);
+Mat create_image_for_time_step(const float* slice, size_t nLat, size_t nLon, const ColorLUT &colormap, float minVar, float maxVar, double scale_factor);
@@ -0,0 +1,251 @@
+#include "derived_fields.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <opencv2/imgproc.hpp>
+
+using namespace netCDF;
+
+// Time steps in a period, from the spacing of the first two times in the file
+static size_t steps_for(const NcFile& file, size_t nTime, double seconds) {
+  if (nTime < 2) {
+    return 1;
+  }
+  std::vector<double> times(2);
+  file.getVar("time").getVar({0}, {2}, times.data());
+  double step = times[1] - times[0];
+  if (step <= 0.0) {
+    return 1;
+  }
+  return std::max<size_t>(1, static_cast<size_t>(std::lround(seconds / step)));
+}
+
+FieldReader::FieldReader(const NcFile& file, const NcVar& var, const DerivedField& field, size_t nTime, const GridWindow& window,
+                         const SliceCacheLocation& cache_location)
+    : input_(var, nTime, window), field_(field), nTime_(nTime), slice_size_(window.rows() * window.cols()), window_(window) {
+  if (cache_location.enabled()) {
+    cache_ = SliceCache::open(cache_location, var.getName(), nTime, window);
+  }
+  if (field_.op == DerivedOp::difference) {
+    lag_steps_ = steps_for(file, nTime, field_.lag_seconds);
+    history_.resize(lag_steps_ * slice_size_);
+  }
+  if (!field_.arrow_variable.empty()) {
+    // One sample in the middle of every arrow_spacing x arrow_spacing cell of
+    // the window, on its rows and columns so they can be taken from a block of it
+    arrow_spacing_ = static_cast<size_t>(std::max(field_.arrow_spacing, 1));
+    arrow_row0_ = std::min(arrow_spacing_ / 2, window.rows() - 1);
+    arrow_col0_ = std::min(arrow_spacing_ / 2, window.cols() - 1);
+    arrow_window_ = window;
+    arrow_window_.stride = arrow_spacing_ * window.stride;
+    arrow_window_.y0 = window.y0 + arrow_row0_ * window.stride;
+    arrow_window_.x0 = window.x0 + arrow_col0_ * window.stride;
+    arrow_window_.ny = window.ny - arrow_row0_ * window.stride;
+    arrow_window_.nx = window.nx - arrow_col0_ * window.stride;
+    arrow_reader_ = std::make_unique<VariableReader>(file.getVar(field_.arrow_variable), nTime, arrow_window_, false);
+    arrows_.assign(nTime * arrow_size(), NAN);
+  }
+}
+
+// Makes the history hold the stored slices of [t0 - lag, t0), reading them
+// again unless the last read ended at t0
+void FieldReader::fill_history(size_t t0) {
+  if (t0 == history_end_ && t0 > 0) {
+    return;
+  }
+  for (size_t t = t0 >= lag_steps_ ? t0 - lag_steps_ : 0; t < t0; t++) {
+    read_stored(t, 1, history_.data() + (t % lag_steps_) * slice_size_);
+  }
+  history_end_ = t0;
+}
+
+void FieldReader::read_stored(size_t t0, size_t nt, float* dst) {
+  if (cache_ && cache_->complete()) {
+    std::copy(cache_->data() + t0 * slice_size_, cache_->data() + (t0 + nt) * slice_size_, dst);
+    cache_bytes_read_ += nt * slice_size_ * sizeof(float);
+    return;
+  }
+  input_.read(t0, nt, dst);
+  if (cache_) {
+    cache_->store(t0, nt, dst);
+  }
+}
+
+const float* FieldReader::cached_field() const {
+  return field_.op == DerivedOp::value && cache_complete() ? cache_->data() : nullptr;
+}
+
+void FieldReader::read(size_t t0, size_t nt, float* dst) {
+  read_stored(t0, nt, dst);
+  derive(t0, nt, dst);
+}
+
+void FieldReader::derive(size_t t0, size_t nt, float* dst) {
+  if (field_.op != DerivedOp::difference) {
+    return;
+  }
+  fill_history(t0);
+
+  // The stored slices of the block's last lag steps become the next history,
+  // keep them before the block is overwritten. A block that ends the file has
+  // no next read to keep them for, which spares the copy when the whole
+  // variable is read in one block.
+  const bool keep_tail = t0 + nt < nTime_;
+  size_t tail_start = t0 + nt > lag_steps_ ? std::max(t0, t0 + nt - lag_steps_) : t0;
+  if (keep_tail) {
+    tail_.assign(dst + (tail_start - t0) * slice_size_, dst + nt * slice_size_);
+  }
+
+  // From the last step back, so the earlier stored slices of the block are still intact when needed.
+  // Fill values come out of the reader as NaN, so a difference with either end missing stays NaN.
+  const float scale = static_cast<float>(field_.scale);
+  for (size_t t = t0 + nt; t-- > t0;) {
+    float* out = dst + (t - t0) * slice_size_;
+    if (t < lag_steps_) {
+      std::fill(out, out + slice_size_, NAN);
+      continue;
+    }
+    size_t prev_t = t - lag_steps_;
+    const float* prev = prev_t >= t0 ? dst + (prev_t - t0) * slice_size_ : history_.data() + (prev_t % lag_steps_) * slice_size_;
+    for (size_t i = 0; i < slice_size_; i++) {
+      out[i] = (out[i] - prev[i]) * scale;
+    }
+  }
+
+  if (!keep_tail) {
+    // The history still holds the steps before this block, a read after this one fills it again
+    history_end_ = 0;
+    return;
+  }
+  for (size_t t = tail_start; t < t0 + nt; t++) {
+    std::copy(tail_.data() + (t - tail_start) * slice_size_, tail_.data() + (t - tail_start + 1) * slice_size_,
+              history_.data() + (t % lag_steps_) * slice_size_);
+  }
+  history_end_ = t0 + nt;
+}
+
+void FieldReader::read_arrows(size_t t0, size_t nt) {
+  if (arrow_reader_) {
+    arrow_reader_->read(t0, nt, arrows_.data() + t0 * arrow_size());
+  }
+}
+
+void FieldReader::sample_arrows(size_t t0, size_t nt, const float* directions) {
+  const size_t rows = arrow_window_.rows();
+  const size_t cols = arrow_window_.cols();
+  const size_t window_cols = window_.cols();
+  for (size_t t = t0; t < t0 + nt; t++) {
+    const float* slice = directions + (t - t0) * slice_size_;
+    float* out = arrows_.data() + t * arrow_size();
+    for (size_t r = 0; r < rows; r++) {
+      const float* row = slice + (arrow_row0_ + r * arrow_spacing_) * window_cols + arrow_col0_;
+      for (size_t c = 0; c < cols; c++) {
+        out[r * cols + c] = row[c * arrow_spacing_];
+      }
+    }
+  }
+}
+
+FieldSet::FieldSet(const NcFile& file, const std::vector<FieldSpec>& fields, size_t nTime, const GridWindow& window,
+                   const SliceCacheLocation& cache_location) {
+  for (size_t i = 0; i < fields.size(); i++) {
+    size_t source = i;
+    for (size_t j = 0; j < i; j++) {
+      if (fields[j].variable == fields[i].variable) {
+        source = j;
+        break;
+      }
+    }
+    source_.push_back(source);
+    // A second cache of the same variable would be built from reads that never happen
+    readers_.push_back(std::make_unique<FieldReader>(file, file.getVar(fields[i].variable), fields[i].derived, nTime, window,
+                                                     source == i ? cache_location : SliceCacheLocation{}));
+  }
+  for (const FieldSpec& field : fields) {
+    size_t arrow_source = SIZE_MAX;
+    for (size_t j = 0; j < fields.size() && !field.derived.arrow_variable.empty(); j++) {
+      if (fields[j].variable == field.derived.arrow_variable) {
+        arrow_source = source_[j];
+        break;
+      }
+    }
+    arrow_source_.push_back(arrow_source);
+  }
+}
+
+size_t FieldSet::history_bytes() const {
+  size_t bytes = 0;
+  for (const auto& reader : readers_) {
+    bytes += reader->history_bytes();
+  }
+  return bytes;
+}
+
+void FieldSet::read(size_t t0, size_t nt, const std::vector<float*>& dst) {
+  const size_t n = nt * readers_[0]->input().window().rows() * readers_[0]->input().window().cols();
+  // Every stored variable once, then copied to the other fields made from it
+  // before any field is derived in place
+  for (size_t i = 0; i < readers_.size(); i++) {
+    if (source_[i] == i) {
+      readers_[i]->read_stored(t0, nt, dst[i]);
+    }
+  }
+  for (size_t i = 0; i < readers_.size(); i++) {
+    if (source_[i] != i) {
+      std::copy(dst[source_[i]], dst[source_[i]] + n, dst[i]);
+    }
+    if (readers_[i]->has_arrows()) {
+      if (arrow_source_[i] != SIZE_MAX) {
+        readers_[i]->sample_arrows(t0, nt, dst[arrow_source_[i]]);
+      } else {
+        readers_[i]->read_arrows(t0, nt);
+      }
+    }
+  }
+  for (size_t i = 0; i < readers_.size(); i++) {
+    readers_[i]->derive(t0, nt, dst[i]);
+  }
+}
+
+void draw_arrows(cv::Mat& img, const float* directions, const GridWindow& arrow_window, const GridWindow& window,
+                 double scale_factor, const ColorLUT& lut) {
+  // Darkest entry of the LUT, so the arrows stand out from most of the field
+  int darkest = 0;
+  int darkest_sum = 3 * 255 + 1;
+  for (int i = 0; i < lut.size; i++) {
+    int sum = lut.bgr[3 * i] + lut.bgr[3 * i + 1] + lut.bgr[3 * i + 2];
+    if (sum < darkest_sum) {
+      darkest_sum = sum;
+      darkest = i;
+    }
+  }
+  // Index frames are drawn without anti-aliasing, blended indices would be other colours
+  cv::Scalar colour = img.channels() == 1 ? cv::Scalar(darkest)
+                                          : cv::Scalar(lut.bgr[3 * darkest], lut.bgr[3 * darkest + 1], lut.bgr[3 * darkest + 2]);
+
+  // Frame pixels per grid point of the window, and from the window's top (north) row
+  const double px = scale_factor / window.stride;
+  const double length = 0.8 * arrow_window.stride * px;
+  const int thickness = std::max(1, static_cast<int>(length / 16));
+  const size_t rows = arrow_window.rows();
+  const size_t cols = arrow_window.cols();
+  for (size_t r = 0; r < rows; r++) {
+    for (size_t c = 0; c < cols; c++) {
+      float direction = directions[r * cols + c];
+      if (std::isnan(direction)) {
+        continue;
+      }
+      double gx = static_cast<double>(arrow_window.x0 - window.x0 + c * arrow_window.stride);
+      double gy = static_cast<double>(arrow_window.y0 - window.y0 + r * arrow_window.stride);
+      double x = (gx + 0.5) * px;
+      double y = (window.ny - gy - 0.5) * px;
+      // The wind blows towards direction + 180 degrees; image y grows southwards
+      double a = direction * M_PI / 180.0;
+      double dx = -std::sin(a) * length / 2;
+      double dy = std::cos(a) * length / 2;
+      cv::arrowedLine(img, cv::Point(static_cast<int>(x - dx), static_cast<int>(y - dy)),
+                      cv::Point(static_cast<int>(x + dx), static_cast<int>(y + dy)), colour, thickness, img.channels() == 1 ? cv::LINE_8 : cv::LINE_AA, 0, 0.3);
+    }
+  }
+}
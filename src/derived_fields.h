@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <netcdf>
+#include <opencv2/core.hpp>
+#include "colorize.h"
+#include "netcdf_reader.h"
+#include "slice_cache.h"
+
+// How the field a job renders is made from its stored variable
+enum class DerivedOp {
+  // The stored values as they are
+  value,
+  // (value[t] - value[t - lag]) * scale: amounts per interval from
+  // accumulations, or the change over a period. NaN for the first lag steps.
+  difference,
+};
+
+struct DerivedField {
+  DerivedOp op = DerivedOp::value;
+  // Period of a difference, turned into time steps with the file's step length
+  double lag_seconds = 3600.0;
+  double scale = 1.0;
+  // Wind direction variable (degrees the wind blows from, clockwise from grid
+  // north) to draw arrows of over the frame, empty for none
+  std::string arrow_variable;
+  // Grid points between arrows along each axis
+  int arrow_spacing = 48;
+  // Alias whose colormap is used, empty for the job's own
+  std::string colormap;
+};
+
+// Reads a job's field for blocks of time steps, deriving it on the way. Every
+// stored slice is read once per pass over the time steps: the slices a
+// difference needs from before a block are kept from the previous read, and
+// only fetched again when a read does not follow on from the last one. With a
+// slice cache location the stored slices come from, or go into, the
+// variable's slice cache instead of being decompressed every run. The
+// arrow directions are read separately, subsampled by the reader, and only
+// when asked for. Like the VariableReader it wraps, it must only be used from
+// one thread.
+class FieldReader {
+public:
+  FieldReader(const netCDF::NcFile& file, const netCDF::NcVar& var, const DerivedField& field, size_t nTime,
+              const GridWindow& window, const SliceCacheLocation& cache_location = {});
+
+  const VariableReader& input() const { return input_; }
+  size_t aligned_block_steps(size_t max_steps) const { return input_.aligned_block_steps(max_steps); }
+  // Time steps a difference looks back, 0 for plain values
+  size_t lag_steps() const { return lag_steps_; }
+  // Memory kept between reads for the difference: the history, and the copy
+  // of a block's last slices it is refilled from
+  size_t history_bytes() const { return (history_.size() + tail_.capacity()) * sizeof(float); }
+  // Reads the field for time steps [t0, t0 + nt) into dst, nt * rows() * cols() floats
+  void read(size_t t0, size_t nt, float* dst);
+  // The two halves of read(): the stored values into dst, from the cache when
+  // it is complete, otherwise from the file and into the cache; then the field
+  // derived from them in place
+  void read_stored(size_t t0, size_t nt, float* dst);
+  void derive(size_t t0, size_t nt, float* dst);
+  // The whole field, mapped from a complete slice cache, when it needs no
+  // deriving; nullptr otherwise
+  const float* cached_field() const;
+  bool cache_complete() const { return cache_ && cache_->complete(); }
+  // Bytes copied out of the slice cache rather than read from the file
+  size_t cache_bytes_read() const { return cache_bytes_read_; }
+
+  bool has_arrows() const { return arrow_reader_ != nullptr; }
+  // Reads the arrow directions of [t0, t0 + nt), for arrow_directions() to hand out
+  void read_arrows(size_t t0, size_t nt);
+  // Takes them from a block of the arrow variable over the field's window instead
+  void sample_arrows(size_t t0, size_t nt, const float* directions);
+  // Directions on the arrow grid (arrow_rows() x arrow_cols(), south to north)
+  // of a time step read by read_arrows(); may be used from any thread once
+  // read_arrows() has returned
+  const float* arrow_directions(size_t t) const { return arrows_.data() + t * arrow_size(); }
+  const GridWindow& arrow_window() const { return arrow_window_; }
+
+private:
+  size_t arrow_size() const { return arrow_window_.rows() * arrow_window_.cols(); }
+  void fill_history(size_t t0);
+
+  VariableReader input_;
+  std::unique_ptr<SliceCache> cache_;
+  size_t cache_bytes_read_ = 0;
+  DerivedField field_;
+  size_t nTime_;
+  size_t slice_size_;
+  size_t lag_steps_ = 0;
+  // Stored slices of the lag_steps_ time steps before history_end_, time step t in slot t % lag_steps_
+  std::vector<float> history_;
+  // The stored slices of the last read's final lag steps, until they are moved into the history
+  std::vector<float> tail_;
+  size_t history_end_ = 0;
+  std::unique_ptr<VariableReader> arrow_reader_;
+  GridWindow window_;
+  GridWindow arrow_window_;
+  // Window rows and columns between arrows, and of the first arrow
+  size_t arrow_spacing_ = 0;
+  size_t arrow_row0_ = 0;
+  size_t arrow_col0_ = 0;
+  std::vector<float> arrows_;
+};
+
+// One field of a FieldSet: the stored variable and how it is derived
+struct FieldSpec {
+  std::string variable;
+  DerivedField derived;
+};
+
+// Several fields over the same window read together, block by block: each
+// stored variable is read once per block, from the file or its slice cache,
+// and every field made from it is derived from a copy of that read. Arrows
+// along a stored variable of the set are sampled from its block rather than
+// read again. Only the first field of each stored variable builds and uses its
+// slice cache. Like the FieldReaders it holds, it must only be used from one
+// thread.
+class FieldSet {
+public:
+  FieldSet(const netCDF::NcFile& file, const std::vector<FieldSpec>& fields, size_t nTime, const GridWindow& window,
+           const SliceCacheLocation& cache_location = {});
+
+  size_t size() const { return readers_.size(); }
+  FieldReader& field(size_t i) { return *readers_[i]; }
+  const FieldReader& field(size_t i) const { return *readers_[i]; }
+  // Block sizes line up with the time chunks of the first field's variable
+  size_t aligned_block_steps(size_t max_steps) const { return readers_[0]->aligned_block_steps(max_steps); }
+  size_t history_bytes() const;
+  // Reads time steps [t0, t0 + nt) of every field, field i into dst[i], along
+  // with the arrows of the fields that have them
+  void read(size_t t0, size_t nt, const std::vector<float*>& dst);
+
+private:
+  std::vector<std::unique_ptr<FieldReader>> readers_;
+  // Field whose stored values field i copies, i itself for the ones that read them
+  std::vector<size_t> source_;
+  // Field whose stored values field i's arrows are sampled from, SIZE_MAX when they are read
+  std::vector<size_t> arrow_source_;
+};
+
+// Draws the arrows of one time step on a frame of the field (CV_8UC1 indices
+// or CV_8UC3 BGR) that was scaled by scale_factor from the nLat x nLon window,
+// in the darkest colour of the LUT
+void draw_arrows(cv::Mat& img, const float* directions, const GridWindow& arrow_window, const GridWindow& window,
+                 double scale_factor, const ColorLUT& lut);
@@ -1,21 +1,5 @@
 #include "download.h"
 
-int progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
-    if (dltotal <= 0) {
-        return 0;
-    }
-
-    int progress = static_cast<int>(100.0 * dlnow / dltotal);
-    std::cout << "\rDownloading: " << progress << "%";
-    std::cout.flush();
-
-    if (progress == 100) {
-        std::cout << std::endl;
-    }
-
-    return 0;
-}
-
 time_t get_local_timestamp(const std::string &file_path) {
     struct stat buf;
     if (stat(file_path.c_str(), &buf) == 0) {
@@ -25,82 +9,454 @@ time_t get_local_timestamp(const std::string &file_path) {
 }
 
 
-time_t get_remote_timestamp() {
-    std::string url = "https://thredds.met.no/thredds/dodsC/metpplatest/met_forecast_1_0km_nordic_latest.nc.dds";
-    std::string command = "curl -s -I " + url + " | grep -i 'Last-Modified' | awk '{ print substr($0, index($0,$2)) }'";
-    char buffer[128];
-    std::string result = "";
+// One byte range of the file, written straight to its offset in the partial file
+struct ChunkTransfer {
+    size_t index = 0;
+    size_t offset = 0;
+    size_t length = 0;
+    size_t written = 0;
+    int fd = -1;
+    int retries = 0;
+    CURL *handle = nullptr;
+    // Filled in from the response headers
+    long status = 0;
+    size_t total_size = 0;
+    RemoteValidator remote;
+    char range[64];
+};
+
+size_t write_chunk(char *ptr, size_t size, size_t nmemb, void *userdata) {
+    auto *chunk = static_cast<ChunkTransfer *>(userdata);
+    size_t n = size * nmemb;
+    // More data than was asked for means the range was ignored, abort the transfer
+    if (chunk->written + n > chunk->length) {
+        return 0;
+    }
+    if (pwrite(chunk->fd, ptr, n, chunk->offset + chunk->written) != static_cast<ssize_t>(n)) {
+        return 0;
+    }
+    chunk->written += n;
+    return n;
+}
+
+void trim(std::string &value) {
+    size_t first = value.find_first_not_of(" \t");
+    size_t last = value.find_last_not_of(" \t");
+    value = first == std::string::npos ? std::string() : value.substr(first, last - first + 1);
+}
 
-    FILE *pipe = popen(command.c_str(), "r");
-    if (!pipe) {
-        throw std::runtime_error("Failed to open pipe");
+size_t read_chunk_header(char *buffer, size_t size, size_t nitems, void *userdata) {
+    auto *chunk = static_cast<ChunkTransfer *>(userdata);
+    size_t n = size * nitems;
+    std::string line(buffer, n);
+    while (!line.empty() && (line.back() == '\r' || line.back() == '\n')) {
+        line.pop_back();
     }
 
-    while (fgets(buffer, 128, pipe) != nullptr) {
-        result += buffer;
+    auto header_value = [&line](const char *name) -> const char * {
+        size_t len = strlen(name);
+        if (line.size() > len && strncasecmp(line.c_str(), name, len) == 0) {
+            return line.c_str() + len;
+        }
+        return nullptr;
+    };
+
+    if (line.rfind("HTTP/", 0) == 0) {
+        // New response, e.g. after a redirect: forget the previous headers
+        chunk->status = 0;
+        chunk->total_size = 0;
+        chunk->remote = RemoteValidator();
+        size_t space = line.find(' ');
+        if (space != std::string::npos) {
+            chunk->status = std::strtol(line.c_str() + space + 1, nullptr, 10);
+        }
+    } else if (const char *value = header_value("Content-Range:")) {
+        // bytes <first>-<last>/<total>
+        const char *slash = strchr(value, '/');
+        if (slash) {
+            chunk->total_size = std::strtoull(slash + 1, nullptr, 10);
+        }
+    } else if (const char *value = header_value("Content-Length:")) {
+        if (chunk->status == 200) {
+            chunk->total_size = std::strtoull(value, nullptr, 10);
+        }
+    } else if (const char *value = header_value("ETag:")) {
+        chunk->remote.etag = value;
+        trim(chunk->remote.etag);
+    } else if (const char *value = header_value("Last-Modified:")) {
+        // HTTP dates are always GMT, curl_getdate gives the UTC epoch for them
+        time_t t = curl_getdate(value, nullptr);
+        chunk->remote.last_modified = t > 0 ? t : 0;
+    }
+    if (chunk->status == 200) {
+        // The server sent the whole file instead of a range
+        chunk->offset = 0;
+        chunk->length = SIZE_MAX;
     }
+    return n;
+}
 
-    auto pclose_result = pclose(pipe);
-    if (pclose_result == -1) {
-        throw std::runtime_error("Failed to close pipe");
+CURL *create_chunk_handle(const std::string &url, ChunkTransfer &chunk) {
+    CURL *curl = curl_easy_init();
+    if (!curl) {
+        return nullptr;
     }
+    snprintf(chunk.range, sizeof(chunk.range), "%zu-%zu", chunk.offset, chunk.offset + chunk.length - 1);
+    chunk.written = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_RANGE, chunk.range);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_chunk);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &chunk);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_chunk_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &chunk);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &chunk);
+    // Drop connections that stall instead of waiting on them forever
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+    return curl;
+}
+
+bool chunk_complete(const ChunkTransfer &chunk) {
+    return chunk.status == 206 && chunk.written == chunk.length;
+}
 
-    if (result.empty()) {
-        return -1;
+bool read_download_progress(const std::string &progress_path, DownloadProgress &progress) {
+    std::ifstream file(progress_path);
+    if (!file) {
+        return false;
+    }
+    std::string key;
+    while (file >> key) {
+        if (key == "url") {
+            file >> progress.url;
+        } else if (key == "etag") {
+            std::getline(file, progress.remote.etag);
+            trim(progress.remote.etag);
+        } else if (key == "last_modified") {
+            file >> progress.remote.last_modified;
+        } else if (key == "size") {
+            file >> progress.total_size;
+        } else if (key == "chunk") {
+            file >> progress.chunk_size;
+        } else if (key == "done") {
+            size_t index;
+            if (file >> index) {
+                progress.done.insert(index);
+            }
+        }
     }
+    return progress.total_size > 0 && progress.chunk_size > 0;
+}
 
-    std::tm tm = {};
-    std::istringstream ss(result);
-    ss >> std::get_time(&tm, "%a, %d %b %Y %H:%M:%S %Z");
+// Written to <path>.tmp and renamed over path, like the part file, so a kill
+// halfway through leaves the previous version rather than a truncated one
+void replace_file(const std::string &path, const std::string &contents) {
+    const std::string tmp_path = path + ".tmp";
+    bool written;
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << contents;
+        file.flush();
+        written = static_cast<bool>(file);
+    }
+    std::error_code ec;
+    if (written) {
+        std::filesystem::rename(tmp_path, path, ec);
+    }
+    if (!written || ec) {
+        std::cerr << "Error: Could not write " << path << std::endl;
+        std::filesystem::remove(tmp_path, ec);
+    }
+}
 
-    if (ss.fail()) {
-        return -1;
+void write_download_progress(const std::string &progress_path, const DownloadProgress &progress) {
+    std::ostringstream text;
+    text << "url " << progress.url << "\n";
+    text << "etag " << progress.remote.etag << "\n";
+    text << "last_modified " << progress.remote.last_modified << "\n";
+    text << "size " << progress.total_size << "\n";
+    text << "chunk " << progress.chunk_size << "\n";
+    for (size_t index : progress.done) {
+        text << "done " << index << "\n";
     }
+    replace_file(progress_path, text.str());
+}
 
-    return std::mktime(&tm);
+void append_chunk_done(const std::string &progress_path, size_t index) {
+    std::ofstream file(progress_path, std::ios::app);
+    file << "done " << index << "\n";
 }
 
-size_t write_data(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-    size_t written = fwrite(ptr, size, nmemb, stream);
-    return written;
+void print_download_progress(size_t done_bytes, size_t total_bytes) {
+    int progress = static_cast<int>(100.0 * done_bytes / total_bytes);
+    std::cout << "\rDownloading: " << progress << "%";
+    std::cout.flush();
 }
 
-bool download_file(const std::string &output_path) {
-    CURL *curl;
-    CURLcode res;
-    curl = curl_easy_init();
-    std::string url = "https://thredds.met.no/thredds/fileServer/metpplatest/met_forecast_1_0km_nordic_latest.nc";
-    std::cout << "Downloading file" << std::endl;
+DownloadResult download_file(const std::string &output_path, const DownloadOptions &options, const RemoteValidator *condition) {
+    // Chunks go into <output>.part at their offsets, finished chunks are listed in
+    // <output>.progress. The part file only replaces the output once it is complete.
+    const std::string part_path = output_path + ".part";
+    const std::string progress_path = output_path + ".progress";
+
+    DownloadProgress progress;
+    bool resuming = read_download_progress(progress_path, progress) && progress.url == options.url &&
+                    std::filesystem::exists(part_path);
+    if (!resuming) {
+        progress = DownloadProgress();
+        progress.url = options.url;
+        progress.chunk_size = options.chunk_size;
+    }
+
+    int fd = open(part_path.c_str(), O_RDWR | O_CREAT | (resuming ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Could not open " << part_path << std::endl;
+        return DownloadResult::failed;
+    }
+
+    size_t n_chunks = (progress.total_size + progress.chunk_size - 1) / progress.chunk_size;
+    if (resuming && progress.done.size() == n_chunks) {
+        // Every chunk arrived last time, only the rename was missing. The chunks
+        // may still be in the page cache of a run that crashed, so they go to
+        // disk first, as on the normal path.
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        if (!synced) {
+            std::cerr << "Error: Could not sync " << part_path << std::endl;
+            return DownloadResult::failed;
+        }
+        std::error_code ec;
+        std::filesystem::rename(part_path, output_path, ec);
+        if (ec) {
+            std::cerr << "Error: Could not move " << part_path << " into place: " << ec.message() << std::endl;
+            return DownloadResult::failed;
+        }
+        std::filesystem::remove(progress_path, ec);
+        write_validator_cache(output_path, progress.remote);
+        return DownloadResult::downloaded;
+    }
+
+    // The first request fetches one missing chunk and tells us the size and
+    // version of the remote file, the rest are planned from that
+    size_t first = 0;
+    while (resuming && progress.done.count(first)) {
+        first++;
+    }
+    ChunkTransfer probe;
+    probe.index = first;
+    probe.offset = first * progress.chunk_size;
+    probe.length = progress.chunk_size;
+    probe.fd = fd;
+    CURL *curl = create_chunk_handle(options.url, probe);
+    struct curl_slist *headers = nullptr;
+    if (curl && condition && !resuming) {
+        // A resumed download is already known to be newer, otherwise let the
+        // server answer 304 instead of sending data we already have
+        if (!condition->etag.empty()) {
+            headers = curl_slist_append(headers, ("If-None-Match: " + condition->etag).c_str());
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        } else if (condition->last_modified > 0) {
+            curl_easy_setopt(curl, CURLOPT_TIMECONDITION, static_cast<long>(CURL_TIMECOND_IFMODSINCE));
+            curl_easy_setopt(curl, CURLOPT_TIMEVALUE_LARGE, static_cast<curl_off_t>(condition->last_modified));
+        }
+    }
+    CURLcode res = curl ? curl_easy_perform(curl) : CURLE_FAILED_INIT;
+    long unmet = 0;
     if (curl) {
-        FILE *fp;
-        fp = fopen(output_path.c_str(), "wb");
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
-
-        res = curl_easy_perform(curl);
+        // Also set when the server ignores the condition and curl drops an old body itself
+        curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &unmet);
         curl_easy_cleanup(curl);
-        fclose(fp);
+    }
+    curl_slist_free_all(headers);
+    if (res != CURLE_OK) {
+        std::cerr << "Error: Download failed: " << curl_easy_strerror(res) << std::endl;
+        close(fd);
+        return DownloadResult::failed;
+    }
+    if (probe.status == 304 || unmet) {
+        close(fd);
+        std::error_code ec;
+        std::filesystem::remove(part_path, ec);
+        return DownloadResult::not_modified;
+    }
+    std::cout << "Downloading file" << std::endl;
 
-        if (res != CURLE_OK) {
-            return false;
+    bool complete = false;
+    if (probe.status == 200) {
+        // No range support, the whole file came in this one response
+        complete = (probe.total_size == 0 || probe.written == probe.total_size) && ftruncate(fd, probe.written) == 0;
+        progress.total_size = probe.written;
+        progress.remote = probe.remote;
+    } else if (probe.status == 206 && probe.total_size > 0) {
+        if (resuming && (probe.total_size != progress.total_size || !(probe.remote == progress.remote))) {
+            // The remote file changed since the interrupted download, start over
+            std::cout << "Remote file changed, restarting download" << std::endl;
+            close(fd);
+            std::error_code ec;
+            std::filesystem::remove(progress_path, ec);
+            std::filesystem::remove(part_path, ec);
+            return download_file(output_path, options);
+        }
+        progress.total_size = probe.total_size;
+        progress.remote = probe.remote;
+        if (ftruncate(fd, progress.total_size) != 0) {
+            std::cerr << "Error: Could not size " << part_path << std::endl;
+            close(fd);
+            return DownloadResult::failed;
         }
-        return true;
+        // The last chunk is usually shorter than asked for
+        probe.length = std::min(probe.length, progress.total_size - probe.offset);
+        if (chunk_complete(probe)) {
+            progress.done.insert(probe.index);
+        }
+        write_download_progress(progress_path, progress);
+    } else {
+        std::cerr << "Error: Unexpected HTTP status " << probe.status << std::endl;
+        close(fd);
+        return DownloadResult::failed;
     }
-    return false;
-}
 
-bool download_if_newer(const std::string &output_path) {
-    time_t remote_time = get_remote_timestamp();
-    time_t local_time = get_local_timestamp(output_path);
-    std::cout << "local time: " << local_time <<  " remote time: " << remote_time << std::endl;
+    if (!complete) {
+        n_chunks = (progress.total_size + progress.chunk_size - 1) / progress.chunk_size;
+        std::deque<size_t> pending;
+        size_t done_bytes = 0;
+        for (size_t index = 0; index < n_chunks; index++) {
+            size_t length = std::min(progress.chunk_size, progress.total_size - index * progress.chunk_size);
+            if (progress.done.count(index)) {
+                done_bytes += length;
+            } else {
+                pending.push_back(index);
+            }
+        }
+
+        // Chunks are fetched over several connections, each into its own slot
+        CURLM *multi = curl_multi_init();
+        std::vector<ChunkTransfer> slots(std::max(options.connections, 1));
+        std::vector<ChunkTransfer *> free_slots;
+        for (ChunkTransfer &slot : slots) {
+            free_slots.push_back(&slot);
+        }
+        std::map<size_t, int> retries;
+        bool failed = false;
+        int running = 0;
+        while (!failed && (!pending.empty() || free_slots.size() < slots.size())) {
+            while (!pending.empty() && !free_slots.empty()) {
+                ChunkTransfer *chunk = free_slots.back();
+                free_slots.pop_back();
+                size_t index = pending.front();
+                pending.pop_front();
+                *chunk = ChunkTransfer();
+                chunk->index = index;
+                chunk->offset = index * progress.chunk_size;
+                chunk->length = std::min(progress.chunk_size, progress.total_size - chunk->offset);
+                chunk->fd = fd;
+                chunk->retries = retries[index];
+                CURL *handle = create_chunk_handle(options.url, *chunk);
+                if (!handle) {
+                    failed = true;
+                    break;
+                }
+                chunk->handle = handle;
+                curl_multi_add_handle(multi, handle);
+            }
 
-    if (remote_time > local_time || local_time == 0) {
-        return download_file(output_path);
+            curl_multi_perform(multi, &running);
+            curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+
+            int queued = 0;
+            while (CURLMsg *msg = curl_multi_info_read(multi, &queued)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                ChunkTransfer *chunk = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char **>(&chunk));
+                bool ok = msg->data.result == CURLE_OK && chunk_complete(*chunk) &&
+                          chunk->total_size == progress.total_size && chunk->remote == progress.remote;
+                curl_multi_remove_handle(multi, msg->easy_handle);
+                curl_easy_cleanup(msg->easy_handle);
+                chunk->handle = nullptr;
+
+                if (ok) {
+                    progress.done.insert(chunk->index);
+                    append_chunk_done(progress_path, chunk->index);
+                    done_bytes += chunk->length;
+                } else if (chunk->retries < 3) {
+                    retries[chunk->index] = chunk->retries + 1;
+                    pending.push_back(chunk->index);
+                } else {
+                    std::cerr << std::endl << "Error: Chunk " << chunk->index << " failed after 3 retries" << std::endl;
+                    failed = true;
+                }
+                free_slots.push_back(chunk);
+            }
+            print_download_progress(done_bytes, progress.total_size);
+        }
+        std::cout << std::endl;
+
+        // Abandon whatever is still in flight, finished chunks stay recorded for the next attempt
+        for (ChunkTransfer &slot : slots) {
+            if (slot.handle) {
+                curl_multi_remove_handle(multi, slot.handle);
+                curl_easy_cleanup(slot.handle);
+            }
+        }
+        curl_multi_cleanup(multi);
+        complete = !failed && progress.done.size() == n_chunks;
+    }
+
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    if (!complete || !synced) {
+        return DownloadResult::failed;
+    }
+
+    // Readers either see the old file or the complete new one, never a partial one
+    std::error_code ec;
+    std::filesystem::rename(part_path, output_path, ec);
+    if (ec) {
+        std::cerr << "Error: Could not move " << part_path << " into place: " << ec.message() << std::endl;
+        return DownloadResult::failed;
     }
+    std::filesystem::remove(progress_path, ec);
+    write_validator_cache(output_path, progress.remote);
+    return DownloadResult::downloaded;
+}
+
+bool read_validator_cache(const std::string &output_path, RemoteValidator &remote) {
+    std::ifstream file(output_path + ".validator");
+    if (!file) {
+        return false;
+    }
+    std::string key;
+    while (file >> key) {
+        if (key == "etag") {
+            std::getline(file, remote.etag);
+            trim(remote.etag);
+        } else if (key == "last_modified") {
+            file >> remote.last_modified;
+        }
+    }
+    return !remote.etag.empty() || remote.last_modified > 0;
+}
 
-    return false;
+void write_validator_cache(const std::string &output_path, const RemoteValidator &remote) {
+    std::ostringstream text;
+    text << "etag " << remote.etag << "\n";
+    text << "last_modified " << remote.last_modified << "\n";
+    replace_file(output_path + ".validator", text.str());
 }
 
+DownloadResult download_if_newer(const std::string &output_path, const DownloadOptions &options) {
+    if (!std::filesystem::exists(output_path)) {
+        return download_file(output_path, options);
+    }
+
+    RemoteValidator condition;
+    if (!read_validator_cache(output_path, condition)) {
+        // Downloaded before validators were cached, fall back to the file time.
+        // mtime is a UTC epoch just like the parsed Last-Modified.
+        condition.last_modified = get_local_timestamp(output_path);
+    }
+    return download_file(output_path, options, &condition);
+}
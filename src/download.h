@@ -1,12 +1,57 @@
 #pragma once
 
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <unistd.h>
 #include <curl/curl.h>
 #include <ctime>
 #include <filesystem>
 #include <iostream>
 #include <stdexcept>
 #include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <vector>
 #include <string>
+#include <set>
+#include <sstream>
 
-bool download_if_newer(const std::string &output_path);
+// Where and how the forecast file is fetched.
+struct DownloadOptions {
+    std::string url = "https://thredds.met.no/thredds/fileServer/metpplatest/met_forecast_1_0km_nordic_latest.nc";
+    // Byte ranges fetched concurrently, and the size of each range
+    int connections = 4;
+    size_t chunk_size = 32 * 1024 * 1024;
+};
+
+// Version of the remote file as the server reported it, used to make the next
+// request conditional. Either field may be missing.
+struct RemoteValidator {
+    std::string etag;
+    time_t last_modified = 0;
+
+    bool operator==(const RemoteValidator &other) const = default;
+};
+
+enum class DownloadResult { downloaded, not_modified, failed };
+
+// Sidecar state of an interrupted download, kept next to the partial file so
+// a restart only fetches the chunks that are still missing.
+struct DownloadProgress {
+    std::string url;
+    RemoteValidator remote;
+    size_t total_size = 0;
+    size_t chunk_size = 0;
+    std::set<size_t> done;
+};
+
+// With a condition the first request is sent as a conditional GET and nothing
+// is downloaded if the server still has that version
+DownloadResult download_file(const std::string &output_path, const DownloadOptions &options, const RemoteValidator *condition = nullptr);
+// Validator of the last completed download, kept in <output>.validator
+bool read_validator_cache(const std::string &output_path, RemoteValidator &remote);
+void write_validator_cache(const std::string &output_path, const RemoteValidator &remote);
+DownloadResult download_if_newer(const std::string &output_path, const DownloadOptions &options);
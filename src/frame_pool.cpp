@@ -0,0 +1,86 @@
+#include "frame_pool.h"
+
+FramePool::~FramePool() {
+  for (auto& [size, buffer] : free_) {
+    cv::fastFree(buffer);
+  }
+}
+
+cv::UMatData* FramePool::allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag,
+                                  cv::UMatUsageFlags) const {
+  // Same step layout as OpenCV's default allocator
+  size_t total = CV_ELEM_SIZE(type);
+  for (int i = dims - 1; i >= 0; i--) {
+    if (step) {
+      if (data && step[i] != CV_AUTOSTEP) {
+        total = step[i];
+      } else {
+        step[i] = total;
+      }
+    }
+    total *= sizes[i];
+  }
+
+  cv::UMatData* u = new cv::UMatData(this);
+  u->size = total;
+  if (data) {
+    u->data = u->origdata = static_cast<uchar*>(data);
+    u->flags |= cv::UMatData::USER_ALLOCATED;
+    return u;
+  }
+
+  uint8_t* buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = free_.find(total);
+    if (it != free_.end()) {
+      buffer = it->second;
+      free_.erase(it);
+      cached_bytes_ -= total;
+      reused_++;
+    } else {
+      allocated_++;
+    }
+  }
+  if (!buffer) {
+    buffer = static_cast<uint8_t*>(cv::fastMalloc(total));
+  }
+  u->data = u->origdata = buffer;
+  return u;
+}
+
+bool FramePool::allocate(cv::UMatData* data, cv::AccessFlag, cv::UMatUsageFlags) const {
+  return data != nullptr;
+}
+
+void FramePool::deallocate(cv::UMatData* u) const {
+  if (!u) {
+    return;
+  }
+  if (!(u->flags & cv::UMatData::USER_ALLOCATED) && u->origdata) {
+    uint8_t* buffer = u->origdata;
+    bool keep = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (cached_bytes_ + u->size <= max_cached_bytes_) {
+        free_.emplace(u->size, buffer);
+        cached_bytes_ += u->size;
+        keep = true;
+      }
+    }
+    if (!keep) {
+      cv::fastFree(buffer);
+    }
+  }
+  delete u;
+}
+
+size_t FramePool::reused() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return reused_;
+}
+
+size_t FramePool::allocated() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return allocated_;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <opencv2/core.hpp>
+
+// OpenCV allocator that keeps the pixel buffers of released Mats and hands
+// them out again for the next Mat of the same byte size, so the frames of a
+// render (and of the next variable or daemon cycle, which have the same
+// shape) reuse a handful of buffers instead of going through malloc and
+// fresh page faults every time step. Set it as a Mat's allocator before
+// create(); Mats keep their usual reference counting and the buffer only
+// returns to the pool once the last copy of the Mat is gone. Buffers beyond
+// max_cached_bytes are freed instead of kept. Must outlive every Mat it
+// allocated. Thread safe.
+class FramePool : public cv::MatAllocator {
+public:
+  explicit FramePool(size_t max_cached_bytes = size_t(512) << 20) : max_cached_bytes_(max_cached_bytes) {}
+  ~FramePool() override;
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage) const override;
+  bool allocate(cv::UMatData* data, cv::AccessFlag flags, cv::UMatUsageFlags usage) const override;
+  void deallocate(cv::UMatData* data) const override;
+
+  // Buffers handed out that were taken from the pool, and ones that had to be allocated
+  size_t reused() const;
+  size_t allocated() const;
+
+private:
+  size_t max_cached_bytes_;
+  // Free buffers by size
+  mutable std::multimap<size_t, uint8_t*> free_;
+  mutable size_t cached_bytes_ = 0;
+  mutable size_t reused_ = 0;
+  mutable size_t allocated_ = 0;
+  mutable std::mutex mutex_;
+};
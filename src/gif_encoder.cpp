@@ -0,0 +1,289 @@
+#include "gif_encoder.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+const int kMinCodeSize = 8;
+const int kClearCode = 1 << kMinCodeSize;
+const int kEndCode = kClearCode + 1;
+const int kMaxCodes = 4096;
+// Dictionary slots, a power of two at about twice the number of LZW codes
+const int kTableBits = 13;
+const int kTableSize = 1 << kTableBits;
+
+// Packs variable width codes LSB first into GIF data sub-blocks of at most 255 bytes
+class CodeWriter {
+public:
+  explicit CodeWriter(std::vector<uint8_t>& out) : out_(out) {}
+
+  void write(int code, int size) {
+    bits_ |= static_cast<uint32_t>(code) << n_bits_;
+    n_bits_ += size;
+    while (n_bits_ >= 8) {
+      put(bits_ & 0xff);
+      bits_ >>= 8;
+      n_bits_ -= 8;
+    }
+  }
+
+  void finish() {
+    if (n_bits_ > 0) {
+      put(bits_ & 0xff);
+    }
+    flush_block();
+    out_.push_back(0);
+  }
+
+private:
+  void put(uint8_t byte) {
+    block_[block_len_++] = byte;
+    if (block_len_ == 255) {
+      flush_block();
+    }
+  }
+
+  void flush_block() {
+    if (block_len_ > 0) {
+      out_.push_back(static_cast<uint8_t>(block_len_));
+      out_.insert(out_.end(), block_, block_ + block_len_);
+      block_len_ = 0;
+    }
+  }
+
+  std::vector<uint8_t>& out_;
+  uint32_t bits_ = 0;
+  int n_bits_ = 0;
+  uint8_t block_[255];
+  int block_len_ = 0;
+};
+
+struct EncodedFrame {
+  int left = 0;
+  int top = 0;
+  int width = 0;
+  int height = 0;
+  int transparent = -1;
+  std::vector<uint8_t> data;
+};
+
+EncodedFrame encode_frame(const uint8_t* prev, const uint8_t* cur, int width, int height) {
+  EncodedFrame frame;
+  frame.width = width;
+  frame.height = height;
+  if (prev == nullptr) {
+    lzw_compress(cur, static_cast<size_t>(width) * height, frame.data);
+    return frame;
+  }
+
+  // Only the bounding box of the pixels that differ from the previous frame is stored
+  int x0 = width, x1 = -1, y0 = height, y1 = -1;
+  for (int y = 0; y < height; y++) {
+    const uint8_t* p = prev + static_cast<size_t>(y) * width;
+    const uint8_t* c = cur + static_cast<size_t>(y) * width;
+    for (int x = 0; x < width; x++) {
+      if (p[x] != c[x]) {
+        x0 = std::min(x0, x);
+        x1 = std::max(x1, x);
+        y0 = std::min(y0, y);
+        y1 = y;
+      }
+    }
+  }
+  if (x1 < 0) {
+    // Identical frame: redraw a single pixel with the value it already has
+    frame.width = 1;
+    frame.height = 1;
+    lzw_compress(cur, 1, frame.data);
+    return frame;
+  }
+  frame.left = x0;
+  frame.top = y0;
+  frame.width = x1 - x0 + 1;
+  frame.height = y1 - y0 + 1;
+
+  // Unchanged pixels inside the box become transparent when some palette entry
+  // is not used by the new frame there, which gives LZW long runs to work with
+  bool used[256] = {};
+  for (int y = y0; y <= y1; y++) {
+    const uint8_t* c = cur + static_cast<size_t>(y) * width;
+    for (int x = x0; x <= x1; x++) {
+      used[c[x]] = true;
+    }
+  }
+  for (int i = 255; i >= 0; i--) {
+    if (!used[i]) {
+      frame.transparent = i;
+      break;
+    }
+  }
+
+  std::vector<uint8_t> pixels(static_cast<size_t>(frame.width) * frame.height);
+  uint8_t* out = pixels.data();
+  for (int y = y0; y <= y1; y++) {
+    const uint8_t* p = prev + static_cast<size_t>(y) * width;
+    const uint8_t* c = cur + static_cast<size_t>(y) * width;
+    for (int x = x0; x <= x1; x++) {
+      *out++ = (frame.transparent >= 0 && p[x] == c[x]) ? static_cast<uint8_t>(frame.transparent) : c[x];
+    }
+  }
+  lzw_compress(pixels.data(), pixels.size(), frame.data);
+  return frame;
+}
+
+void put16(std::vector<uint8_t>& out, int value) {
+  out.push_back(value & 0xff);
+  out.push_back((value >> 8) & 0xff);
+}
+
+}  // namespace
+
+void lzw_compress(const uint8_t* pixels, size_t n, std::vector<uint8_t>& out) {
+  out.push_back(kMinCodeSize);
+  CodeWriter writer(out);
+
+  // Open addressing dictionary from (prefix code << 8 | next byte) to code
+  std::vector<int32_t> keys(kTableSize, -1);
+  std::vector<int16_t> codes(kTableSize);
+  int code_size = kMinCodeSize + 1;
+  int next_code = kEndCode + 1;
+
+  writer.write(kClearCode, code_size);
+  if (n > 0) {
+    int prefix = pixels[0];
+    for (size_t i = 1; i < n; i++) {
+      int32_t key = (prefix << 8) | pixels[i];
+      uint32_t slot = (static_cast<uint32_t>(key) * 2654435761u) >> (32 - kTableBits);
+      while (keys[slot] != -1 && keys[slot] != key) {
+        slot = (slot + 1) & (kTableSize - 1);
+      }
+      if (keys[slot] == key) {
+        prefix = codes[slot];
+        continue;
+      }
+
+      writer.write(prefix, code_size);
+      keys[slot] = key;
+      codes[slot] = static_cast<int16_t>(next_code++);
+      if (next_code > (1 << code_size)) {
+        code_size++;
+      }
+      if (next_code == kMaxCodes) {
+        // Table full: start over rather than keep coding with a stale dictionary
+        writer.write(kClearCode, code_size);
+        std::fill(keys.begin(), keys.end(), -1);
+        code_size = kMinCodeSize + 1;
+        next_code = kEndCode + 1;
+      }
+      prefix = pixels[i];
+    }
+    writer.write(prefix, code_size);
+    // The decoder adds one more entry for the last code, and widens its codes if that fills the current size
+    if (next_code == (1 << code_size) && code_size < 12) {
+      code_size++;
+    }
+  }
+  writer.write(kEndCode, code_size);
+  writer.finish();
+}
+
+std::vector<uint8_t> encode_gif(const std::vector<const uint8_t*>& frames, int width, int height, const ColorLUT& palette, int delay_cs) {
+  std::vector<EncodedFrame> encoded(frames.size());
+  cv::parallel_for_(cv::Range(0, static_cast<int>(frames.size())), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++) {
+      encoded[i] = encode_frame(i > 0 ? frames[i - 1] : nullptr, frames[i], width, height);
+    }
+  });
+
+  size_t data_size = 0;
+  for (const EncodedFrame& frame : encoded) {
+    data_size += frame.data.size() + 20;
+  }
+  std::vector<uint8_t> out;
+  out.reserve(data_size + 1024);
+  const uint8_t header[] = {'G', 'I', 'F', '8', '9', 'a'};
+  out.insert(out.end(), header, header + sizeof(header));
+  put16(out, width);
+  put16(out, height);
+  // Global colour table of 256 entries, background index 0, square pixels
+  out.push_back(0xF7);
+  out.push_back(0);
+  out.push_back(0);
+  for (int i = 0; i < 256; i++) {
+    if (i < palette.size) {
+      out.push_back(palette.bgr[3 * i + 2]);
+      out.push_back(palette.bgr[3 * i + 1]);
+      out.push_back(palette.bgr[3 * i]);
+    } else {
+      out.insert(out.end(), 3, 0);
+    }
+  }
+
+  if (frames.size() > 1) {
+    // Loop forever
+    const uint8_t netscape[] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+    out.insert(out.end(), netscape, netscape + sizeof(netscape));
+  }
+
+  for (const EncodedFrame& frame : encoded) {
+    // Graphic control extension: leave each frame in place for the next delta
+    out.push_back(0x21);
+    out.push_back(0xF9);
+    out.push_back(0x04);
+    out.push_back((1 << 2) | (frame.transparent >= 0 ? 1 : 0));
+    put16(out, delay_cs);
+    out.push_back(frame.transparent >= 0 ? frame.transparent : 0);
+    out.push_back(0x00);
+
+    out.push_back(0x2C);
+    put16(out, frame.left);
+    put16(out, frame.top);
+    put16(out, frame.width);
+    put16(out, frame.height);
+    out.push_back(0x00);
+    out.insert(out.end(), frame.data.begin(), frame.data.end());
+  }
+  out.push_back(0x3B);
+  return out;
+}
+
+static bool write_file(const std::string& filename, const std::vector<uint8_t>& data) {
+  std::ofstream file(filename, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+  return static_cast<bool>(file);
+}
+
+bool write_gif_frame(const std::string& filename, const cv::Mat& indices, const ColorLUT& palette) {
+  std::vector<const uint8_t*> frames = {indices.ptr<uint8_t>(0)};
+  return write_file(filename, encode_gif(frames, indices.cols, indices.rows, palette, 0));
+}
+
+void GifWriter::set_frame(size_t t, const cv::Mat& indices) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  frames_[t] = indices;
+}
+
+cv::Mat GifWriter::frame(size_t t) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return frames_[t];
+}
+
+bool GifWriter::write(const std::string& filename) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<const uint8_t*> frames;
+  int width = 0, height = 0;
+  for (const cv::Mat& frame : frames_) {
+    if (!frame.empty()) {
+      frames.push_back(frame.ptr<uint8_t>(0));
+      width = frame.cols;
+      height = frame.rows;
+    }
+  }
+  if (frames.empty()) {
+    return false;
+  }
+
+  return write_file(filename, encode_gif(frames, width, height, palette_, delay_cs_));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "colorize.h"
+
+// Encodes width x height frames of 8-bit palette indices into a looping GIF
+// with the LUT as its global colour table. Every frame after the first only
+// stores the rectangle that changed, with unchanged pixels in it made
+// transparent when a palette entry is free, and the frames are
+// LZW-compressed in parallel. delay_cs is the time per frame in 1/100 s.
+std::vector<uint8_t> encode_gif(const std::vector<const uint8_t*>& frames, int width, int height, const ColorLUT& palette, int delay_cs);
+// Writes a single CV_8UC1 index frame as a still GIF
+bool write_gif_frame(const std::string& filename, const cv::Mat& indices, const ColorLUT& palette);
+// LZW data stream (minimum code size 8, split into sub-blocks) for one frame
+void lzw_compress(const uint8_t* pixels, size_t n, std::vector<uint8_t>& out);
+
+// Collects index frames as they come out of the render pipeline, in any
+// order and from any thread, and writes them as one animation at the end.
+class GifWriter {
+public:
+  GifWriter(size_t n_frames, const ColorLUT& palette, int delay_cs)
+      : frames_(n_frames), palette_(palette), delay_cs_(delay_cs) {}
+
+  // indices is a CV_8UC1 frame, all frames must have the same size
+  void set_frame(size_t t, const cv::Mat& indices);
+  // Empty when frame t was never set
+  cv::Mat frame(size_t t) const;
+  // Frames that were never set are left out
+  bool write(const std::string& filename) const;
+
+private:
+  std::vector<cv::Mat> frames_;
+  ColorLUT palette_;
+  int delay_cs_;
+  mutable std::mutex mutex_;
+};
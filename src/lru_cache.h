@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// String-keyed cache of shared values that evicts the least recently used
+// entries once the values it holds add up to more than max_bytes. Values are
+// handed out as shared pointers, so an evicted value stays valid for whoever
+// still holds it. Thread safe.
+template <typename Value>
+class LruCache {
+public:
+  explicit LruCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  std::shared_ptr<const Value> get(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+      return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->value;
+  }
+
+  void put(const std::string& key, std::shared_ptr<const Value> value, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (bytes > max_bytes_) {
+      return;
+    }
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      bytes_ -= it->second->bytes;
+      entries_.erase(it->second);
+      index_.erase(it);
+    }
+    entries_.push_front(Entry{key, std::move(value), bytes});
+    index_[key] = entries_.begin();
+    bytes_ += bytes;
+    while (bytes_ > max_bytes_) {
+      const Entry& last = entries_.back();
+      bytes_ -= last.bytes;
+      index_.erase(last.key);
+      entries_.pop_back();
+    }
+  }
+
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const Value> value;
+    size_t bytes;
+  };
+  size_t max_bytes_;
+  size_t bytes_ = 0;
+  // Most recently used first
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, typename std::list<Entry>::iterator> index_;
+  mutable std::mutex mutex_;
+};
@@ -1,31 +1,284 @@
 #include <map>
 #include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include "create_images.h"
 #include "download.h"
+#include "render_server.h"
+#include "shard.h"
 
+// Poll loop settings of --daemon
+struct DaemonOptions {
+    bool enabled = false;
+    // Seconds between polls, and the longest wait after repeated failures
+    int interval_s = 300;
+    int max_backoff_s = 3600;
+    // JSON heartbeat for the supervisor, defaults to <output>/daemon_status.json
+    std::string status_file;
+};
 
-bool parse_arguments(int argc, char *argv[], std::string& input_file, std::string& variable, std::string& output_folder, bool& no_download) {
+// Where --metrics dumps the stage timings and counters, empty for nowhere
+struct MetricsOptions {
+    std::string path;
+    MetricsFormat format = MetricsFormat::json;
+};
+
+// What the status file reports
+struct DaemonStatus {
+    std::string state = "starting";
+    time_t started = 0;
+    time_t last_poll = 0;
+    time_t last_render = 0;
+    time_t next_poll = 0;
+    double last_render_seconds = 0.0;
+    size_t renders = 0;
+    int consecutive_failures = 0;
+    std::string last_error;
+};
+
+static std::atomic<bool> stop_requested{false};
+
+void request_stop(int) {
+    stop_requested = true;
+}
+
+
+// Moves i to the value of the option at argv[i], or reports it missing
+bool next_value(int argc, char *argv[], int& i) {
+    if (i + 1 >= argc) {
+        std::cerr << "Error: Missing value for argument " << argv[i] << "\n";
+        return false;
+    }
+    ++i;
+    return true;
+}
+
+// Parses "x_min,y_min,x_max,y_max"
+bool parse_bbox(const char* value, GridRegion& region) {
+    double v[4];
+    std::stringstream ss(value);
+    char sep;
+    for (int k = 0; k < 4; k++) {
+        if (!(ss >> v[k]) || (k < 3 && !(ss >> sep && sep == ','))) {
+            std::cerr << "Error: --bbox expects x_min,y_min,x_max,y_max\n";
+            return false;
+        }
+    }
+    region.set = true;
+    region.x_min = v[0];
+    region.y_min = v[1];
+    region.x_max = v[2];
+    region.y_max = v[3];
+    return true;
+}
+
+bool parse_arguments(int argc, char *argv[], std::string& input_file, std::string& variable, std::string& output_folder, std::optional<bool>& download, bool& with_derived, RenderOptions& options, DownloadOptions& download_options, DaemonOptions& daemon, MetricsOptions& metrics, ServerOptions& server, ShardOptions& shard) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--input") == 0) {
-            if (++i >= argc) {
-                std::cerr << "Error: Missing value for argument --input\n";
-                return false;
-            }
+            if (!next_value(argc, argv, i)) return false;
             input_file = argv[i];
         } else if (strcmp(argv[i], "--var") == 0) {
-            if (++i >= argc) {
-                std::cerr << "Error: Missing value for argument --var\n";
-                return false;
-            }
+            if (!next_value(argc, argv, i)) return false;
             variable = argv[i];
         } else if (strcmp(argv[i], "--output") == 0) {
-            if (++i >= argc) {
-                std::cerr << "Error: Missing value for argument --output\n";
+            if (!next_value(argc, argv, i)) return false;
+            output_folder = argv[i];
+        } else if (strcmp(argv[i], "--memory_limit") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            // Given in MiB
+            options.memory_limit_bytes = std::stoull(argv[i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--scale") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.scale_factor = std::stod(argv[i]);
+            if (options.scale_factor <= 0.0) {
+                std::cerr << "Error: --scale must be positive\n";
                 return false;
             }
-            output_folder = argv[i];
+        } else if (strcmp(argv[i], "--format") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            if (strcmp(argv[i], "jpg") == 0) {
+                options.frame_format = FrameFormat::jpg;
+            } else if (strcmp(argv[i], "png") == 0) {
+                options.frame_format = FrameFormat::png;
+            } else if (strcmp(argv[i], "gif") == 0) {
+                options.frame_format = FrameFormat::gif;
+            } else {
+                std::cerr << "Error: Unknown frame format " << argv[i] << "\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--tiles") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.tile_size = std::stoi(argv[i]);
+            if (options.tile_size < 1) {
+                std::cerr << "Error: --tiles must be a positive tile size\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--bbox") == 0 || strcmp(argv[i], "--bbox_xy") == 0) {
+            options.region.projected = strcmp(argv[i], "--bbox_xy") == 0;
+            if (!next_value(argc, argv, i)) return false;
+            if (!parse_bbox(argv[i], options.region)) return false;
+        } else if (strcmp(argv[i], "--stride") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.region.stride = std::stoull(argv[i]);
+            if (options.region.stride < 1) {
+                std::cerr << "Error: --stride must be at least 1\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--colorize_threads") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.colorize_threads = std::stoull(argv[i]);
+        } else if (strcmp(argv[i], "--encode_threads") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.encode_threads = std::stoull(argv[i]);
+        } else if (strcmp(argv[i], "--slice_queue") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.slice_queue_depth = std::stoull(argv[i]);
+        } else if (strcmp(argv[i], "--frame_queue") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.frame_queue_depth = std::stoull(argv[i]);
+        } else if (strcmp(argv[i], "--colormaps") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            if (!load_palettes(argv[i], options.palettes)) return false;
+        } else if (strcmp(argv[i], "--colormap_size") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            options.colormap_size = std::stoi(argv[i]);
+            if (options.colormap_size < 2 || options.colormap_size > kMaxColormapSize) {
+                std::cerr << "Error: --colormap_size must be between 2 and " << kMaxColormapSize << "\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--range_config") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            if (!load_range_policies(argv[i], options.range_policies)) return false;
+        } else if (strcmp(argv[i], "--full_render") == 0) {
+            options.incremental = false;
+        } else if (strcmp(argv[i], "--no_gif") == 0) {
+            options.write_gif = false;
+        } else if (strcmp(argv[i], "--url") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            download_options.url = argv[i];
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            download_options.connections = std::stoi(argv[i]);
+            if (download_options.connections < 1) {
+                std::cerr << "Error: --connections must be at least 1\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--chunk_mb") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            // Given in MiB
+            download_options.chunk_size = std::stoull(argv[i]) * 1024 * 1024;
+            if (download_options.chunk_size == 0) {
+                std::cerr << "Error: --chunk_mb must be positive\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon.enabled = true;
+        } else if (strcmp(argv[i], "--interval") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            daemon.interval_s = std::stoi(argv[i]);
+            if (daemon.interval_s < 1) {
+                std::cerr << "Error: --interval must be at least 1 second\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--max_backoff") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            daemon.max_backoff_s = std::stoi(argv[i]);
+        } else if (strcmp(argv[i], "--status_file") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            daemon.status_file = argv[i];
+        } else if (strcmp(argv[i], "--metrics") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            metrics.path = argv[i];
+        } else if (strcmp(argv[i], "--metrics_format") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            if (strcmp(argv[i], "json") == 0) {
+                metrics.format = MetricsFormat::json;
+            } else if (strcmp(argv[i], "prometheus") == 0) {
+                metrics.format = MetricsFormat::prometheus;
+            } else {
+                std::cerr << "Error: Unknown metrics format " << argv[i] << "\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            server.port = std::stoi(argv[i]);
+            if (server.port < 1 || server.port > 65535) {
+                std::cerr << "Error: --serve expects a port number\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--serve_threads") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            server.threads = std::stoull(argv[i]);
+        } else if (strcmp(argv[i], "--frame_cache_mb") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            server.frame_cache_bytes = std::stoull(argv[i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--hot_slices_mb") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            server.slice_cache_bytes = std::stoull(argv[i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--readers_mb") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            server.reader_cache_bytes = std::stoull(argv[i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--serve_connections") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            server.max_connections = std::stoull(argv[i]);
+            if (server.max_connections < 1) {
+                std::cerr << "Error: --serve_connections must be at least 1\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--shard") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            if (strcmp(argv[i], "plan") == 0) {
+                shard.role = ShardRole::plan;
+            } else if (strcmp(argv[i], "work") == 0) {
+                shard.role = ShardRole::work;
+            } else if (strcmp(argv[i], "merge") == 0) {
+                shard.role = ShardRole::merge;
+            } else {
+                std::cerr << "Error: --shard expects plan, work or merge\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--shard_dir") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            shard.dir = argv[i];
+        } else if (strcmp(argv[i], "--shard_workers") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            shard.workers = std::stoull(argv[i]);
+            if (shard.workers < 1) {
+                std::cerr << "Error: --shard_workers must be at least 1\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--shard_id") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            shard.worker_id = std::stoull(argv[i]);
+        } else if (strcmp(argv[i], "--shard_steps") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            shard.steps_per_unit = std::stoull(argv[i]);
+            if (shard.steps_per_unit < 1) {
+                std::cerr << "Error: --shard_steps must be at least 1\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--shard_lease") == 0) {
+            if (!next_value(argc, argv, i)) return false;
+            shard.lease_seconds = std::stod(argv[i]);
+            if (shard.lease_seconds < 1) {
+                std::cerr << "Error: --shard_lease must be at least 1 second\n";
+                return false;
+            }
+        } else if (strcmp(argv[i], "--slice_cache") == 0) {
+            options.slice_cache = true;
+        } else if (strcmp(argv[i], "--no_progress") == 0) {
+            options.show_progress = false;
         } else if (strcmp(argv[i], "--no_download") == 0) {
-            no_download = true;
+            download = false;
+        } else if (strcmp(argv[i], "--download") == 0) {
+            download = true;
+        } else if (strcmp(argv[i], "--derived") == 0) {
+            with_derived = true;
         } else {
             std::cerr << "Error: Unknown argument " << argv[i] << std::endl;
             return false;
@@ -40,82 +293,313 @@ bool parse_arguments(int argc, char *argv[], std::string& input_file, std::strin
         output_folder = "/output";
     }
 
+    if (daemon.status_file.empty()) {
+        daemon.status_file = (std::filesystem::path(output_folder) / "daemon_status.json").string();
+    }
+    daemon.max_backoff_s = std::max(daemon.max_backoff_s, daemon.interval_s);
+
+    if (shard.role != ShardRole::none && shard.dir.empty()) {
+        shard.dir = (std::filesystem::path(output_folder) / ".shards").string();
+    }
+
     return true;
 }
 
-void create_variable_images(const std::string& input_file, const std::string& variable, const std::string& alias, const std::filesystem::path& output_folder) {
+VariableJob make_variable_job(const std::string& variable, const std::string& alias, const std::filesystem::path& output_folder,
+                              const DerivedField& derived = {}) {
     std::filesystem::create_directories(output_folder);
-    create_images(input_file, variable, alias, output_folder.string());
+    return VariableJob{variable, alias, output_folder.string(), derived};
 }
 
-void create_variable_gif(const std::string& alias, const std::filesystem::path& output_folder){
-    const std::filesystem::path input_pattern = output_folder / "*.jpg";
-    const std::filesystem::path output_filename = output_folder / (alias + ".gif");
-    create_gif(input_pattern.string(), output_filename.string(), 10);
+// Products computed from a stored variable while it is read, by alias
+std::map<std::string, std::pair<std::string, DerivedField>> derived_products() {
+    std::map<std::string, std::pair<std::string, DerivedField>> products;
+
+    DerivedField temperature_change;
+    temperature_change.op = DerivedOp::difference;
+    temperature_change.lag_seconds = 24 * 3600;
+    temperature_change.colormap = "air_pressure";
+    products["temperature_change_24h"] = {"air_temperature_2m", temperature_change};
+
+    // Radiation is accumulated since the start of the forecast, the hourly difference is the mean flux in W/m2
+    DerivedField shortwave_flux;
+    shortwave_flux.op = DerivedOp::difference;
+    shortwave_flux.lag_seconds = 3600;
+    shortwave_flux.scale = 1.0 / 3600;
+    shortwave_flux.colormap = "radiation";
+    products["shortwave_flux"] = {"integral_of_surface_downwelling_shortwave_flux_in_air_wrt_time", shortwave_flux};
+
+    DerivedField wind;
+    wind.arrow_variable = "wind_direction_10m";
+    wind.colormap = "wind_speed";
+    products["wind"] = {"wind_speed_10m", wind};
+    return products;
+}
+
+// Written to a temporary file and renamed so the supervisor never reads half of it
+void write_daemon_status(const std::string& path, const DaemonStatus& status) {
+    std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << "{\n";
+        file << "  \"pid\": " << getpid() << ",\n";
+        file << "  \"state\": \"" << json_escape(status.state) << "\",\n";
+        file << "  \"heartbeat\": " << time(nullptr) << ",\n";
+        file << "  \"started\": " << status.started << ",\n";
+        file << "  \"last_poll\": " << status.last_poll << ",\n";
+        file << "  \"last_render\": " << status.last_render << ",\n";
+        file << "  \"last_render_seconds\": " << status.last_render_seconds << ",\n";
+        file << "  \"next_poll\": " << status.next_poll << ",\n";
+        file << "  \"renders\": " << status.renders << ",\n";
+        file << "  \"consecutive_failures\": " << status.consecutive_failures << ",\n";
+        file << "  \"last_error\": \"" << json_escape(status.last_error) << "\"\n";
+        file << "}\n";
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+}
+
+void write_metrics(const Metrics& metrics, const MetricsOptions& options) {
+    if (!options.path.empty() && !metrics.write(options.path, options.format)) {
+        std::cerr << "Error: Could not write metrics to " << options.path << std::endl;
+    }
 }
 
+// Identifies the version of the input file a render was made from
+std::optional<std::pair<std::filesystem::file_time_type, uintmax_t>> input_version(const std::string& input_file) {
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(input_file, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    auto size = std::filesystem::file_size(input_file, ec);
+    if (ec) {
+        return std::nullopt;
+    }
+    return std::make_pair(mtime, size);
+}
+
+// Polls for a new forecast file and renders it as soon as it lands, keeping
+// the worker pool and colormaps alive between cycles. Runs until SIGTERM or
+// SIGINT, which let the current variable finish before exiting.
+int run_daemon(const std::string& input_file, const std::vector<VariableJob>& jobs, bool no_download,
+               const DownloadOptions& download_options, const RenderOptions& options, const DaemonOptions& daemon,
+               const MetricsOptions& metrics) {
+    std::signal(SIGTERM, request_stop);
+    std::signal(SIGINT, request_stop);
+
+    RenderContext context(options);
+    context.cancel = &stop_requested;
+    DaemonStatus status;
+    status.started = time(nullptr);
+    decltype(input_version(input_file)) rendered_version;
+
+    // The heartbeat is refreshed from a thread of its own every 30 s, so a long
+    // render does not look like a hung daemon. The status is only touched under
+    // the lock; set_state rewrites the file with every change of state.
+    std::mutex status_mutex;
+    std::condition_variable heartbeat_stop;
+    bool stopping = false;
+    std::thread heartbeat([&] {
+        std::unique_lock<std::mutex> lock(status_mutex);
+        while (!heartbeat_stop.wait_for(lock, std::chrono::seconds(30), [&] { return stopping; })) {
+            write_daemon_status(daemon.status_file, status);
+        }
+    });
+    auto set_state = [&](const char* state, const std::function<void(DaemonStatus&)>& update = {}) {
+        std::lock_guard<std::mutex> lock(status_mutex);
+        status.state = state;
+        if (update) {
+            update(status);
+        }
+        write_daemon_status(daemon.status_file, status);
+    };
+
+    int consecutive_failures = 0;
+    while (!stop_requested) {
+        bool failed = false;
+        std::string error;
+        const time_t poll_time = time(nullptr);
+        if (!no_download) {
+            set_state("downloading", [&](DaemonStatus& s) { s.last_poll = poll_time; });
+            ScopedTimer timer(context.metrics, "download");
+            if (download_if_newer(input_file, download_options) == DownloadResult::failed) {
+                failed = true;
+                error = "download failed";
+            }
+        }
+
+        // Render whenever the file changed, whoever put it there
+        auto version = input_version(input_file);
+        if (!failed && version && version != rendered_version && !stop_requested) {
+            set_state("rendering", [&](DaemonStatus& s) { s.last_poll = poll_time; });
+            auto start_time = std::chrono::high_resolution_clock::now();
+            bool ok = create_images(input_file, jobs, context);
+            auto end_time = std::chrono::high_resolution_clock::now();
+            double seconds = std::chrono::duration<double>(end_time - start_time).count();
+            std::cout << std::fixed << std::setprecision(3) << "Total execution time: " << seconds << " s" << std::endl;
+            std::lock_guard<std::mutex> lock(status_mutex);
+            status.last_render_seconds = seconds;
+            if (ok && !stop_requested) {
+                rendered_version = version;
+                status.last_render = time(nullptr);
+                status.renders++;
+            } else if (!ok) {
+                failed = true;
+                error = "render failed";
+            }
+        }
+
+        // Back off exponentially while polls keep failing
+        consecutive_failures = failed ? consecutive_failures + 1 : 0;
+        long long delay = daemon.interval_s;
+        if (consecutive_failures > 0) {
+            delay <<= std::min(consecutive_failures, 20);
+            delay = std::min<long long>(delay, daemon.max_backoff_s);
+        }
+        set_state(failed ? "backoff" : "idle", [&](DaemonStatus& s) {
+            s.last_poll = poll_time;
+            s.consecutive_failures = consecutive_failures;
+            s.next_poll = time(nullptr) + delay;
+            if (failed) {
+                s.last_error = error;
+            }
+        });
+        // Totals since the daemon started, rewritten every cycle
+        context.metrics.add_count("polls", "", 1);
+        write_metrics(context.metrics, metrics);
+
+        // Sleep in short steps so a stop request is seen promptly
+        for (long long waited = 0; waited < delay && !stop_requested; waited++) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    std::cout << "Stopping" << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(status_mutex);
+        stopping = true;
+    }
+    heartbeat_stop.notify_all();
+    heartbeat.join();
+    set_state("stopped");
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     std::string input_file;
     std::string variable;
     std::string output_folder;
-    bool no_download = true;
+    std::optional<bool> download;
+    bool with_derived = false;
+    RenderOptions options;
+    DownloadOptions download_options;
+    DaemonOptions daemon;
+    MetricsOptions metrics;
+    ServerOptions server;
+    ShardOptions shard;
 
-    if (!parse_arguments(argc, argv, input_file, variable, output_folder, no_download)) {
+    try {
+        if (!parse_arguments(argc, argv, input_file, variable, output_folder, download, with_derived, options, download_options, daemon, metrics, server, shard)) {
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Invalid argument value (" << e.what() << ")" << std::endl;
         return 1;
     }
+    // A single run uses the file it is given unless told to fetch a newer one, the daemon polls unless told not to
+    const bool no_download = !download.value_or(daemon.enabled);
 
-    std::map<std::string, std::string> variable_aliases = {
-        {"temperature", "air_temperature_2m"},
-        {"radiation", "integral_of_surface_downwelling_shortwave_flux_in_air_wrt_time"},
-        {"wind_direction", "wind_direction_10m"},
-        {"wind_speed", "wind_speed_10m"},
-        {"wind_gust", "wind_speed_of_gust"},
-        {"cloud_cover", "cloud_area_fraction"},
-        {"air_pressure", "air_pressure_at_sea_level"},
-        {"relative_humidity", "relative_humidity_2m"},
-        {"precipitation", "precipitation_amount"}
-    };
+    const std::map<std::string, std::string>& aliases = variable_aliases();
 
-    if (!no_download) {
+    double download_duration = 0.0;
+    // Of a sharded run only the planner downloads, the workers and the merge use what it planned for
+    bool single_download = shard.role == ShardRole::none || shard.role == ShardRole::plan;
+    if (!no_download && !daemon.enabled && server.port == 0 && single_download) {
         // Capture the start time
         auto download_start_time = std::chrono::high_resolution_clock::now();
-        if (download_if_newer(input_file)) {
+        DownloadResult result = download_if_newer(input_file, download_options);
+        if (result == DownloadResult::downloaded) {
             std::cout << "Downloaded a newer version of the dataset." << std::endl;
-        } else {
+        } else if (result == DownloadResult::not_modified) {
             std::cout << "Local dataset is already up-to-date." << std::endl;
+        } else {
+            std::cerr << "Error: Download failed, using the local dataset." << std::endl;
         }
         auto download_end_time = std::chrono::high_resolution_clock::now();
-        auto download_duration = std::chrono::duration<double>(download_end_time - download_start_time).count();
-        std::cout << std::fixed << std::setprecision(3) << "Download time: " << download_duration << " m" << std::endl;
+        download_duration = std::chrono::duration<double>(download_end_time - download_start_time).count();
+        std::cout << std::fixed << std::setprecision(3) << "Download time: " << download_duration << " s" << std::endl;
     }
+    // Plan every requested variable up front so the file is opened and parsed once
+    const auto derived = derived_products();
+    std::vector<VariableJob> jobs;
     if (!variable.empty()) {
-        auto start_time = std::chrono::high_resolution_clock::now();
-        auto it = variable_aliases.find(variable);
-        if (it != variable_aliases.end()) {
+        auto it = aliases.find(variable);
+        auto derived_it = derived.find(variable);
+        if (it != aliases.end()) {
             std::filesystem::path variable_output_folder = std::filesystem::path(output_folder) / it->first;
-            create_variable_images(input_file, it->second, it->first, variable_output_folder);
-            //create_variable_gif(it->first, variable_output_folder);
+            jobs.push_back(make_variable_job(it->second, it->first, variable_output_folder));
+        } else if (derived_it != derived.end()) {
+            std::filesystem::path variable_output_folder = std::filesystem::path(output_folder) / derived_it->first;
+            jobs.push_back(make_variable_job(derived_it->second.first, derived_it->first, variable_output_folder, derived_it->second.second));
         } else {
             std::cerr << "Error: Invalid variable name provided." << std::endl;
             return 1;
         }
-        auto end_time = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration<double>(end_time - start_time).count();
-        std::cout << std::fixed << std::setprecision(3)<< "Execution time: " << duration << " s" << std::endl;
     } else {
-        for (const auto& alias_pair : variable_aliases) {
-            auto start_time = std::chrono::high_resolution_clock::now();
+        for (const auto& alias_pair : aliases) {
             const std::string& variable_name = alias_pair.first;
             const std::string& variable_alias = alias_pair.second;
             std::filesystem::path variable_output_folder = std::filesystem::path(output_folder) / variable_name;
-            create_variable_images(input_file, variable_alias, variable_name, variable_output_folder);
-            //create_variable_gif(alias_pair.first, variable_output_folder);
-            auto end_time = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration<double>(end_time - start_time).count();
-            std::cout << std::fixed << std::setprecision(3) << "Execution time: " << duration << " s" << std::endl;
-        } 
+            jobs.push_back(make_variable_job(variable_alias, variable_name, variable_output_folder));
+        }
+        // Derived products share the reads of their stored variables but add their own frames, so a full run
+        // only draws them when asked to. The server renders on demand and offers them all.
+        if (with_derived || server.port != 0) {
+            for (const auto& [alias, product] : derived) {
+                jobs.push_back(make_variable_job(product.first, alias, std::filesystem::path(output_folder) / alias, product.second));
+            }
+        }
     }
-    return 0;
+
+    if (server.port != 0) {
+        // Every connection is served by one of the context's workers
+        options.encode_threads = server.threads;
+        RenderContext context(options);
+        std::signal(SIGTERM, request_stop);
+        std::signal(SIGINT, request_stop);
+        int status = run_server(input_file, jobs, context, server, stop_requested);
+        write_metrics(context.metrics, metrics);
+        return status;
+    }
+
+    if (shard.role != ShardRole::none) {
+        RenderContext context(options);
+        std::signal(SIGTERM, request_stop);
+        std::signal(SIGINT, request_stop);
+        // A worker stops taking units, the one it is on is finished
+        context.cancel = &stop_requested;
+        bool ok = shard.role == ShardRole::plan   ? plan_shards(input_file, jobs, context, shard)
+                  : shard.role == ShardRole::work ? run_shard_worker(input_file, jobs, context, shard)
+                                                  : merge_shards(input_file, jobs, context, shard);
+        write_metrics(context.metrics, metrics);
+        return ok ? 0 : 1;
+    }
+
+    if (daemon.enabled) {
+        return run_daemon(input_file, jobs, no_download, download_options, options, daemon, metrics);
+    }
+
+    RenderContext context(options);
+    if (!no_download) {
+        context.metrics.add_time("download", "", download_duration);
+    }
+    auto start_time = std::chrono::high_resolution_clock::now();
+    bool ok = create_images(input_file, jobs, context);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration<double>(end_time - start_time).count();
+    std::cout << std::fixed << std::setprecision(3) << "Total execution time: " << duration << " s" << std::endl;
+    write_metrics(context.metrics, metrics);
+    return ok ? 0 : 1;
 }
 
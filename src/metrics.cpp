@@ -0,0 +1,119 @@
+#include "metrics.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+std::string json_escape(const std::string& text) {
+  std::string escaped;
+  escaped.reserve(text.size());
+  for (char c : text) {
+    switch (c) {
+      case '"':
+        escaped += "\\\"";
+        break;
+      case '\\':
+        escaped += "\\\\";
+        break;
+      case '\n':
+        escaped += "\\n";
+        break;
+      case '\r':
+        escaped += "\\r";
+        break;
+      case '\t':
+        escaped += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char code[8];
+          snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+          escaped += code;
+        } else {
+          escaped += c;
+        }
+    }
+  }
+  return escaped;
+}
+
+void Metrics::add_time(const std::string& stage, const std::string& variable, double seconds, uint64_t calls) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Timer& timer = timers_[{stage, variable}];
+  timer.calls += calls;
+  timer.seconds += seconds;
+}
+
+void Metrics::add_count(const std::string& counter, const std::string& variable, uint64_t n) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  counters_[{counter, variable}] += n;
+}
+
+std::string Metrics::to_json() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream out;
+  out << "{\n  \"timers\": [";
+  const char* sep = "\n";
+  for (const auto& [key, timer] : timers_) {
+    out << sep << "    {\"stage\": \"" << json_escape(key.first) << "\", \"variable\": \"" << json_escape(key.second) << "\", \"calls\": "
+        << timer.calls << ", \"seconds\": " << timer.seconds << "}";
+    sep = ",\n";
+  }
+  out << "\n  ],\n  \"counters\": [";
+  sep = "\n";
+  for (const auto& [key, value] : counters_) {
+    out << sep << "    {\"counter\": \"" << json_escape(key.first) << "\", \"variable\": \"" << json_escape(key.second) << "\", \"value\": " << value
+        << "}";
+    sep = ",\n";
+  }
+  out << "\n  ]\n}\n";
+  return out.str();
+}
+
+std::string Metrics::to_prometheus() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream out;
+  out << "# HELP metno_gif_stage_seconds_total Time spent in each pipeline stage.\n"
+      << "# TYPE metno_gif_stage_seconds_total counter\n";
+  for (const auto& [key, timer] : timers_) {
+    out << "metno_gif_stage_seconds_total{stage=\"" << key.first << "\",variable=\"" << key.second << "\"} "
+        << timer.seconds << "\n";
+  }
+  out << "# HELP metno_gif_stage_calls_total Times each pipeline stage ran.\n"
+      << "# TYPE metno_gif_stage_calls_total counter\n";
+  for (const auto& [key, timer] : timers_) {
+    out << "metno_gif_stage_calls_total{stage=\"" << key.first << "\",variable=\"" << key.second << "\"} "
+        << timer.calls << "\n";
+  }
+  std::string last;
+  for (const auto& [key, value] : counters_) {
+    std::string name = "metno_gif_" + key.first + "_total";
+    if (name != last) {
+      out << "# TYPE " << name << " counter\n";
+      last = name;
+    }
+    out << name << "{variable=\"" << key.second << "\"} " << value << "\n";
+  }
+  return out.str();
+}
+
+bool Metrics::write(const std::string& path, MetricsFormat format) const {
+  std::string text = format == MetricsFormat::json ? to_json() : to_prometheus();
+  if (path == "-") {
+    std::cout << text;
+    return true;
+  }
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    file << text;
+    if (!file) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  return !ec;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+enum class MetricsFormat { json, prometheus };
+
+// text as the contents of a JSON string: quotes, backslashes and control characters escaped
+std::string json_escape(const std::string& text);
+
+// Time spent per pipeline stage and running counters (bytes, frames), each
+// labelled with the variable it belongs to, or "" for the whole run. Values
+// accumulate for the lifetime of the object, so a long-running process reports
+// totals since it started. Updates may come from any thread.
+class Metrics {
+public:
+  void add_time(const std::string& stage, const std::string& variable, double seconds, uint64_t calls = 1);
+  void add_count(const std::string& counter, const std::string& variable, uint64_t n);
+
+  std::string to_json() const;
+  // Prometheus text exposition format, e.g. for the node exporter's textfile collector
+  std::string to_prometheus() const;
+  // Writes to a temporary file and renames it so readers never see half a dump,
+  // "-" prints to stdout
+  bool write(const std::string& path, MetricsFormat format) const;
+
+private:
+  struct Timer {
+    uint64_t calls = 0;
+    double seconds = 0.0;
+  };
+  // Keyed by stage or counter name and variable
+  std::map<std::pair<std::string, std::string>, Timer> timers_;
+  std::map<std::pair<std::string, std::string>, uint64_t> counters_;
+  mutable std::mutex mutex_;
+};
+
+// Adds the time from construction to destruction to a stage
+class ScopedTimer {
+public:
+  ScopedTimer(Metrics& metrics, std::string stage, std::string variable = "")
+      : metrics_(metrics), stage_(std::move(stage)), variable_(std::move(variable)),
+        start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() {
+    metrics_.add_time(stage_, variable_, std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count());
+  }
+  ScopedTimer(const ScopedTimer&) = delete;
+  ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+  Metrics& metrics_;
+  std::string stage_;
+  std::string variable_;
+  std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,195 @@
+#include "netcdf_reader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <netcdf.h>
+
+using namespace netCDF;
+
+VariableLayout query_variable_layout(const NcVar& var) {
+  VariableLayout layout;
+  size_t n_dims = var.getDimCount();
+
+  NcVar::ChunkMode mode;
+  std::vector<size_t> chunk_shape(n_dims);
+  var.getChunkingParameters(mode, chunk_shape);
+  layout.chunked = mode == NcVar::nc_CHUNKED;
+  var.getCompressionParameters(layout.shuffle, layout.deflate, layout.deflate_level);
+  if (!layout.chunked) {
+    return layout;
+  }
+
+  layout.chunk_shape = chunk_shape;
+  layout.chunk_bytes = sizeof(float);
+  layout.chunks_per_row = 1;
+  for (size_t d = 0; d < n_dims; d++) {
+    size_t extent = std::max<size_t>(chunk_shape[d], 1);
+    layout.chunk_bytes *= extent;
+    // Time is the first dimension and the grid the last two, which the reader
+    // narrows to its window; dimensions in between are only read at index 0
+    if (d + 2 >= n_dims && d > 0) {
+      size_t dim_size = var.getDim(d).getSize();
+      layout.chunks_per_row *= (dim_size + extent - 1) / extent;
+    }
+  }
+  layout.time_chunk = std::max<size_t>(chunk_shape[0], 1);
+  return layout;
+}
+
+GridWindow full_window(size_t nLat, size_t nLon) {
+  GridWindow window;
+  window.ny = nLat;
+  window.nx = nLon;
+  return window;
+}
+
+// Chunks along one dimension holding at least one of the sampled indices
+static size_t chunks_touched(size_t start, size_t count, size_t stride, size_t extent) {
+  size_t touched = 0;
+  size_t last = SIZE_MAX;
+  for (size_t i = start; i < start + count; i += stride) {
+    if (i / extent != last) {
+      last = i / extent;
+      touched++;
+    }
+  }
+  return touched;
+}
+
+std::string describe_layout(const VariableLayout& layout) {
+  if (!layout.chunked) {
+    return "contiguous";
+  }
+  std::string shape;
+  for (size_t extent : layout.chunk_shape) {
+    shape += (shape.empty() ? "" : "x") + std::to_string(extent);
+  }
+  char text[160];
+  snprintf(text, sizeof(text), "chunks %s (%.1f MiB, %zu per row), %s", shape.c_str(), layout.chunk_bytes / 1048576.0,
+           layout.chunks_per_row, layout.deflate ? ("deflate level " + std::to_string(layout.deflate_level)).c_str() : "uncompressed");
+  return text;
+}
+
+// Smallest prime at or above n, HDF5 wants a prime number of hash slots
+static size_t next_prime(size_t n) {
+  auto is_prime = [](size_t v) {
+    if (v < 2) {
+      return false;
+    }
+    for (size_t f = 2; f * f <= v; f++) {
+      if (v % f == 0) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while (!is_prime(n)) {
+    n++;
+  }
+  return n;
+}
+
+// A float attribute of the variable, or fallback when it has none
+static float float_attribute(const NcVar& var, const char* name, float fallback) {
+  auto atts = var.getAtts();
+  auto it = atts.find(name);
+  if (it == atts.end()) {
+    return fallback;
+  }
+  float value = fallback;
+  it->second.getValues(&value);
+  return value;
+}
+
+VariableReader::VariableReader(const NcVar& var, size_t nTime, const GridWindow& window, bool size_cache)
+    : var_(var), nTime_(nTime), window_(window), layout_(query_variable_layout(var)) {
+  // Grid points never written hold the fill value
+  fill_value_ = float_attribute(var_, "_FillValue", NC_FILL_FLOAT);
+  missing_value_ = float_attribute(var_, "missing_value", fill_value_);
+  if (!layout_.chunked) {
+    return;
+  }
+  // Only the chunks under the window count
+  size_t n_dims = layout_.chunk_shape.size();
+  size_t chunk_y = std::max<size_t>(layout_.chunk_shape[n_dims - 2], 1);
+  size_t chunk_x = std::max<size_t>(layout_.chunk_shape[n_dims - 1], 1);
+  layout_.chunks_per_row = chunks_touched(window_.y0, window_.ny, window_.stride, chunk_y) *
+                           chunks_touched(window_.x0, window_.nx, window_.stride, chunk_x);
+  size_t row_bytes = layout_.chunks_per_row * layout_.chunk_bytes;
+  if (size_cache && layout_.time_chunk > 1) {
+    // One chunk row is enough: reads go forward in time and cover whole rows.
+    // Preemption 1 because a chunk that has been read whole is not needed again.
+    var_.setChunkCache(row_bytes, next_prime(10 * layout_.chunks_per_row), 1.0f);
+  }
+  size_t nelems = 0;
+  float preemption = 0.0f;
+  if (nc_get_var_chunk_cache(var_.getParentGroup().getId(), var_.getId(), &cache_bytes_, &nelems, &preemption) != NC_NOERR) {
+    cache_bytes_ = 0;
+  }
+  cache_rows_ = row_bytes > 0 ? cache_bytes_ / row_bytes : 0;
+}
+
+size_t VariableReader::aligned_block_steps(size_t max_steps) const {
+  size_t tc = layout_.time_chunk;
+  if (tc <= 1 || max_steps < tc) {
+    return max_steps;
+  }
+  return max_steps / tc * tc;
+}
+
+void VariableReader::read(size_t t0, size_t nt, float* dst) {
+  // Any dimensions between time and the grid (height, ensemble member) are read at index 0
+  size_t n_dims = var_.getDimCount();
+  std::vector<size_t> start(n_dims, 0);
+  std::vector<size_t> count(n_dims, 1);
+  start[0] = t0;
+  count[0] = nt;
+  start[n_dims - 2] = window_.y0;
+  start[n_dims - 1] = window_.x0;
+  count[n_dims - 2] = window_.rows();
+  count[n_dims - 1] = window_.cols();
+  auto start_time = std::chrono::steady_clock::now();
+  if (window_.stride > 1) {
+    std::vector<ptrdiff_t> stride(n_dims, 1);
+    stride[n_dims - 2] = static_cast<ptrdiff_t>(window_.stride);
+    stride[n_dims - 1] = static_cast<ptrdiff_t>(window_.stride);
+    var_.getVar(start, count, stride, dst);
+  } else {
+    var_.getVar(start, count, dst);
+  }
+  stats_.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+  const size_t n = nt * window_.rows() * window_.cols();
+  for (size_t i = 0; i < n; i++) {
+    if (dst[i] == fill_value_ || dst[i] == missing_value_) {
+      dst[i] = NAN;
+    }
+  }
+
+  size_t bytes = n * sizeof(float);
+  stats_.reads++;
+  stats_.bytes_used += bytes;
+  if (!layout_.chunked) {
+    stats_.bytes_decompressed_estimated += bytes;
+    return;
+  }
+  size_t tc = layout_.time_chunk;
+  for (size_t row = t0 / tc; row <= (t0 + nt - 1) / tc; row++) {
+    auto it = std::find(cached_rows_.begin(), cached_rows_.end(), row);
+    if (it != cached_rows_.end()) {
+      cached_rows_.erase(it);
+      cached_rows_.push_back(row);
+      continue;
+    }
+    stats_.bytes_decompressed_estimated += layout_.chunks_per_row * layout_.chunk_bytes;
+    if (cache_rows_ > 0) {
+      cached_rows_.push_back(row);
+      if (cached_rows_.size() > cache_rows_) {
+        cached_rows_.pop_front();
+      }
+    }
+  }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <vector>
+#include <netcdf>
+
+// How a variable is stored in the file
+struct VariableLayout {
+  bool chunked = false;
+  // Chunk extent per dimension, empty for contiguous storage
+  std::vector<size_t> chunk_shape;
+  bool shuffle = false;
+  bool deflate = false;
+  int deflate_level = 0;
+  // Uncompressed size of one chunk
+  size_t chunk_bytes = 0;
+  // Time steps per chunk, and the chunks that cover the grid (or the window a
+  // reader reads) for one of those runs of time steps (a "chunk row")
+  size_t time_chunk = 1;
+  size_t chunks_per_row = 1;
+};
+
+VariableLayout query_variable_layout(const netCDF::NcVar& var);
+
+// Part of the grid to read: every stride-th row of [y0, y0 + ny) and column of
+// [x0, x0 + nx), in file order (rows south to north)
+struct GridWindow {
+  size_t y0 = 0;
+  size_t x0 = 0;
+  size_t ny = 0;
+  size_t nx = 0;
+  size_t stride = 1;
+
+  size_t rows() const { return (ny + stride - 1) / stride; }
+  size_t cols() const { return (nx + stride - 1) / stride; }
+  bool operator==(const GridWindow& other) const = default;
+};
+
+GridWindow full_window(size_t nLat, size_t nLon);
+std::string describe_layout(const VariableLayout& layout);
+
+// Bytes handed to the caller against the uncompressed bytes of the chunks HDF5
+// decompressed to produce them. HDF5 does not report the latter, so it is an
+// estimate, modelled from the chunk layout and the size of the chunk cache,
+// not a measurement.
+struct ReadStats {
+  size_t reads = 0;
+  size_t bytes_used = 0;
+  size_t bytes_decompressed_estimated = 0;
+  // Wall time spent in getVar
+  double seconds = 0.0;
+};
+
+// Reads time steps of a (time, ..., y, x) float variable, each as the
+// rows() x cols() hyperslab of the window, so only the chunks that overlap the
+// window are decompressed. Every read covers the whole window, so chunks are
+// only decompressed more than once when a chunk spans several time steps and
+// they are read separately; the reader sizes
+// the chunk cache to hold one chunk row so that does not happen, and hands out
+// block sizes that line up with the chunks along time. Values equal to the
+// variable's _FillValue (the NetCDF default fill when it has none) or
+// missing_value come out as NaN, which is what the rest of the code takes as
+// no data. Like everything NetCDF, a reader must only be used from one thread.
+class VariableReader {
+public:
+  VariableReader(const netCDF::NcVar& var, size_t nTime, const GridWindow& window, bool size_cache = true);
+
+  const VariableLayout& layout() const { return layout_; }
+  const ReadStats& stats() const { return stats_; }
+  size_t cache_bytes() const { return cache_bytes_; }
+  // The largest multiple of the time chunk up to max_steps, or max_steps
+  // itself when not even one chunk row fits
+  size_t aligned_block_steps(size_t max_steps) const;
+  const GridWindow& window() const { return window_; }
+  // Reads time steps [t0, t0 + nt) into dst, nt * rows() * cols() floats
+  void read(size_t t0, size_t nt, float* dst);
+
+private:
+  netCDF::NcVar var_;
+  size_t nTime_;
+  GridWindow window_;
+  VariableLayout layout_;
+  float fill_value_;
+  float missing_value_;
+  size_t cache_bytes_ = 0;
+  // Chunk rows the cache can hold, and the ones it holds now, most recent last
+  size_t cache_rows_ = 0;
+  std::deque<size_t> cached_rows_;
+  ReadStats stats_;
+};
@@ -0,0 +1,96 @@
+#include "png_encoder.h"
+
+#include <algorithm>
+#include <fstream>
+#include <zlib.h>
+
+namespace {
+
+void put32(std::vector<uint8_t>& out, uint32_t value) {
+  out.push_back((value >> 24) & 0xff);
+  out.push_back((value >> 16) & 0xff);
+  out.push_back((value >> 8) & 0xff);
+  out.push_back(value & 0xff);
+}
+
+void put_chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size) {
+  put32(out, static_cast<uint32_t>(size));
+  size_t type_pos = out.size();
+  out.insert(out.end(), type, type + 4);
+  out.insert(out.end(), data, data + size);
+  // The CRC covers the chunk type and data
+  uLong crc = crc32(0L, out.data() + type_pos, static_cast<uInt>(4 + size));
+  put32(out, static_cast<uint32_t>(crc));
+}
+
+}  // namespace
+
+bool encode_indexed_png(const uint8_t* indices, int width, int height, size_t stride, const ColorLUT& palette, int compression_level, int transparent_index, std::vector<uint8_t>& out) {
+  // The filtered rows and the deflate output are scratch, kept per thread so
+  // the encode workers do not allocate them again for every frame
+  thread_local std::vector<uint8_t> raw;
+  thread_local std::vector<uint8_t> compressed;
+  out.clear();
+  const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  out.insert(out.end(), signature, signature + sizeof(signature));
+
+  // 8 bits per index, colour type 3 (palette), deflate, adaptive filtering, no interlace
+  std::vector<uint8_t> ihdr;
+  put32(ihdr, width);
+  put32(ihdr, height);
+  const uint8_t ihdr_tail[] = {8, 3, 0, 0, 0};
+  ihdr.insert(ihdr.end(), ihdr_tail, ihdr_tail + sizeof(ihdr_tail));
+  put_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+  // The transparent entry may lie past the LUT, the palette has to reach it anyway
+  int n_lut = std::min(palette.size, 256);
+  int n_colors = std::max(n_lut, transparent_index + 1);
+  std::vector<uint8_t> plte(3 * n_colors, 0);
+  for (int i = 0; i < n_lut; i++) {
+    plte[3 * i] = palette.bgr[3 * i + 2];
+    plte[3 * i + 1] = palette.bgr[3 * i + 1];
+    plte[3 * i + 2] = palette.bgr[3 * i];
+  }
+  put_chunk(out, "PLTE", plte.data(), plte.size());
+  if (transparent_index >= 0) {
+    // Alpha per palette entry, entries past the end of tRNS are opaque
+    std::vector<uint8_t> trns(transparent_index + 1, 255);
+    trns[transparent_index] = 0;
+    put_chunk(out, "tRNS", trns.data(), trns.size());
+  }
+
+  // Filter type 0 on every row, which is what the PNG spec recommends for palette images
+  raw.resize(static_cast<size_t>(width + 1) * height);
+  for (int y = 0; y < height; y++) {
+    uint8_t* row = raw.data() + static_cast<size_t>(y) * (width + 1);
+    row[0] = 0;
+    std::copy(indices + y * stride, indices + y * stride + width, row + 1);
+  }
+  uLongf compressed_size = compressBound(raw.size());
+  compressed.resize(compressed_size);
+  if (compress2(compressed.data(), &compressed_size, raw.data(), raw.size(), compression_level) != Z_OK) {
+    out.clear();
+    return false;
+  }
+  out.reserve(out.size() + compressed_size + 24);
+  put_chunk(out, "IDAT", compressed.data(), compressed_size);
+  put_chunk(out, "IEND", nullptr, 0);
+  return true;
+}
+
+std::vector<uint8_t> encode_indexed_png(const uint8_t* indices, int width, int height, size_t stride, const ColorLUT& palette, int compression_level, int transparent_index) {
+  std::vector<uint8_t> out;
+  encode_indexed_png(indices, width, height, stride, palette, compression_level, transparent_index, out);
+  return out;
+}
+
+bool write_indexed_png(const std::string& filename, const cv::Mat& indices, const ColorLUT& palette) {
+  // Fast compression like OpenCV's PNG default, the banded fields compress well either way
+  thread_local std::vector<uint8_t> png;
+  if (!encode_indexed_png(indices.ptr<uint8_t>(0), indices.cols, indices.rows, indices.step, palette, 1, -1, png)) {
+    return false;
+  }
+  std::ofstream file(filename, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(png.data()), png.size());
+  return static_cast<bool>(file);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "colorize.h"
+
+// Encodes a width x height frame of 8-bit palette indices as a paletted PNG
+// (colour type 3) with the LUT as its PLTE chunk. One byte per pixel instead
+// of three, and no lossy artefacts on the colour band edges. A transparent_index
+// of 0-255 makes that palette entry fully transparent.
+std::vector<uint8_t> encode_indexed_png(const uint8_t* indices, int width, int height, size_t stride, const ColorLUT& palette, int compression_level, int transparent_index = -1);
+// Same, into out, reusing its capacity; false when compression failed
+bool encode_indexed_png(const uint8_t* indices, int width, int height, size_t stride, const ColorLUT& palette, int compression_level, int transparent_index, std::vector<uint8_t>& out);
+// indices is a CV_8UC1 frame
+bool write_indexed_png(const std::string& filename, const cv::Mat& indices, const ColorLUT& palette);
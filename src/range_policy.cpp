@@ -0,0 +1,237 @@
+#include "range_policy.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+static const char* kRangeCacheName = ".range_cache";
+
+std::map<std::string, RangePolicy> default_range_policies() {
+  std::map<std::string, RangePolicy> policies;
+  // Precipitation is stored with small negative noise around zero, which would
+  // otherwise stretch the bottom of the colour range
+  RangePolicy precipitation;
+  precipitation.min_threshold = -0.01f;
+  policies["precipitation"] = precipitation;
+  return policies;
+}
+
+bool load_range_policies(const std::string& filename, std::map<std::string, RangePolicy>& policies) {
+  std::ifstream file(filename);
+  if (!file) {
+    std::cerr << "Error: Could not open range config " << filename << std::endl;
+    return false;
+  }
+
+  std::string line;
+  int line_number = 0;
+  while (std::getline(file, line)) {
+    line_number++;
+    std::istringstream ss(line);
+    std::string variable, mode;
+    if (!(ss >> variable) || variable[0] == '#') {
+      continue;
+    }
+    // Start from the built-in policy so a line only changes what it mentions
+    RangePolicy policy = range_policy_for(policies, variable);
+    bool ok = static_cast<bool>(ss >> mode);
+    if (mode == "scan") {
+      policy.mode = RangeMode::scan;
+    } else if (mode == "fixed") {
+      policy.mode = RangeMode::fixed;
+      ok = ok && (ss >> policy.min >> policy.max) && policy.min < policy.max;
+    } else if (mode == "percentile") {
+      policy.mode = RangeMode::percentile;
+      ok = ok && (ss >> policy.lower_percentile >> policy.upper_percentile) && policy.lower_percentile >= 0.0f &&
+           policy.lower_percentile < policy.upper_percentile && policy.upper_percentile <= 100.0f;
+    } else if (mode == "rolling") {
+      policy.mode = RangeMode::rolling;
+      float weight;
+      if (ss >> weight) {
+        policy.rolling_weight = weight;
+      } else {
+        ss.clear();
+      }
+      ok = ok && policy.rolling_weight > 0.0f && policy.rolling_weight <= 1.0f;
+    } else {
+      ok = false;
+    }
+
+    std::string keyword;
+    if (ok && ss >> keyword) {
+      ok = keyword == "threshold" && (ss >> policy.min_threshold >> policy.max_threshold);
+    }
+    if (!ok) {
+      std::cerr << "Error: " << filename << ":" << line_number << ": Invalid range policy: " << line << std::endl;
+      return false;
+    }
+    policies[variable] = policy;
+  }
+  return true;
+}
+
+RangePolicy range_policy_for(const std::map<std::string, RangePolicy>& policies, const std::string& variable_alias) {
+  auto it = policies.find(variable_alias);
+  return it != policies.end() ? it->second : RangePolicy();
+}
+
+std::optional<std::pair<float, float>> read_range_cache(const std::string& folder) {
+  std::ifstream file(std::filesystem::path(folder) / kRangeCacheName);
+  float min, max;
+  if (!(file >> min >> max) || !(min < max)) {
+    return std::nullopt;
+  }
+  return std::make_pair(min, max);
+}
+
+// Replaced in one rename, as the render manifest is, so concurrent shard
+// workers and interrupted runs never leave a truncated cache behind
+bool write_range_cache(const std::string& folder, std::pair<float, float> range) {
+  const std::string path = (std::filesystem::path(folder) / kRangeCacheName).string();
+  std::string tmp_path = path + ".XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    return false;
+  }
+  fchmod(fd, 0644);
+  close(fd);
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    // Enough digits for the floats to read back exactly
+    file << std::setprecision(9) << range.first << " " << range.second << "\n";
+    if (!file) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    unlink(tmp_path.c_str());
+  }
+  return !ec;
+}
+
+// Maps a float to an unsigned key that sorts in the same order
+static uint32_t order_key(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, 4);
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+static float from_order_key(uint32_t key) {
+  uint32_t bits = (key & 0x80000000u) ? (key & 0x7fffffffu) : ~key;
+  float value;
+  std::memcpy(&value, &bits, 4);
+  return value;
+}
+
+void RangeHistogram::add(const float* values, size_t n, float min_threshold, float max_threshold) {
+  for (size_t i = 0; i < n; i++) {
+    float value = values[i];
+    // Also skips NaN
+    if (!(value >= min_threshold && value <= max_threshold)) {
+      continue;
+    }
+    if (count_ == 0) {
+      min_ = max_ = value;
+    }
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    bins_[order_key(value) >> 16]++;
+    count_++;
+  }
+}
+
+std::optional<std::pair<float, float>> RangeHistogram::percentile_range(float lower, float upper) const {
+  if (count_ == 0) {
+    return std::nullopt;
+  }
+  // Ranks of the wanted values among all count_ values
+  uint64_t lower_rank = static_cast<uint64_t>(std::floor(lower / 100.0 * (count_ - 1)));
+  uint64_t upper_rank = static_cast<uint64_t>(std::ceil(upper / 100.0 * (count_ - 1)));
+  float low = min_, high = max_;
+  bool found_low = false;
+  uint64_t seen = 0;
+  for (size_t bin = 0; bin < bins_.size(); bin++) {
+    if (bins_[bin] == 0) {
+      continue;
+    }
+    seen += bins_[bin];
+    if (!found_low && seen > lower_rank) {
+      low = from_order_key(static_cast<uint32_t>(bin << 16));
+      found_low = true;
+    }
+    if (seen > upper_rank) {
+      high = from_order_key(static_cast<uint32_t>(bin << 16) | 0xffffu);
+      break;
+    }
+  }
+  // Bin edges never go past what was actually seen
+  return std::make_pair(std::max(low, min_), std::min(high, max_));
+}
+
+void RangeHistogram::merge(const RangeHistogram& other) {
+  if (other.count_ == 0) {
+    return;
+  }
+  for (size_t bin = 0; bin < bins_.size(); bin++) {
+    bins_[bin] += other.bins_[bin];
+  }
+  min_ = count_ == 0 ? other.min_ : std::min(min_, other.min_);
+  max_ = count_ == 0 ? other.max_ : std::max(max_, other.max_);
+  count_ += other.count_;
+}
+
+std::optional<std::pair<float, float>> RangeHistogram::value_range() const {
+  if (count_ == 0) {
+    return std::nullopt;
+  }
+  return std::make_pair(min_, max_);
+}
+
+// <count> <min> <max> <bins in use>, then (bin, count) for each of them
+bool RangeHistogram::save(const std::string& filename) const {
+  std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+  uint32_t used = static_cast<uint32_t>(std::count_if(bins_.begin(), bins_.end(), [](uint64_t n) { return n > 0; }));
+  file.write(reinterpret_cast<const char*>(&count_), sizeof(count_));
+  file.write(reinterpret_cast<const char*>(&min_), sizeof(min_));
+  file.write(reinterpret_cast<const char*>(&max_), sizeof(max_));
+  file.write(reinterpret_cast<const char*>(&used), sizeof(used));
+  for (uint32_t bin = 0; bin < bins_.size(); bin++) {
+    if (bins_[bin] > 0) {
+      file.write(reinterpret_cast<const char*>(&bin), sizeof(bin));
+      file.write(reinterpret_cast<const char*>(&bins_[bin]), sizeof(bins_[bin]));
+    }
+  }
+  return static_cast<bool>(file);
+}
+
+bool RangeHistogram::load(const std::string& filename) {
+  std::ifstream file(filename, std::ios::binary);
+  uint32_t used = 0;
+  file.read(reinterpret_cast<char*>(&count_), sizeof(count_));
+  file.read(reinterpret_cast<char*>(&min_), sizeof(min_));
+  file.read(reinterpret_cast<char*>(&max_), sizeof(max_));
+  file.read(reinterpret_cast<char*>(&used), sizeof(used));
+  std::fill(bins_.begin(), bins_.end(), 0);
+  for (uint32_t i = 0; i < used && file; i++) {
+    uint32_t bin;
+    file.read(reinterpret_cast<char*>(&bin), sizeof(bin));
+    file.read(reinterpret_cast<char*>(&bins_[bin & 0xffffu]), sizeof(uint64_t));
+  }
+  if (!file) {
+    count_ = 0;
+    std::fill(bins_.begin(), bins_.end(), 0);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How the colour range of a variable is chosen:
+// scan       min/max of the whole variable, the original behaviour
+// fixed      the bounds given in the config, no pass over the data at all
+// percentile the given percentiles of all values, from a streaming histogram
+// rolling    the range cached by the previous run, so drawing starts at once;
+//            the range measured while drawing is blended into the cache
+enum class RangeMode { scan, fixed, percentile, rolling };
+
+struct RangePolicy {
+  RangeMode mode = RangeMode::scan;
+  // fixed
+  float min = 0.0f;
+  float max = 1.0f;
+  // percentile, in [0, 100]
+  float lower_percentile = 1.0f;
+  float upper_percentile = 99.0f;
+  // rolling: weight of this run's range in the cached one
+  float rolling_weight = 0.25f;
+  // Values outside these are not counted when a range is measured
+  float min_threshold = -1e10f;
+  float max_threshold = 1e10f;
+};
+
+// Built-in policies, overridden by a range config file
+std::map<std::string, RangePolicy> default_range_policies();
+// One policy per line: <variable> <scan|fixed|percentile|rolling> [arguments] [threshold <min> <max>]
+//   fixed <min> <max>, percentile <lower> <upper>, rolling [weight]
+// Blank lines and lines starting with # are ignored.
+bool load_range_policies(const std::string& filename, std::map<std::string, RangePolicy>& policies);
+RangePolicy range_policy_for(const std::map<std::string, RangePolicy>& policies, const std::string& variable_alias);
+
+// Range kept in <folder>/.range_cache for the rolling policy
+std::optional<std::pair<float, float>> read_range_cache(const std::string& folder);
+bool write_range_cache(const std::string& folder, std::pair<float, float> range);
+
+// Histogram over the float bit patterns: the top 16 bits of the order-preserving
+// key, so one pass without knowing the range first. That leaves 7 mantissa bits,
+// bins within 1% of the value or about two significant digits. Percentiles are
+// rounded outwards to a bin edge.
+class RangeHistogram {
+public:
+  RangeHistogram() : bins_(1 << 16, 0) {}
+
+  void add(const float* values, size_t n, float min_threshold, float max_threshold);
+  // Adds the values counted by another histogram, e.g. of another part of the variable
+  void merge(const RangeHistogram& other);
+  // p in [0, 100], nullopt when nothing was added
+  std::optional<std::pair<float, float>> percentile_range(float lower, float upper) const;
+  // Smallest and largest value added, nullopt when nothing was added
+  std::optional<std::pair<float, float>> value_range() const;
+  // Binary, only the bins in use
+  bool save(const std::string& filename) const;
+  bool load(const std::string& filename);
+
+private:
+  std::vector<uint64_t> bins_;
+  uint64_t count_ = 0;
+  float min_ = 0.0f;
+  float max_ = 0.0f;
+};
@@ -0,0 +1,124 @@
+#include "render_manifest.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+
+static const char* kManifestName = ".render_manifest";
+
+uint64_t fnv1a_hash(const void* data, size_t size, uint64_t seed) {
+  const uint64_t prime = 0x100000001b3ull;
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  uint64_t hash = seed;
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * prime;
+  }
+  for (; i < size; i++) {
+    hash = (hash ^ bytes[i]) * prime;
+  }
+  return hash;
+}
+
+// One line per frame: <file name> <slice hash> <min> <max> <style hash>, with
+// the floats written as their bit patterns so they compare exactly
+static void read_records(const std::filesystem::path& path, std::map<std::string, FrameRecord>& records) {
+  std::ifstream file(path);
+  std::string name;
+  FrameRecord record;
+  uint32_t min_bits, max_bits;
+  while (file >> name >> std::hex >> record.slice_hash >> min_bits >> max_bits >> record.style_hash >> std::dec) {
+    std::memcpy(&record.min, &min_bits, 4);
+    std::memcpy(&record.max, &max_bits, 4);
+    records[name] = record;
+  }
+}
+
+// Replaced in one rename so an interrupted run leaves the previous file intact
+static bool write_records(const std::filesystem::path& path, const std::map<std::string, FrameRecord>& records,
+                          const std::set<std::string>* only) {
+  // A name of its own, as shard workers may write the same updates at once
+  std::string tmp_path = path.string() + ".XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    return false;
+  }
+  fchmod(fd, 0644);
+  close(fd);
+  {
+    std::ofstream file(tmp_path, std::ios::trunc);
+    file << std::hex << std::setfill('0');
+    for (const auto& [name, record] : records) {
+      if (only && only->count(name) == 0) {
+        continue;
+      }
+      uint32_t min_bits, max_bits;
+      std::memcpy(&min_bits, &record.min, 4);
+      std::memcpy(&max_bits, &record.max, 4);
+      file << name << " " << std::setw(16) << record.slice_hash << " " << std::setw(8) << min_bits << " "
+           << std::setw(8) << max_bits << " " << std::setw(16) << record.style_hash << "\n";
+    }
+    if (!file) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, path, ec);
+  if (ec) {
+    unlink(tmp_path.c_str());
+  }
+  return !ec;
+}
+
+RenderManifest::RenderManifest(const std::string& folder) : folder_(folder) {
+  read_records(std::filesystem::path(folder_) / kManifestName, records_);
+}
+
+bool RenderManifest::is_current(const std::string& file_name, const FrameRecord& record) const {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = records_.find(file_name);
+    if (it == records_.end() || !(it->second == record)) {
+      return false;
+    }
+  }
+  std::error_code ec;
+  return std::filesystem::exists(std::filesystem::path(folder_) / file_name, ec);
+}
+
+void RenderManifest::set(const std::string& file_name, const FrameRecord& record) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  records_[file_name] = record;
+  updated_.insert(file_name);
+}
+
+bool RenderManifest::save() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return write_records(std::filesystem::path(folder_) / kManifestName, records_, nullptr);
+}
+
+bool RenderManifest::save_updates(const std::string& filename) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return write_records(filename, records_, &updated_);
+}
+
+bool RenderManifest::load_updates(const std::string& filename) {
+  std::map<std::string, FrameRecord> records;
+  if (!std::filesystem::exists(filename)) {
+    return false;
+  }
+  read_records(filename, records);
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [name, record] : records) {
+    records_[name] = record;
+    updated_.insert(name);
+  }
+  return true;
+}
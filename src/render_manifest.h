@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+// Everything a frame's pixels depend on: the input slice, the colour range and
+// the style (colormap, scale, format). A frame whose record is unchanged and
+// whose file still exists does not need to be encoded again.
+struct FrameRecord {
+  uint64_t slice_hash = 0;
+  float min = 0.0f;
+  float max = 0.0f;
+  uint64_t style_hash = 0;
+
+  bool operator==(const FrameRecord& other) const = default;
+};
+
+// 64-bit FNV-1a over the bytes, taken a word at a time. Only used to notice
+// changed input, not as a cryptographic hash.
+uint64_t fnv1a_hash(const void* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull);
+
+// Records of the frames written to one output folder, kept in
+// <folder>/.render_manifest between runs. Lookups and updates may come from
+// any thread.
+class RenderManifest {
+public:
+  explicit RenderManifest(const std::string& folder);
+
+  // True when file_name was written from the same record and is still on disk
+  bool is_current(const std::string& file_name, const FrameRecord& record) const;
+  void set(const std::string& file_name, const FrameRecord& record);
+  // Entries of frames that were not touched this run are kept
+  bool save() const;
+  // Only the entries set since the manifest was loaded, to the given file, for
+  // a shard worker to hand its part to the merge
+  bool save_updates(const std::string& filename) const;
+  // Sets the entries of a file written by save_updates
+  bool load_updates(const std::string& filename);
+
+private:
+  std::string folder_;
+  std::map<std::string, FrameRecord> records_;
+  std::set<std::string> updated_;
+  mutable std::mutex mutex_;
+};
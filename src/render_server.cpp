@@ -0,0 +1,648 @@
+#include "render_server.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <opencv2/imgcodecs.hpp>
+#include "lru_cache.h"
+
+namespace {
+
+// An encoded frame, or the error that came out of rendering it
+struct EncodedFrame {
+  int status = 200;
+  std::string content_type;
+  std::vector<uint8_t> bytes;
+};
+
+// Everything a frame depends on, parsed from the query string
+struct FrameRequest {
+  const VariableJob* job = nullptr;
+  size_t t = 0;
+  GridRegion region;
+  // The grid points the region resolves to
+  GridWindow window;
+  double scale = 1.0;
+  std::string colormap;
+  bool jpg = false;
+  bool has_range = false;
+  float min = 0.0f;
+  float max = 0.0f;
+};
+
+std::string url_decode(const std::string& text) {
+  std::string out;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '%' && i + 2 < text.size()) {
+      out += static_cast<char>(std::stoi(text.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else if (text[i] == '+') {
+      out += ' ';
+    } else {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+std::map<std::string, std::string> parse_query(const std::string& query) {
+  std::map<std::string, std::string> params;
+  size_t start = 0;
+  while (start < query.size()) {
+    size_t end = query.find('&', start);
+    if (end == std::string::npos) {
+      end = query.size();
+    }
+    std::string pair = query.substr(start, end - start);
+    size_t eq = pair.find('=');
+    if (eq != std::string::npos) {
+      params[url_decode(pair.substr(0, eq))] = url_decode(pair.substr(eq + 1));
+    }
+    start = end + 1;
+  }
+  return params;
+}
+
+bool parse_box(const std::string& text, GridRegion& region) {
+  double v[4];
+  if (sscanf(text.c_str(), "%lf,%lf,%lf,%lf", &v[0], &v[1], &v[2], &v[3]) != 4) {
+    return false;
+  }
+  region.set = true;
+  region.x_min = v[0];
+  region.y_min = v[1];
+  region.x_max = v[2];
+  region.y_max = v[3];
+  return true;
+}
+
+bool send_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    size -= static_cast<size_t>(sent);
+  }
+  return true;
+}
+
+bool send_response(int fd, int status, const std::string& content_type, const uint8_t* body, size_t size, bool keep_alive) {
+  const char* reason = status == 200   ? "OK"
+                       : status == 400 ? "Bad Request"
+                       : status == 404 ? "Not Found"
+                       : status == 503 ? "Service Unavailable"
+                                       : "Internal Server Error";
+  char header[256];
+  int n = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n",
+                   status, reason, content_type.c_str(), size, keep_alive ? "keep-alive" : "close");
+  return send_all(fd, header, static_cast<size_t>(n)) && send_all(fd, reinterpret_cast<const char*>(body), size);
+}
+
+bool send_text(int fd, int status, const std::string& text, bool keep_alive) {
+  return send_response(fd, status, "text/plain", reinterpret_cast<const uint8_t*>(text.data()), text.size(), keep_alive);
+}
+
+// A reader kept between requests. The cache hands out const values, the
+// reader itself is not.
+struct CachedReader {
+  std::unique_ptr<FieldReader> reader;
+};
+
+// What a kept reader is charged against its budget besides the history of a
+// difference, so a run of windows without history cannot pile up readers either
+const size_t kReaderOverheadBytes = size_t(1) << 20;
+
+class RenderServer {
+public:
+  RenderServer(const std::string& input_file, const std::vector<VariableJob>& catalog, RenderContext& context,
+               const ServerOptions& server)
+      : file_(input_file, NcFile::read), catalog_(catalog), context_(context), frames_(server.frame_cache_bytes),
+        slices_(server.slice_cache_bytes), readers_(server.reader_cache_bytes) {
+    nTime_ = file_.getVar("time").getDim(0).getSize();
+    time_labels_ = load_time_labels(file_, nTime_);
+  }
+
+  void handle_connection(int fd);
+
+  // Connections accepted and not closed yet, queued ones included
+  std::atomic<size_t> connections{0};
+
+private:
+  std::shared_ptr<const EncodedFrame> frame(const FrameRequest& request, const std::string& key);
+  std::shared_ptr<const EncodedFrame> render(const FrameRequest& request);
+  std::shared_ptr<const std::vector<float>> slice(const VariableJob& job, const GridWindow& window, size_t t,
+                                                  std::shared_ptr<const CachedReader>& reader);
+  std::pair<float, float> variable_range(const VariableJob& job);
+  std::pair<float, float> scan_range(const VariableJob& job);
+  bool parse_request(const std::map<std::string, std::string>& params, FrameRequest& request, std::string& key,
+                     std::string& error);
+  bool known_colormap(const std::string& name) const;
+  // True while accepted connections wait for a worker, so kept-alive ones should make way
+  bool others_waiting() const { return connections > static_cast<size_t>(context_.pool.size()); }
+
+  NcFile file_;
+  size_t nTime_ = 0;
+  std::vector<std::string> time_labels_;
+  std::vector<VariableJob> catalog_;
+  RenderContext& context_;
+  LruCache<EncodedFrame> frames_;
+  LruCache<std::vector<float>> slices_;
+
+  // Requests being rendered, by key, so a second one for the same frame waits for the first
+  std::mutex in_flight_mutex_;
+  std::map<std::string, std::shared_future<std::shared_ptr<const EncodedFrame>>> in_flight_;
+
+  // NetCDF is not thread safe: the file and the readers are only touched under this lock
+  std::mutex netcdf_mutex_;
+  LruCache<CachedReader> readers_;
+
+  // Colour ranges by variable, each worked out once, see variable_range
+  std::mutex ranges_mutex_;
+  std::map<std::string, std::shared_future<std::pair<float, float>>> ranges_;
+};
+
+bool RenderServer::known_colormap(const std::string& name) const {
+  if (context_.colormaps.has(name)) {
+    return true;
+  }
+  // Variables without a palette of their own draw with viridis
+  return std::any_of(catalog_.begin(), catalog_.end(), [&](const VariableJob& job) { return job.variable_alias == name; });
+}
+
+bool RenderServer::parse_request(const std::map<std::string, std::string>& params, FrameRequest& request, std::string& key,
+                                 std::string& error) {
+  auto param = [&](const char* name) -> const std::string* {
+    auto it = params.find(name);
+    return it == params.end() ? nullptr : &it->second;
+  };
+
+  const std::string* var = param("var");
+  for (const VariableJob& job : catalog_) {
+    if (var && job.variable_alias == *var) {
+      request.job = &job;
+    }
+  }
+  if (!request.job) {
+    error = "unknown or missing var";
+    return false;
+  }
+  if (const std::string* label = param("time")) {
+    auto it = std::find(time_labels_.begin(), time_labels_.end(), *label);
+    if (it == time_labels_.end()) {
+      error = "unknown time";
+      return false;
+    }
+    request.t = static_cast<size_t>(it - time_labels_.begin());
+  } else if (const std::string* t = param("t")) {
+    request.t = std::stoull(*t);
+  }
+  if (request.t >= nTime_) {
+    error = "time step out of range";
+    return false;
+  }
+  if (const std::string* bbox = param("bbox")) {
+    if (!parse_box(*bbox, request.region)) {
+      error = "bbox expects x_min,y_min,x_max,y_max";
+      return false;
+    }
+  } else if (const std::string* bbox = param("bbox_xy")) {
+    request.region.projected = true;
+    if (!parse_box(*bbox, request.region)) {
+      error = "bbox_xy expects x_min,y_min,x_max,y_max";
+      return false;
+    }
+  }
+  if (const std::string* stride = param("stride")) {
+    request.region.stride = std::max<size_t>(1, std::stoull(*stride));
+  }
+  if (const std::string* scale = param("scale")) {
+    request.scale = std::stod(*scale);
+    if (!(request.scale > 0.0 && request.scale <= 4.0)) {
+      error = "scale must be in (0, 4]";
+      return false;
+    }
+  }
+  const std::string* colormap = param("colormap");
+  request.colormap = colormap ? *colormap
+                              : request.job->derived.colormap.empty() ? request.job->variable_alias : request.job->derived.colormap;
+  // Checked before the registry bakes anything under the name, which would keep it for good
+  if (colormap && !known_colormap(*colormap)) {
+    error = "unknown colormap";
+    return false;
+  }
+  if (const std::string* format = param("format")) {
+    if (*format != "png" && *format != "jpg") {
+      error = "format must be png or jpg";
+      return false;
+    }
+    request.jpg = *format == "jpg";
+  }
+  const std::string* min = param("min");
+  const std::string* max = param("max");
+  if (min && max) {
+    request.has_range = true;
+    request.min = std::stof(*min);
+    request.max = std::stof(*max);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(netcdf_mutex_);
+    size_t nLat = file_.getVar("y").getDim(0).getSize();
+    size_t nLon = file_.getVar("x").getDim(0).getSize();
+    try {
+      request.window = resolve_region(file_, file_.getVar(request.job->variable_name), request.region, nLat, nLon);
+    } catch (const std::invalid_argument& e) {
+      error = e.what();
+      return false;
+    }
+  }
+
+  // Keyed on the grid points drawn rather than the box asked for, and with
+  // every bit of the floats, so only requests for the same pixels share a frame
+  const GridWindow& window = request.window;
+  char text[256];
+  snprintf(text, sizeof(text), "|%zu|%zu,%zu,%zu,%zu,%zu|%.17g|%d|%d|%.9g|%.9g", request.t, window.y0, window.x0, window.ny,
+           window.nx, window.stride, request.scale, request.jpg, request.has_range, request.min, request.max);
+  key = request.job->variable_alias + "|" + request.colormap + text;
+  return true;
+}
+
+std::pair<float, float> RenderServer::variable_range(const VariableJob& job) {
+  // The first request for a variable works its range out, others for it wait
+  // for the result; requests for anything else carry on meanwhile
+  std::promise<std::pair<float, float>> promise;
+  std::shared_future<std::pair<float, float>> result;
+  bool owner = false;
+  {
+    std::lock_guard<std::mutex> lock(ranges_mutex_);
+    auto it = ranges_.find(job.variable_alias);
+    if (it != ranges_.end()) {
+      result = it->second;
+    } else {
+      result = promise.get_future().share();
+      ranges_[job.variable_alias] = result;
+      owner = true;
+    }
+  }
+  if (!owner) {
+    return result.get();
+  }
+  try {
+    std::pair<float, float> range = scan_range(job);
+    promise.set_value(range);
+    return range;
+  } catch (...) {
+    // Left for a later request to try again
+    promise.set_exception(std::current_exception());
+    std::lock_guard<std::mutex> lock(ranges_mutex_);
+    ranges_.erase(job.variable_alias);
+    throw;
+  }
+}
+
+std::pair<float, float> RenderServer::scan_range(const VariableJob& job) {
+  const RangePolicy policy = range_policy_for(context_.options.range_policies, job.variable_alias);
+  if (policy.mode == RangeMode::fixed) {
+    return {policy.min, policy.max};
+  }
+  if (policy.mode == RangeMode::rolling) {
+    if (std::optional<std::pair<float, float>> cached = read_range_cache(job.output_folder)) {
+      return *cached;
+    }
+  }
+
+  // A pass over the whole grid, with the NetCDF lock only held for each read
+  // so the other requests' reads go in between
+  std::unique_lock<std::mutex> lock(netcdf_mutex_);
+  NcVar var;
+  size_t nTime, nLat, nLon;
+  std::tie(var, nTime, nLat, nLon) = load_netcdf_variable(file_, job.variable_name);
+  FieldReader reader(file_, var, job.derived, nTime, full_window(nLat, nLon));
+  const size_t slice_size = nLat * nLon;
+  const size_t block_steps = reader.aligned_block_steps(1);
+  lock.unlock();
+
+  std::vector<float> buffer(block_steps * slice_size);
+  RangeHistogram histogram;
+  std::vector<std::pair<float, float>> slice_ranges(policy.mode == RangeMode::percentile ? 0 : nTime);
+  ScopedTimer timer(context_.metrics, "range_scan", job.variable_alias);
+  for (size_t t0 = 0; t0 < nTime; t0 += block_steps) {
+    size_t nt = std::min(block_steps, nTime - t0);
+    lock.lock();
+    reader.read(t0, nt, buffer.data());
+    lock.unlock();
+    if (policy.mode == RangeMode::percentile) {
+      histogram.add(buffer.data(), nt * slice_size, policy.min_threshold, policy.max_threshold);
+      continue;
+    }
+    for (size_t i = 0; i < nt; i++) {
+      slice_ranges[t0 + i] = get_slice_range(buffer.data() + i * slice_size, slice_size, policy.min_threshold, policy.max_threshold);
+    }
+  }
+
+  if (policy.mode == RangeMode::percentile) {
+    auto range = histogram.percentile_range(policy.lower_percentile, policy.upper_percentile);
+    return range ? *range : std::make_pair(policy.max_threshold, policy.min_threshold);
+  }
+  return combine_ranges(slice_ranges, policy.min_threshold, policy.max_threshold);
+}
+
+// The field of one time step, followed by its arrow directions if it has any
+std::shared_ptr<const std::vector<float>> RenderServer::slice(const VariableJob& job, const GridWindow& window, size_t t,
+                                                              std::shared_ptr<const CachedReader>& cached) {
+  char text[160];
+  int n = snprintf(text, sizeof(text), "|%zu,%zu,%zu,%zu,%zu", window.y0, window.x0, window.ny, window.nx, window.stride);
+  std::string reader_key = job.variable_alias + std::string(text, static_cast<size_t>(n));
+  std::string key = reader_key + "|" + std::to_string(t);
+
+  std::lock_guard<std::mutex> lock(netcdf_mutex_);
+  // One reader per field and window, kept while it fits the budget so its
+  // chunk cache and difference history stay warm. One evicted while a
+  // request still uses it lives until that request is done.
+  cached = readers_.get(reader_key);
+  if (!cached) {
+    auto created = std::make_shared<CachedReader>();
+    created->reader = std::make_unique<FieldReader>(file_, file_.getVar(job.variable_name), job.derived, nTime_, window);
+    cached = created;
+  }
+  FieldReader* reader = cached->reader.get();
+  if (auto hot = slices_.get(key)) {
+    readers_.put(reader_key, cached, kReaderOverheadBytes + reader->history_bytes());
+    return hot;
+  }
+  const size_t slice_size = window.rows() * window.cols();
+  const size_t arrow_size = reader->has_arrows() ? reader->arrow_window().rows() * reader->arrow_window().cols() : 0;
+  auto values = std::make_shared<std::vector<float>>(slice_size + arrow_size);
+  {
+    ScopedTimer timer(context_.metrics, "getvar", job.variable_alias);
+    reader->read(t, 1, values->data());
+    if (arrow_size > 0) {
+      reader->read_arrows(t, 1);
+      std::copy_n(reader->arrow_directions(t), arrow_size, values->data() + slice_size);
+    }
+  }
+  slices_.put(key, values, values->size() * sizeof(float));
+  // Charged after the read, which is when a difference fills its history
+  readers_.put(reader_key, cached, kReaderOverheadBytes + reader->history_bytes());
+  return values;
+}
+
+std::shared_ptr<const EncodedFrame> RenderServer::render(const FrameRequest& request) {
+  const VariableJob& job = *request.job;
+  const GridWindow& window = request.window;
+  std::pair<float, float> range{request.min, request.max};
+  if (!request.has_range) {
+    range = variable_range(job);
+  }
+  std::shared_ptr<const CachedReader> cached;
+  std::shared_ptr<const std::vector<float>> values = slice(job, window, request.t, cached);
+  const FieldReader* reader = cached->reader.get();
+
+  auto frame = std::make_shared<EncodedFrame>();
+  ScopedTimer timer(context_.metrics, "colorize", job.variable_alias);
+  const float* arrows = values->data() + window.rows() * window.cols();
+  if (request.jpg) {
+    // Colorized straight from the field, so it can use the finer LUT of --colormap_size
+    const ColorLUT& lut = cached_colormap(context_, request.colormap, context_.options.colormap_size);
+    Mat img;
+    img.allocator = &context_.frame_pool;
+    colorize_scaled(values->data(), window.rows(), window.cols(), lut, range.first, range.second, request.scale, img);
+    if (reader->has_arrows()) {
+      draw_arrows(img, arrows, reader->arrow_window(), window, request.scale, lut);
+    }
+    std::vector<uchar> jpg;
+    if (!cv::imencode(".jpg", img, jpg)) {
+      throw std::runtime_error("could not encode the frame");
+    }
+    frame->bytes.assign(jpg.begin(), jpg.end());
+    frame->content_type = "image/jpeg";
+  } else {
+    const ColorLUT& lut = cached_colormap(context_, request.colormap, 256);
+    Mat indices;
+    indices.allocator = &context_.frame_pool;
+    index_scaled(values->data(), window.rows(), window.cols(), lut, range.first, range.second, request.scale, indices);
+    if (reader->has_arrows()) {
+      draw_arrows(indices, arrows, reader->arrow_window(), window, request.scale, lut);
+    }
+    if (!encode_indexed_png(indices.ptr<uint8_t>(0), indices.cols, indices.rows, indices.step, lut, 1, -1, frame->bytes)) {
+      throw std::runtime_error("could not encode the frame");
+    }
+    frame->content_type = "image/png";
+  }
+  return frame;
+}
+
+std::shared_ptr<const EncodedFrame> RenderServer::frame(const FrameRequest& request, const std::string& key) {
+  if (auto cached = frames_.get(key)) {
+    context_.metrics.add_count("frame_cache_hits", request.job->variable_alias, 1);
+    return cached;
+  }
+
+  // The first request for a frame renders it, identical ones arriving meanwhile wait for its result
+  std::promise<std::shared_ptr<const EncodedFrame>> promise;
+  std::shared_future<std::shared_ptr<const EncodedFrame>> result;
+  bool owner = false;
+  {
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    auto it = in_flight_.find(key);
+    if (it != in_flight_.end()) {
+      result = it->second;
+    } else {
+      result = promise.get_future().share();
+      in_flight_[key] = result;
+      owner = true;
+    }
+  }
+  if (!owner) {
+    context_.metrics.add_count("requests_coalesced", request.job->variable_alias, 1);
+    return result.get();
+  }
+
+  // The key is freed for later requests however the render ends, after the waiters have their result
+  std::shared_ptr<void> release(nullptr, [this, &key](void*) {
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    in_flight_.erase(key);
+  });
+  auto failed = [](const std::string& what) {
+    auto frame = std::make_shared<EncodedFrame>();
+    frame->status = 500;
+    frame->content_type = "text/plain";
+    std::string message = "Error: " + what + "\n";
+    frame->bytes.assign(message.begin(), message.end());
+    return frame;
+  };
+  std::shared_ptr<const EncodedFrame> frame;
+  try {
+    frame = render(request);
+    frames_.put(key, frame, frame->bytes.size());
+  } catch (const std::exception& e) {
+    frame = failed(e.what());
+  } catch (...) {
+    frame = failed("unknown error");
+  }
+  promise.set_value(frame);
+  return frame;
+}
+
+void RenderServer::handle_connection(int fd) {
+  // A client that stops halfway through a request is dropped
+  timeval timeout{5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  // Header and body go out in separate sends, without this the body waits for the client's delayed ACK
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  std::string buffer;
+  char chunk[4096];
+  bool keep_alive = true;
+  while (keep_alive) {
+    // Between requests a kept-alive connection holds a worker: it is closed
+    // after 5 s idle, or straight away once other connections are queued
+    for (int waited = 0; buffer.empty(); waited++) {
+      pollfd pfd{fd, POLLIN, 0};
+      int ready = poll(&pfd, 1, 100);
+      if (ready > 0) {
+        break;
+      }
+      if (ready < 0 && errno != EINTR) {
+        keep_alive = false;
+        break;
+      }
+      if (waited == 50 || others_waiting()) {
+        keep_alive = false;
+        break;
+      }
+    }
+    if (!keep_alive) {
+      break;
+    }
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0 || buffer.size() > 65536) {
+        close(fd);
+        return;
+      }
+      buffer.append(chunk, static_cast<size_t>(n));
+    }
+    std::string head = buffer.substr(0, end);
+    buffer.erase(0, end + 4);
+
+    auto start = std::chrono::steady_clock::now();
+    std::string method, target, version;
+    std::istringstream line(head.substr(0, head.find("\r\n")));
+    line >> method >> target >> version;
+    std::string lower = head;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+    keep_alive = version == "HTTP/1.1" ? lower.find("connection: close") == std::string::npos
+                                       : lower.find("connection: keep-alive") != std::string::npos;
+    // A client sending request after request would otherwise never let the worker go
+    keep_alive = keep_alive && !others_waiting();
+
+    size_t q = target.find('?');
+    std::string path = target.substr(0, q);
+    bool sent;
+    if (method != "GET") {
+      sent = send_text(fd, 400, "Only GET is supported\n", false);
+      keep_alive = false;
+    } else if (path == "/metrics") {
+      std::string text = context_.metrics.to_prometheus();
+      sent = send_text(fd, 200, text, keep_alive);
+    } else if (path == "/render") {
+      FrameRequest request;
+      std::string key, error;
+      bool parsed = false;
+      try {
+        parsed = parse_request(parse_query(q == std::string::npos ? "" : target.substr(q + 1)), request, key, error);
+      } catch (const std::exception& e) {
+        error = "bad parameter value";
+      }
+      if (!parsed) {
+        sent = send_text(fd, 400, "Error: " + error + "\n", keep_alive);
+      } else {
+        std::shared_ptr<const EncodedFrame> frame = this->frame(request, key);
+        sent = send_response(fd, frame->status, frame->content_type, frame->bytes.data(), frame->bytes.size(), keep_alive);
+        context_.metrics.add_time("request", request.job->variable_alias,
+                                  std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+      }
+    } else {
+      sent = send_text(fd, 404, "Not found\n", keep_alive);
+    }
+    if (!sent) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+}  // namespace
+
+int run_server(const std::string& input_file, const std::vector<VariableJob>& catalog, RenderContext& context,
+               const ServerOptions& server, const std::atomic<bool>& stop) {
+  std::unique_ptr<RenderServer> renderer;
+  try {
+    renderer = std::make_unique<RenderServer>(input_file, catalog, context, server);
+  } catch (const NcException& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(static_cast<uint16_t>(server.port));
+  // Local only, the web layer in front of it does the rest
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 128) != 0) {
+    std::cerr << "Error: Could not listen on port " << server.port << ": " << strerror(errno) << std::endl;
+    if (listener >= 0) {
+      close(listener);
+    }
+    return 1;
+  }
+  std::cout << "Serving " << input_file << " on http://127.0.0.1:" << server.port << " with " << context.pool.size()
+            << " workers" << std::endl;
+
+  // Poll with a timeout so a stop request is seen while no one connects
+  while (!stop) {
+    pollfd pfd{listener, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) <= 0) {
+      continue;
+    }
+    int fd = accept(listener, nullptr, nullptr);
+    if (fd < 0) {
+      continue;
+    }
+    // Past the cap new clients are turned away rather than queued behind the others
+    if (renderer->connections >= server.max_connections) {
+      send_text(fd, 503, "Error: too many connections\n", false);
+      close(fd);
+      context.metrics.add_count("connections_refused", "", 1);
+      continue;
+    }
+    renderer->connections++;
+    context.pool.push([&renderer, fd](int) {
+      renderer->handle_connection(fd);
+      renderer->connections--;
+    });
+  }
+  close(listener);
+  // Let the connections being served finish before the renderer goes away
+  context.pool.stop(true);
+  std::cout << "Stopping" << std::endl;
+  return 0;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "create_images.h"
+
+// Settings of --serve
+struct ServerOptions {
+  int port = 0;
+  // Connections served at once, 0 for one per core
+  size_t threads = 0;
+  // Connections open at once, queued ones included; more are answered with 503
+  size_t max_connections = 256;
+  // Budgets of the encoded frame cache, of the field slices kept in memory and
+  // of the readers kept open per field and window
+  size_t frame_cache_bytes = size_t(256) << 20;
+  size_t slice_cache_bytes = size_t(1024) << 20;
+  size_t reader_cache_bytes = size_t(512) << 20;
+};
+
+// Serves frames rendered on demand over HTTP on 127.0.0.1:<port>:
+//
+//   GET /render?var=<alias>&t=<index>|time=<YYYYMMDD_HH>[&bbox=x0,y0,x1,y1|bbox_xy=...][&stride=n]
+//              [&scale=f][&colormap=<alias>][&format=png|jpg][&min=v&max=v]
+//   GET /metrics   stage timings and counters, Prometheus text format
+//
+// The catalog's jobs name the variables that can be asked for. The file stays
+// open, field slices and encoded frames are kept in LRU caches, and identical
+// requests in flight are rendered once. NetCDF reads are serialised, the rest
+// of a render runs in parallel on the context's workers. Unknown colormaps and
+// formats and boxes that select no grid points are answered with 400. Without
+// min and max the colour range is the variable's range policy over the whole
+// grid, worked out once on the first request for it; the scan only holds the
+// NetCDF lock for each of its reads, so other requests are served meanwhile.
+// Runs until stop turns true.
+int run_server(const std::string& input_file, const std::vector<VariableJob>& catalog, RenderContext& context,
+               const ServerOptions& server, const std::atomic<bool>& stop);
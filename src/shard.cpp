@@ -0,0 +1,714 @@
+#include "shard.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace {
+
+// One unit of the plan: a range unit measures the values of its time steps,
+// a frame unit draws them
+struct PlannedUnit {
+  std::string id;
+  bool frames = false;
+  std::string alias;
+  size_t t0 = 0;
+  size_t t1 = 0;
+  size_t owner = 0;
+};
+
+struct ShardPlan {
+  uint64_t identity = 0;
+  size_t workers = 1;
+  std::vector<PlannedUnit> units;
+  // Variables whose colour range was known when planning (fixed, or rolling with a cache)
+  std::set<std::string> known_ranges;
+};
+
+std::filesystem::path shard_path(const ShardOptions& shard, const std::string& sub) {
+  return std::filesystem::path(shard.dir) / sub;
+}
+
+std::filesystem::path queue_path(const ShardOptions& shard, const char* queue, size_t worker) {
+  return std::filesystem::path(shard.dir) / queue / std::to_string(worker);
+}
+
+bool move_file(const std::filesystem::path& from, const std::filesystem::path& to) {
+  // rename is atomic: when several workers try the same unit, exactly one of them gets it
+  return std::rename(from.c_str(), to.c_str()) == 0;
+}
+
+bool touch(const std::filesystem::path& path) {
+  return static_cast<bool>(std::ofstream(path, std::ios::trunc));
+}
+
+std::vector<std::string> list_units(const std::filesystem::path& dir) {
+  std::vector<std::string> names;
+  std::error_code ec;
+  for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+    names.push_back(entry.path().filename().string());
+  }
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+bool any_units(const ShardOptions& shard, const char* queue, size_t workers) {
+  for (size_t w = 0; w < workers; w++) {
+    if (!list_units(queue_path(shard, queue, w)).empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Who holds a claim, written into the claimed unit: host, process and queue
+std::string claim_token(const ShardOptions& shard) {
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  return std::string(host) + " " + std::to_string(getpid()) + " " + std::to_string(shard.worker_id);
+}
+
+bool holds_claim(const ShardOptions& shard, const std::string& id, const std::string& token) {
+  std::ifstream file(shard_path(shard, "claimed") / id);
+  std::string line;
+  return std::getline(file, line) && line == token;
+}
+
+// Seconds since the unit was claimed or its worker last said it was alive
+double claim_age(const std::filesystem::path& path) {
+  std::error_code ec;
+  auto mtime = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return 0;
+  }
+  return std::chrono::duration<double>(std::filesystem::file_time_type::clock::now() - mtime).count();
+}
+
+// Keeps the mtime of a claim fresh while its unit runs, so idle workers can
+// tell it from the claim of a worker that died
+class ClaimHeartbeat {
+ public:
+  ClaimHeartbeat(std::filesystem::path path, double interval_seconds)
+      : path_(std::move(path)), thread_([this, interval_seconds] {
+          std::unique_lock<std::mutex> lock(mutex_);
+          while (!stopped_.wait_for(lock, std::chrono::duration<double>(interval_seconds), [this] { return stop_; })) {
+            std::error_code ec;
+            std::filesystem::last_write_time(path_, std::filesystem::file_time_type::clock::now(), ec);
+          }
+        }) {}
+
+  ~ClaimHeartbeat() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    stopped_.notify_all();
+    thread_.join();
+  }
+
+ private:
+  std::filesystem::path path_;
+  std::mutex mutex_;
+  std::condition_variable stopped_;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+// Text, written under a name of its own and renamed so readers never see half of
+// it; every worker may write the same range at once, so none share a temporary
+bool write_atomically(const std::filesystem::path& path, const std::string& text) {
+  std::string tmp_path = path.string() + ".XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    return false;
+  }
+  const char* data = text.data();
+  size_t left = text.size();
+  while (left > 0) {
+    ssize_t n = write(fd, data, left);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    data += n;
+    left -= static_cast<size_t>(n);
+  }
+  // Flushed before the rename, or a crash could leave the new name on an empty file
+  bool ok = left == 0 && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok || !move_file(tmp_path, path)) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool write_range(const ShardOptions& shard, const std::string& alias, std::pair<float, float> range) {
+  std::ostringstream text;
+  // Enough digits for the floats to read back exactly
+  text << std::setprecision(9) << range.first << " " << range.second << "\n";
+  return write_atomically(shard_path(shard, "ranges") / alias, text.str());
+}
+
+std::optional<std::pair<float, float>> read_range(const ShardOptions& shard, const std::string& alias) {
+  std::ifstream file(shard_path(shard, "ranges") / alias);
+  float min, max;
+  if (!(file >> min >> max)) {
+    return std::nullopt;
+  }
+  return std::make_pair(min, max);
+}
+
+// identity <hex>
+// workers <n>
+// known <variable>
+// unit <id> <range|frames> <variable> <t0> <t1> <owner>
+bool read_plan(const ShardOptions& shard, ShardPlan& plan) {
+  std::ifstream file(shard_path(shard, "plan"));
+  if (!file) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream ss(line);
+    std::string key;
+    ss >> key;
+    if (key == "identity") {
+      ss >> std::hex >> plan.identity;
+    } else if (key == "workers") {
+      ss >> plan.workers;
+    } else if (key == "known") {
+      std::string alias;
+      ss >> alias;
+      plan.known_ranges.insert(alias);
+    } else if (key == "unit") {
+      PlannedUnit unit;
+      std::string kind;
+      if (!(ss >> unit.id >> kind >> unit.alias >> unit.t0 >> unit.t1 >> unit.owner)) {
+        return false;
+      }
+      unit.frames = kind == "frames";
+      plan.units.push_back(unit);
+    }
+  }
+  return plan.workers > 0;
+}
+
+// Size, mtime and the netCDF header of the input, but not its path: machines
+// may mount the shared filesystem in different places
+uint64_t input_identity(const std::string& input_file) {
+  int fd = open(input_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  std::vector<char> head(64 * 1024);
+  ssize_t n = fstat(fd, &st) == 0 ? pread(fd, head.data(), head.size(), 0) : -1;
+  close(fd);
+  if (n < 0) {
+    return 0;
+  }
+  uint64_t size = static_cast<uint64_t>(st.st_size);
+  int64_t mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  uint64_t identity = fnv1a_hash(head.data(), static_cast<size_t>(n));
+  identity = fnv1a_hash(&size, sizeof(size), identity);
+  return fnv1a_hash(&mtime_ns, sizeof(mtime_ns), identity);
+}
+
+bool check_identity(const std::string& input_file, const ShardPlan& plan) {
+  if (input_identity(input_file) != plan.identity) {
+    std::cerr << "Error: " << input_file << " is not the file the shards were planned for" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+const VariableJob* find_job(const std::vector<VariableJob>& jobs, const std::string& alias) {
+  for (const VariableJob& job : jobs) {
+    if (job.variable_alias == alias) {
+      return &job;
+    }
+  }
+  return nullptr;
+}
+
+// True when every blocked frame unit belongs to a variable one of whose range units failed
+bool blocked_for_good(const ShardOptions& shard, const ShardPlan& plan) {
+  std::set<std::string> failed;
+  for (const PlannedUnit& unit : plan.units) {
+    if (!unit.frames && std::filesystem::exists(shard_path(shard, "failed") / unit.id)) {
+      failed.insert(unit.alias);
+    }
+  }
+  for (const PlannedUnit& unit : plan.units) {
+    if (unit.frames && failed.count(unit.alias) == 0 && std::filesystem::exists(queue_path(shard, "blocked", unit.owner) / unit.id)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Renames a queued unit into claimed and signs it. The mtime is refreshed
+// first, as rename keeps the one the unit was queued with and an old claim
+// would look stale before it is signed.
+bool take_unit(const ShardOptions& shard, const std::filesystem::path& from, const std::string& id, const std::string& token) {
+  std::error_code ec;
+  std::filesystem::last_write_time(from, std::filesystem::file_time_type::clock::now(), ec);
+  if (ec || !move_file(from, shard_path(shard, "claimed") / id)) {
+    return false;
+  }
+  std::ofstream(shard_path(shard, "claimed") / id, std::ios::trunc) << token << "\n";
+  return true;
+}
+
+// Own queue from the front, then the other queues from the back, so a thief
+// takes the units their owner would have reached last
+std::optional<std::string> claim_unit(const ShardOptions& shard, size_t workers, const std::string& token) {
+  for (const std::string& id : list_units(queue_path(shard, "queue", shard.worker_id))) {
+    if (take_unit(shard, queue_path(shard, "queue", shard.worker_id) / id, id, token)) {
+      return id;
+    }
+  }
+  for (size_t k = 1; k < workers; k++) {
+    size_t victim = (shard.worker_id + k) % workers;
+    std::vector<std::string> ids = list_units(queue_path(shard, "queue", victim));
+    for (auto it = ids.rbegin(); it != ids.rend(); ++it) {
+      if (take_unit(shard, queue_path(shard, "queue", victim) / *it, *it, token)) {
+        std::cout << "Took " << *it << " from worker " << victim << std::endl;
+        return *it;
+      }
+    }
+  }
+  return std::nullopt;
+}
+
+// Moves claims not refreshed within the lease back into their owner's queue.
+// Only one of the workers doing this at once wins each rename.
+size_t requeue_stale_claims(const ShardOptions& shard, const ShardPlan& plan) {
+  size_t requeued = 0;
+  for (const std::string& id : list_units(shard_path(shard, "claimed"))) {
+    std::filesystem::path path = shard_path(shard, "claimed") / id;
+    double age = claim_age(path);
+    if (age <= shard.lease_seconds) {
+      continue;
+    }
+    auto planned = std::find_if(plan.units.begin(), plan.units.end(), [&](const PlannedUnit& unit) { return unit.id == id; });
+    if (planned == plan.units.end()) {
+      continue;
+    }
+    std::string holder;
+    std::getline(std::ifstream(path), holder);
+    if (move_file(path, queue_path(shard, "queue", planned->owner) / id)) {
+      std::cout << "Re-queued " << id << ", claimed by " << (holder.empty() ? "?" : holder) << " and silent for "
+                << static_cast<int>(age) << " s" << std::endl;
+      requeued++;
+    }
+  }
+  return requeued;
+}
+
+// Histogram of the values of one range unit, which gives both the min/max of a
+// scan and the percentiles, and merges exactly with the other units'
+void measure_unit(NcFile& dataFile, const VariableJob& job, RenderContext& context, const PlannedUnit& unit,
+                  const std::filesystem::path& result_path) {
+  const RenderOptions& options = context.options;
+  std::cout << "Measuring the range of " << job.variable_alias << ", time steps " << unit.t0 << "-" << unit.t1 - 1 << std::endl;
+  NcVar var;
+  size_t nTime, nLat, nLon;
+  std::tie(var, nTime, nLat, nLon) = load_netcdf_variable(dataFile, job.variable_name);
+  const GridWindow window = resolve_region(dataFile, var, options.region, nLat, nLon);
+  FieldReader reader(dataFile, var, job.derived, nTime, window);
+  const RangePolicy policy = range_policy_for(options.range_policies, job.variable_alias);
+
+  ScopedTimer timer(context.metrics, "range_scan", job.variable_alias);
+  const size_t slice_size = window.rows() * window.cols();
+  // A unit past the end of the file measures nothing and leaves an empty histogram
+  const size_t t_begin = std::min(unit.t0, nTime);
+  const size_t t1 = std::clamp(unit.t1, t_begin, nTime);
+  size_t max_steps = std::max<size_t>(t1 - t_begin, 1);
+  if (options.memory_limit_bytes > 0) {
+    max_steps = std::clamp<size_t>(options.memory_limit_bytes / (slice_size * sizeof(float)), 1, max_steps);
+  }
+  const size_t block_steps = reader.aligned_block_steps(max_steps);
+  std::vector<float> block(block_steps * slice_size);
+  RangeHistogram histogram;
+  for (size_t t0 = t_begin; t0 < t1; t0 += block_steps) {
+    size_t nt = std::min(block_steps, t1 - t0);
+    reader.read(t0, nt, block.data());
+    histogram.add(block.data(), nt * slice_size, policy.min_threshold, policy.max_threshold);
+  }
+  const ReadStats& read_stats = reader.input().stats();
+  context.metrics.add_time("getvar", job.variable_alias, read_stats.seconds, read_stats.reads);
+  context.metrics.add_count("bytes_read", job.variable_alias, read_stats.bytes_used);
+  context.metrics.add_count("bytes_decompressed_estimated", job.variable_alias, read_stats.bytes_decompressed_estimated);
+  if (!histogram.save(result_path.string())) {
+    throw std::runtime_error("Could not write " + result_path.string());
+  }
+}
+
+// Once every range unit of a variable is done, works out its colour range and
+// moves its frame units from blocked into the queues. Several workers may get
+// here at once; they write the same range and only one moves each unit.
+bool release_frames(const ShardOptions& shard, const ShardPlan& plan, const RenderOptions& options, const std::string& alias) {
+  RangeHistogram total;
+  for (const PlannedUnit& unit : plan.units) {
+    if (unit.alias != alias || unit.frames) {
+      continue;
+    }
+    if (!std::filesystem::exists(shard_path(shard, "done") / unit.id)) {
+      return true;
+    }
+    RangeHistogram histogram;
+    if (!histogram.load((shard_path(shard, "results") / (unit.id + ".hist")).string())) {
+      std::cerr << "Error: Could not read the range of " << unit.id << std::endl;
+      return false;
+    }
+    total.merge(histogram);
+  }
+  const RangePolicy policy = range_policy_for(options.range_policies, alias);
+  std::optional<std::pair<float, float>> range =
+      policy.mode == RangeMode::percentile ? total.percentile_range(policy.lower_percentile, policy.upper_percentile) : total.value_range();
+  if (!write_range(shard, alias, range ? *range : std::make_pair(policy.max_threshold, policy.min_threshold))) {
+    std::cerr << "Error: Could not write the range of " << alias << std::endl;
+    return false;
+  }
+  for (const PlannedUnit& unit : plan.units) {
+    if (unit.alias == alias && unit.frames) {
+      move_file(queue_path(shard, "blocked", unit.owner) / unit.id, queue_path(shard, "queue", unit.owner) / unit.id);
+    }
+  }
+  return true;
+}
+
+// Releases the frames of every variable whose range units are all done. Run by
+// idle workers, so frames still go out when the worker that finished the last
+// range unit died before releasing them.
+bool release_finished_ranges(const ShardOptions& shard, const ShardPlan& plan, const RenderOptions& options) {
+  std::set<std::string> waiting;
+  for (const PlannedUnit& unit : plan.units) {
+    if (unit.frames && std::filesystem::exists(queue_path(shard, "blocked", unit.owner) / unit.id)) {
+      waiting.insert(unit.alias);
+    }
+  }
+  bool ok = true;
+  for (const std::string& alias : waiting) {
+    ok = release_frames(shard, plan, options, alias) && ok;
+  }
+  return ok;
+}
+
+}  // namespace
+
+bool plan_shards(const std::string& input_file, const std::vector<VariableJob>& jobs, RenderContext& context,
+                 const ShardOptions& shard) {
+  const RenderOptions& options = context.options;
+  ShardPlan plan;
+  plan.workers = std::max<size_t>(1, shard.workers);
+  plan.identity = input_identity(input_file);
+
+  // Units of earlier plans go, anything else in the directory stays
+  std::error_code ec;
+  for (const char* sub : {"plan", "queue", "blocked", "claimed", "done", "failed", "results", "ranges"}) {
+    std::filesystem::remove_all(shard_path(shard, sub), ec);
+  }
+  for (size_t w = 0; w < plan.workers; w++) {
+    std::filesystem::create_directories(queue_path(shard, "queue", w), ec);
+    std::filesystem::create_directories(queue_path(shard, "blocked", w), ec);
+  }
+  for (const char* sub : {"claimed", "done", "failed", "results", "ranges"}) {
+    std::filesystem::create_directories(shard_path(shard, sub), ec);
+  }
+  if (ec) {
+    std::cerr << "Error: Could not create the shard directory " << shard.dir << ": " << ec.message() << std::endl;
+    return false;
+  }
+
+  std::vector<PlannedUnit> range_units, frame_units;
+  try {
+    NcFile dataFile(input_file, NcFile::read);
+    for (const VariableJob& job : jobs) {
+      NcVar var;
+      size_t nTime, nLat, nLon;
+      std::tie(var, nTime, nLat, nLon) = load_netcdf_variable(dataFile, job.variable_name);
+      // Units that end on chunk boundaries along time never split a chunk between two workers
+      VariableReader reader(var, nTime, full_window(nLat, nLon), false);
+      const size_t unit_steps = reader.aligned_block_steps(std::max<size_t>(1, shard.steps_per_unit));
+
+      // As in a single process: a fixed range, or the one cached by the previous run, needs no measuring
+      const RangePolicy policy = range_policy_for(options.range_policies, job.variable_alias);
+      std::optional<std::pair<float, float>> known_range;
+      if (policy.mode == RangeMode::fixed) {
+        known_range = std::make_pair(policy.min, policy.max);
+      } else if (policy.mode == RangeMode::rolling) {
+        known_range = read_range_cache(job.output_folder);
+      }
+      if (known_range) {
+        plan.known_ranges.insert(job.variable_alias);
+        if (!write_range(shard, job.variable_alias, *known_range)) {
+          std::cerr << "Error: Could not write the range of " << job.variable_alias << std::endl;
+          return false;
+        }
+      }
+
+      for (size_t t0 = 0; t0 < nTime; t0 += unit_steps) {
+        PlannedUnit unit;
+        unit.alias = job.variable_alias;
+        unit.t0 = t0;
+        unit.t1 = std::min(nTime, t0 + unit_steps);
+        frame_units.push_back(unit);
+        if (!known_range) {
+          range_units.push_back(unit);
+        }
+      }
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    return false;
+  }
+
+  // Range units come first in every queue, so the frames they hold up are released early
+  std::ostringstream text;
+  text << "identity " << std::hex << plan.identity << std::dec << "\n";
+  text << "workers " << plan.workers << "\n";
+  for (const std::string& alias : plan.known_ranges) {
+    text << "known " << alias << "\n";
+  }
+  size_t n = 0;
+  for (std::vector<PlannedUnit>* units : {&range_units, &frame_units}) {
+    const bool frames = units == &frame_units;
+    for (PlannedUnit& unit : *units) {
+      char id[32];
+      snprintf(id, sizeof(id), "%05zu", n);
+      unit.id = std::string(id) + "-" + (frames ? "frames" : "range") + "-" + unit.alias + "-" + std::to_string(unit.t0);
+      unit.frames = frames;
+      unit.owner = n % plan.workers;
+      n++;
+      bool blocked = frames && plan.known_ranges.count(unit.alias) == 0;
+      if (!touch(queue_path(shard, blocked ? "blocked" : "queue", unit.owner) / unit.id)) {
+        std::cerr << "Error: Could not queue " << unit.id << std::endl;
+        return false;
+      }
+      text << "unit " << unit.id << " " << (frames ? "frames" : "range") << " " << unit.alias << " " << unit.t0 << " "
+           << unit.t1 << " " << unit.owner << "\n";
+    }
+  }
+  // Written last, workers wait for it
+  if (!write_atomically(shard_path(shard, "plan"), text.str())) {
+    std::cerr << "Error: Could not write the shard plan in " << shard.dir << std::endl;
+    return false;
+  }
+  std::cout << "Planned " << range_units.size() << " range and " << frame_units.size() << " frame units for "
+            << plan.workers << " workers in " << shard.dir << std::endl;
+  return true;
+}
+
+bool run_shard_worker(const std::string& input_file, const std::vector<VariableJob>& jobs, RenderContext& context,
+                      const ShardOptions& shard) {
+  // Workers may be started before the plan is written
+  ShardPlan plan;
+  for (int waited = 0; !read_plan(shard, plan); waited++) {
+    if (waited == 600 || (context.cancel && *context.cancel)) {
+      std::cerr << "Error: No shard plan in " << shard.dir << std::endl;
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (!check_identity(input_file, plan)) {
+    return false;
+  }
+
+  bool ok = true;
+  size_t units_done = 0;
+  try {
+    NcFile dataFile(input_file, NcFile::read);
+    size_t nTime = dataFile.getVar("time").getDim(0).getSize();
+    std::vector<std::string> time_labels = load_time_labels(dataFile, nTime);
+
+    const std::string token = claim_token(shard);
+    // A complete slice cache is read from, but none is built: a unit reads only some of the time steps
+    SliceCacheLocation cache_location;
+    if (context.options.slice_cache) {
+      cache_location = slice_cache_location(input_file);
+      cache_location.build = false;
+    }
+    while (!(context.cancel && *context.cancel)) {
+      std::optional<std::string> id = claim_unit(shard, plan.workers, token);
+      if (!id) {
+        // Nothing queued: done once no unit is claimed or blocked. Until then,
+        // take back the units of workers that died and release their frames.
+        if (requeue_stale_claims(shard, plan) > 0) {
+          continue;
+        }
+        if (!release_finished_ranges(shard, plan, context.options)) {
+          ok = false;
+          break;
+        }
+        bool blocked = any_units(shard, "blocked", plan.workers);
+        if (!blocked && list_units(shard_path(shard, "claimed")).empty()) {
+          break;
+        }
+        if (blocked && blocked_for_good(shard, plan)) {
+          std::cerr << "Error: Frame units are waiting for a range unit that failed" << std::endl;
+          ok = false;
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        continue;
+      }
+
+      auto planned = std::find_if(plan.units.begin(), plan.units.end(), [&](const PlannedUnit& unit) { return unit.id == *id; });
+      const VariableJob* job = planned != plan.units.end() ? find_job(jobs, planned->alias) : nullptr;
+      bool unit_ok = job != nullptr;
+      auto start_time = std::chrono::steady_clock::now();
+      try {
+        ClaimHeartbeat heartbeat(shard_path(shard, "claimed") / *id, shard.lease_seconds / 4);
+        if (!job) {
+          std::cerr << "Error: " << *id << " is not a unit of a variable this worker renders" << std::endl;
+        } else if (planned->frames) {
+          std::optional<std::pair<float, float>> range = read_range(shard, job->variable_alias);
+          if (!range) {
+            throw std::runtime_error("no colour range for " + job->variable_alias);
+          }
+          ShardUnit unit{planned->t0, planned->t1, *range, (shard_path(shard, "results") / *id).string()};
+          render_variable(dataFile, *job, time_labels, context, cache_location, &unit);
+        } else {
+          measure_unit(dataFile, *job, context, *planned, shard_path(shard, "results") / (*id + ".hist"));
+        }
+      } catch (const std::exception& e) {
+        std::cerr << "Error: " << *id << ": " << e.what() << std::endl;
+        unit_ok = false;
+      } catch (...) {
+        std::cerr << "Error: " << *id << ": unknown error" << std::endl;
+        unit_ok = false;
+      }
+      context.metrics.add_time("unit", job ? job->variable_alias : "",
+                               std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+      // A claim that went stale was re-queued and may be someone else's by now; their results will match
+      if (!holds_claim(shard, *id, token)) {
+        std::cerr << "Warning: " << *id << " was re-queued while this worker ran it" << std::endl;
+        continue;
+      }
+      move_file(shard_path(shard, "claimed") / *id, shard_path(shard, unit_ok ? "done" : "failed") / *id);
+      if (unit_ok && !planned->frames) {
+        unit_ok = release_frames(shard, plan, context.options, job->variable_alias);
+      }
+      ok = ok && unit_ok;
+      units_done++;
+    }
+  } catch (const NcException& e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    ok = false;
+  }
+  std::cout << "Worker " << shard.worker_id << " finished " << units_done << " units" << std::endl;
+  return ok;
+}
+
+bool merge_shards(const std::string& input_file, const std::vector<VariableJob>& jobs, RenderContext& context,
+                  const ShardOptions& shard) {
+  const RenderOptions& options = context.options;
+  ShardPlan plan;
+  if (!read_plan(shard, plan)) {
+    std::cerr << "Error: No shard plan in " << shard.dir << std::endl;
+    return false;
+  }
+  if (!check_identity(input_file, plan)) {
+    return false;
+  }
+
+  bool ok = true;
+  for (const VariableJob& job : jobs) {
+    std::vector<const PlannedUnit*> units;
+    bool complete = true;
+    for (const PlannedUnit& unit : plan.units) {
+      if (unit.alias == job.variable_alias && unit.frames) {
+        units.push_back(&unit);
+        if (!std::filesystem::exists(shard_path(shard, "done") / unit.id)) {
+          std::cerr << "Error: " << unit.id << (std::filesystem::exists(shard_path(shard, "failed") / unit.id) ? " failed" : " has not finished")
+                    << std::endl;
+          complete = false;
+        }
+      }
+    }
+    if (units.empty()) {
+      continue;
+    }
+    if (!complete) {
+      ok = false;
+      continue;
+    }
+    std::cout << "Merging " << units.size() << " units of " << job.variable_alias << std::endl;
+
+    // Frame units are planned in time order
+    RenderManifest manifest(job.output_folder);
+    std::vector<ShardResult> results(units.size());
+    std::vector<uint64_t> slice_hashes;
+    std::vector<std::pair<float, float>> measured;
+    bool read_ok = true;
+    for (size_t i = 0; i < units.size() && read_ok; i++) {
+      std::string prefix = (shard_path(shard, "results") / units[i]->id).string();
+      read_ok = read_shard_result(prefix + ".result", results[i]) && manifest.load_updates(prefix + ".manifest");
+      slice_hashes.insert(slice_hashes.end(), results[i].slice_hashes.begin(), results[i].slice_hashes.end());
+      measured.push_back(results[i].measured);
+    }
+    if (!read_ok) {
+      std::cerr << "Error: Could not read the results of " << job.variable_alias << std::endl;
+      ok = false;
+      continue;
+    }
+    const std::pair<float, float> range = results[0].range;
+
+    const RangePolicy policy = range_policy_for(options.range_policies, job.variable_alias);
+    if (policy.mode == RangeMode::rolling) {
+      std::pair<float, float> next = combine_ranges(measured, policy.min_threshold, policy.max_threshold);
+      if (plan.known_ranges.count(job.variable_alias) > 0) {
+        float w = policy.rolling_weight;
+        next = std::make_pair(range.first + w * (next.first - range.first), range.second + w * (next.second - range.second));
+      }
+      if (next.first < next.second && !write_range_cache(job.output_folder, next)) {
+        std::cerr << "Error: Could not write the range cache in " << job.output_folder << std::endl;
+      }
+    }
+
+    if (options.write_gif) {
+      // Same record as a single process writes, so either can skip the other's animation
+      std::string gif_name = job.variable_alias + ".gif";
+      std::string gif_filename = job.output_folder + "/" + gif_name;
+      FrameRecord gif_record{fnv1a_hash(slice_hashes.data(), slice_hashes.size() * sizeof(uint64_t)), range.first, range.second,
+                             fnv1a_hash(&options.gif_delay, sizeof(options.gif_delay), results[0].style_hash)};
+      if (options.incremental && manifest.is_current(gif_name, gif_record)) {
+        std::cout << "Animation is up to date: " << gif_filename << std::endl;
+      } else {
+        const std::string& colormap_alias = job.derived.colormap.empty() ? job.variable_alias : job.derived.colormap;
+        GifWriter gif(slice_hashes.size(), cached_colormap(context, colormap_alias, 256), options.gif_delay);
+        for (const ShardResult& result : results) {
+          for (size_t i = 0; i < result.frames.size(); i++) {
+            gif.set_frame(result.t0 + i, result.frames[i]);
+          }
+        }
+        ScopedTimer timer(context.metrics, "gif", job.variable_alias);
+        if (gif.write(gif_filename)) {
+          manifest.set(gif_name, gif_record);
+          std::cout << "GIF created successfully: " << gif_filename << std::endl;
+        } else {
+          std::cerr << "Error: Could not create the output GIF file: " << gif_filename << std::endl;
+          ok = false;
+        }
+      }
+    }
+
+    if (!manifest.save()) {
+      std::cerr << "Error: Could not write the render manifest in " << job.output_folder << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "create_images.h"
+
+// Rendering one input file with several processes, on one machine or on
+// several sharing a filesystem. The work is split into units of one variable
+// and a run of time steps; plan lays them out as files under dir, workers
+// claim them by renaming them and merge finishes every variable from the
+// results. Each unit file starts in one worker's queue, a worker that has
+// emptied its own queue takes the last units of the others'. A worker keeps
+// the mtime of its claim fresh; idle workers put claims that go stale for
+// longer than the lease back into their queue, so the clocks of the machines
+// have to agree to well within it.
+//
+//   <dir>/plan                         input identity and one line per unit
+//   <dir>/queue/<worker>/<unit>        waiting
+//   <dir>/blocked/<worker>/<unit>      frames waiting for their variable's colour range
+//   <dir>/claimed/<unit>               being worked on, signed by its worker
+//   <dir>/done/<unit>, failed/<unit>   finished
+//   <dir>/results/<unit>.*             partial ranges, manifest entries and animation frames
+//   <dir>/ranges/<variable>            colour range shared by the frame units of a variable
+enum class ShardRole { none, plan, work, merge };
+
+struct ShardOptions {
+  ShardRole role = ShardRole::none;
+  std::string dir;
+  // Worker queues the units are dealt over, and this worker's queue
+  size_t workers = 1;
+  size_t worker_id = 0;
+  // Time steps per unit
+  size_t steps_per_unit = 12;
+  // Seconds a claim may go without a heartbeat before it is taken back
+  double lease_seconds = 120;
+};
+
+// Every role gets the same input, variables and render options. Each returns
+// false when something failed; merge also when a unit has not finished.
+bool plan_shards(const std::string& input_file, const std::vector<VariableJob>& jobs, RenderContext& context,
+                 const ShardOptions& shard);
+bool run_shard_worker(const std::string& input_file, const std::vector<VariableJob>& jobs, RenderContext& context,
+                      const ShardOptions& shard);
+bool merge_shards(const std::string& input_file, const std::vector<VariableJob>& jobs, RenderContext& context,
+                  const ShardOptions& shard);
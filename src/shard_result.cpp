@@ -0,0 +1,111 @@
+#include "shard_result.h"
+
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <zlib.h>
+
+static const char kMagic[8] = {'M', 'G', 'S', 'H', 'A', 'R', 'D', '1'};
+
+template <typename T>
+static void put(std::ofstream& file, const T& value) {
+  file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+static bool get(std::ifstream& file, T& value) {
+  return static_cast<bool>(file.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+// <magic> <t0> <t1> <range> <measured> <style hash> <slice hashes>
+// <frame count> then per frame <rows> <cols> <deflated size> <deflated indices>
+bool write_shard_result(const std::string& filename, const ShardResult& result) {
+  // A name of its own: a unit whose worker lost its claim may be written by two at once
+  std::string tmp_path = filename + ".XXXXXX";
+  int fd = mkstemp(tmp_path.data());
+  if (fd < 0) {
+    return false;
+  }
+  close(fd);
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    file.write(kMagic, sizeof(kMagic));
+    put(file, static_cast<uint64_t>(result.t0));
+    put(file, static_cast<uint64_t>(result.t1));
+    put(file, result.range);
+    put(file, result.measured);
+    put(file, result.style_hash);
+    file.write(reinterpret_cast<const char*>(result.slice_hashes.data()), result.slice_hashes.size() * sizeof(uint64_t));
+    put(file, static_cast<uint64_t>(result.frames.size()));
+    std::vector<uint8_t> packed;
+    std::vector<uint8_t> deflated;
+    for (const cv::Mat& frame : result.frames) {
+      int32_t rows = frame.rows;
+      int32_t cols = frame.cols;
+      packed.resize(static_cast<size_t>(rows) * cols);
+      for (int y = 0; y < rows; y++) {
+        std::memcpy(packed.data() + static_cast<size_t>(y) * cols, frame.ptr<uint8_t>(y), cols);
+      }
+      uLongf size = compressBound(packed.size());
+      deflated.resize(size);
+      if (compress2(deflated.data(), &size, packed.data(), packed.size(), 1) != Z_OK) {
+        unlink(tmp_path.c_str());
+        return false;
+      }
+      put(file, rows);
+      put(file, cols);
+      put(file, static_cast<uint64_t>(size));
+      file.write(reinterpret_cast<const char*>(deflated.data()), size);
+    }
+    if (!file) {
+      unlink(tmp_path.c_str());
+      return false;
+    }
+  }
+  std::error_code ec;
+  std::filesystem::rename(tmp_path, filename, ec);
+  if (ec) {
+    unlink(tmp_path.c_str());
+  }
+  return !ec;
+}
+
+bool read_shard_result(const std::string& filename, ShardResult& result) {
+  std::ifstream file(filename, std::ios::binary);
+  char magic[sizeof(kMagic)];
+  uint64_t t0, t1, n_frames;
+  if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0 || !get(file, t0) ||
+      !get(file, t1) || t1 < t0 || !get(file, result.range) || !get(file, result.measured) || !get(file, result.style_hash)) {
+    return false;
+  }
+  result.t0 = t0;
+  result.t1 = t1;
+  result.slice_hashes.resize(t1 - t0);
+  if (!file.read(reinterpret_cast<char*>(result.slice_hashes.data()), result.slice_hashes.size() * sizeof(uint64_t)) ||
+      !get(file, n_frames) || (n_frames != 0 && n_frames != t1 - t0)) {
+    return false;
+  }
+  result.frames.clear();
+  std::vector<uint8_t> deflated;
+  for (uint64_t i = 0; i < n_frames; i++) {
+    int32_t rows, cols;
+    uint64_t size;
+    if (!get(file, rows) || !get(file, cols) || !get(file, size) || rows < 0 || cols < 0) {
+      return false;
+    }
+    deflated.resize(size);
+    if (!file.read(reinterpret_cast<char*>(deflated.data()), size)) {
+      return false;
+    }
+    cv::Mat frame(rows, cols, CV_8UC1);
+    uLongf length = static_cast<uLongf>(rows) * cols;
+    if (frame.total() > 0 && (uncompress(frame.ptr<uint8_t>(0), &length, deflated.data(), size) != Z_OK ||
+                              length != frame.total())) {
+      return false;
+    }
+    result.frames.push_back(frame);
+  }
+  return true;
+}
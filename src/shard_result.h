@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include <opencv2/core.hpp>
+
+// Time steps [t0, t1) of a variable rendered by a shard worker with a colour
+// range decided beforehand. Instead of the animation, the range cache and the
+// manifest, the worker leaves <result_prefix>.result and
+// <result_prefix>.manifest (the entries of the files it wrote) for the merge.
+struct ShardUnit {
+  size_t t0 = 0;
+  size_t t1 = 0;
+  std::pair<float, float> range;
+  std::string result_prefix;
+};
+
+// What the merge needs from a rendered unit to finish the variable as a
+// single process would have
+struct ShardResult {
+  size_t t0 = 0;
+  size_t t1 = 0;
+  // Range the frames were drawn with, and the range of the unit's values
+  std::pair<float, float> range;
+  std::pair<float, float> measured;
+  uint64_t style_hash = 0;
+  // One per time step
+  std::vector<uint64_t> slice_hashes;
+  // CV_8UC1 palette index frames for the animation, one per time step, or none
+  std::vector<cv::Mat> frames;
+};
+
+// The frames are deflated, they are mostly runs of similar indices
+bool write_shard_result(const std::string& filename, const ShardResult& result);
+bool read_shard_result(const std::string& filename, ShardResult& result);
@@ -0,0 +1,179 @@
+#include "slice_cache.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "render_manifest.h"
+
+namespace {
+
+// 2: fill values are stored as NaN
+const char kMagic[8] = {'M', 'G', 'S', 'L', 'I', 'C', 'E', '2'};
+
+// Fixed size header in front of the slices, which start page aligned
+struct CacheHeader {
+  char magic[8];
+  uint64_t identity;
+  uint64_t n_time;
+  uint64_t window[5];
+  uint64_t complete;
+};
+const size_t kDataOffset = 4096;
+
+}  // namespace
+
+SliceCacheLocation slice_cache_location(const std::string& input_file) {
+  SliceCacheLocation location;
+  struct stat st;
+  if (stat(input_file.c_str(), &st) != 0) {
+    return location;
+  }
+  std::error_code ec;
+  std::string path = std::filesystem::absolute(input_file, ec).string();
+  uint64_t identity = fnv1a_hash(path.data(), path.size());
+  uint64_t size = static_cast<uint64_t>(st.st_size);
+  int64_t mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  identity = fnv1a_hash(&size, sizeof(size), identity);
+  identity = fnv1a_hash(&mtime_ns, sizeof(mtime_ns), identity);
+  location.dir = input_file + ".slices";
+  location.identity = identity;
+  return location;
+}
+
+std::unique_ptr<SliceCache> SliceCache::open(const SliceCacheLocation& location, const std::string& variable, size_t nTime,
+                                             const GridWindow& window) {
+  std::unique_ptr<SliceCache> cache(new SliceCache());
+  // One file per variable and window, so a new version of the input replaces the old one
+  char window_key[17];
+  snprintf(window_key, sizeof(window_key), "%016llx", static_cast<unsigned long long>(fnv1a_hash(&window, sizeof(window))));
+  cache->path_ = (std::filesystem::path(location.dir) / (variable + "." + window_key + ".f32")).string();
+  cache->identity_ = location.identity;
+  cache->nTime_ = nTime;
+  cache->slice_size_ = window.rows() * window.cols();
+  cache->window_ = window;
+  cache->map_bytes_ = kDataOffset + nTime * cache->slice_size_ * sizeof(float);
+
+  // A finished cache of this version of the input is mapped read-only
+  int fd = ::open(cache->path_.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    CacheHeader header;
+    struct stat st;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &st) == 0 &&
+                 static_cast<size_t>(st.st_size) == cache->map_bytes_ && std::memcmp(header.magic, kMagic, 8) == 0 &&
+                 header.identity == location.identity && header.n_time == nTime && header.complete == 1 &&
+                 header.window[0] == window.y0 && header.window[1] == window.x0 && header.window[2] == window.ny &&
+                 header.window[3] == window.nx && header.window[4] == window.stride;
+    if (valid) {
+      void* map = mmap(nullptr, cache->map_bytes_, PROT_READ, MAP_SHARED, fd, 0);
+      if (map != MAP_FAILED) {
+        madvise(map, cache->map_bytes_, MADV_SEQUENTIAL);
+        cache->fd_ = fd;
+        cache->map_ = map;
+        cache->data_ = reinterpret_cast<float*>(static_cast<char*>(map) + kDataOffset);
+        cache->complete_ = true;
+        return cache;
+      }
+    }
+    close(fd);
+  }
+  if (!location.build) {
+    return nullptr;
+  }
+
+  // Otherwise build it from this run's reads, in a file of its own until it is
+  // complete; runs building the same cache at once each get their own
+  std::error_code ec;
+  std::filesystem::create_directories(location.dir, ec);
+  cache->build_path_ = cache->path_ + ".build.XXXXXX";
+  fd = mkstemp(cache->build_path_.data());
+  if (fd < 0) {
+    std::cerr << "Error: Could not create the slice cache " << cache->build_path_ << ": " << strerror(errno) << std::endl;
+    cache->build_path_.clear();
+    return nullptr;
+  }
+  fchmod(fd, 0644);
+  // Allocated up front: a sparse file that runs out of disk would raise SIGBUS
+  // through the mapping instead of failing here, where the run goes on uncached
+  int err = posix_fallocate(fd, 0, static_cast<off_t>(cache->map_bytes_));
+  if (err != 0) {
+    std::cerr << "Error: Could not allocate the slice cache " << cache->build_path_ << ", reading without it: " << strerror(err)
+              << std::endl;
+    close(fd);
+    unlink(cache->build_path_.c_str());
+    cache->build_path_.clear();
+    return nullptr;
+  }
+  void* map = mmap(nullptr, cache->map_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    unlink(cache->build_path_.c_str());
+    cache->build_path_.clear();
+    return nullptr;
+  }
+  cache->fd_ = fd;
+  cache->map_ = map;
+  cache->data_ = reinterpret_cast<float*>(static_cast<char*>(map) + kDataOffset);
+  cache->stored_.assign(nTime, false);
+  return cache;
+}
+
+SliceCache::~SliceCache() {
+  if (map_) {
+    munmap(map_, map_bytes_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  // An incomplete build is of no use to the next run
+  if (!complete_ && !build_path_.empty()) {
+    unlink(build_path_.c_str());
+  }
+}
+
+void SliceCache::store(size_t t0, size_t nt, const float* src) {
+  if (complete_) {
+    return;
+  }
+  std::memcpy(data_ + t0 * slice_size_, src, nt * slice_size_ * sizeof(float));
+  for (size_t t = t0; t < t0 + nt; t++) {
+    if (!stored_[t]) {
+      stored_[t] = true;
+      n_stored_++;
+    }
+  }
+  if (n_stored_ == nTime_ && !finish()) {
+    std::cerr << "Error: Could not finish the slice cache " << path_ << std::endl;
+  }
+}
+
+// The header only says complete once the slices are on disk, and the rename
+// makes the file visible to other runs in one step
+bool SliceCache::finish() {
+  if (msync(map_, map_bytes_, MS_SYNC) != 0) {
+    return false;
+  }
+  CacheHeader header{};
+  std::memcpy(header.magic, kMagic, 8);
+  header.identity = identity_;
+  header.n_time = nTime_;
+  header.window[0] = window_.y0;
+  header.window[1] = window_.x0;
+  header.window[2] = window_.ny;
+  header.window[3] = window_.nx;
+  header.window[4] = window_.stride;
+  header.complete = 1;
+  if (pwrite(fd_, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) || fsync(fd_) != 0) {
+    return false;
+  }
+  if (rename(build_path_.c_str(), path_.c_str()) != 0) {
+    return false;
+  }
+  complete_ = true;
+  stored_.clear();
+  return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "netcdf_reader.h"
+
+// Where the slice caches of one input file live and which version of the file
+// they must have been built from. Empty dir means no caching.
+struct SliceCacheLocation {
+  std::string dir;
+  uint64_t identity = 0;
+  // False to only use complete caches, for readers that never read every time step
+  bool build = true;
+
+  bool enabled() const { return !dir.empty(); }
+};
+
+// <input>.slices next to the input file, with the identity taken from its
+// path, size and modification time; not enabled when the file cannot be stat'ed
+SliceCacheLocation slice_cache_location(const std::string& input_file);
+
+// The stored values of one variable over a grid window, uncompressed and
+// time-major in a file under the cache location, memory-mapped. A complete
+// cache built from the same input file hands out slices straight from the page
+// cache, without going through HDF5 and deflate again. Otherwise the cache is
+// built while the variable is read, in a uniquely named file allocated in
+// full up front: every slice read is stored, and once all time steps are in,
+// the file is renamed into place and the cache turns complete. A cache of
+// another version of the input is replaced.
+class SliceCache {
+public:
+  // nullptr when the cache file can neither be used nor built (or building is
+  // off), the caller then reads without it
+  static std::unique_ptr<SliceCache> open(const SliceCacheLocation& location, const std::string& variable, size_t nTime,
+                                          const GridWindow& window);
+  ~SliceCache();
+  SliceCache(const SliceCache&) = delete;
+  SliceCache& operator=(const SliceCache&) = delete;
+
+  bool complete() const { return complete_; }
+  // The whole cube, nTime slices of rows() x cols(); only while building
+  // the slices that were stored already hold data
+  const float* data() const { return data_; }
+  // Stores time steps [t0, t0 + nt) while building, completes the cache with the last missing one
+  void store(size_t t0, size_t nt, const float* src);
+
+private:
+  SliceCache() = default;
+  bool finish();
+
+  std::string path_;
+  std::string build_path_;
+  uint64_t identity_ = 0;
+  size_t nTime_ = 0;
+  size_t slice_size_ = 0;
+  GridWindow window_;
+  int fd_ = -1;
+  void* map_ = nullptr;
+  size_t map_bytes_ = 0;
+  float* data_ = nullptr;
+  bool complete_ = false;
+  std::vector<bool> stored_;
+  size_t n_stored_ = 0;
+};
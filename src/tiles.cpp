@@ -0,0 +1,128 @@
+#include "tiles.h"
+
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <opencv2/core.hpp>
+#include "png_encoder.h"
+
+int tile_max_zoom(size_t nLat, size_t nLon, int tile_size) {
+  size_t extent = std::max(nLat, nLon);
+  int z = 0;
+  while (static_cast<size_t>(tile_size) << z < extent) {
+    z++;
+  }
+  return z;
+}
+
+TileLevel full_resolution_level(const float* slice, size_t nLat, size_t nLon) {
+  TileLevel level;
+  level.width = static_cast<int>(nLon);
+  level.height = static_cast<int>(nLat);
+  level.values.resize(nLat * nLon);
+  // The slice runs south to north, tiles are numbered from the north
+  for (size_t y = 0; y < nLat; y++) {
+    std::copy(slice + (nLat - 1 - y) * nLon, slice + (nLat - y) * nLon, level.values.begin() + y * nLon);
+  }
+  return level;
+}
+
+TileLevel reduce_level(const TileLevel& level) {
+  TileLevel reduced;
+  reduced.width = (level.width + 1) / 2;
+  reduced.height = (level.height + 1) / 2;
+  reduced.values.resize(static_cast<size_t>(reduced.width) * reduced.height);
+  for (int y = 0; y < reduced.height; y++) {
+    for (int x = 0; x < reduced.width; x++) {
+      float sum = 0.0f;
+      int n = 0;
+      for (int dy = 0; dy < 2; dy++) {
+        int sy = 2 * y + dy;
+        for (int dx = 0; dx < 2; dx++) {
+          int sx = 2 * x + dx;
+          if (sy < level.height && sx < level.width) {
+            float v = level.values[static_cast<size_t>(sy) * level.width + sx];
+            if (!std::isnan(v)) {
+              sum += v;
+              n++;
+            }
+          }
+        }
+      }
+      reduced.values[static_cast<size_t>(y) * reduced.width + x] = n > 0 ? sum / n : NAN;
+    }
+  }
+  return reduced;
+}
+
+// Colours one tile of a level, returns false when no pixel of it has data
+static bool fill_tile(const TileLevel& level, int tx, int ty, int tile_size, const ColorLUT& lut, float minVar, float maxVar,
+                      std::vector<uint8_t>& tile) {
+  tile.assign(static_cast<size_t>(tile_size) * tile_size, kTileTransparent);
+  int x0 = tx * tile_size;
+  int y0 = ty * tile_size;
+  int w = std::min(tile_size, level.width - x0);
+  int h = std::min(tile_size, level.height - y0);
+  bool any = false;
+  for (int y = 0; y < h; y++) {
+    const float* src = level.values.data() + static_cast<size_t>(y0 + y) * level.width + x0;
+    uint8_t* dst = tile.data() + static_cast<size_t>(y) * tile_size;
+    index_row(src, dst, w, lut, minVar, maxVar);
+    for (int x = 0; x < w; x++) {
+      if (std::isnan(src[x])) {
+        dst[x] = kTileTransparent;
+      } else {
+        any = true;
+      }
+    }
+  }
+  return any;
+}
+
+size_t write_tile_pyramid(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar,
+                          int tile_size, const std::string& folder, const std::string& key_prefix, RenderManifest& manifest) {
+  std::atomic<size_t> written{0};
+  uint64_t palette_hash = fnv1a_hash(lut.bgr.data(), lut.bgr.size());
+  const int max_zoom = tile_max_zoom(nLat, nLon, tile_size);
+  TileLevel level = full_resolution_level(slice, nLat, nLon);
+  for (int z = max_zoom; z >= 0; z--) {
+    if (z != max_zoom) {
+      level = reduce_level(level);
+    }
+    int n_x = (level.width + tile_size - 1) / tile_size;
+    int n_y = (level.height + tile_size - 1) / tile_size;
+    cv::parallel_for_(cv::Range(0, n_x * n_y), [&](const cv::Range& range) {
+      std::vector<uint8_t> tile;
+      std::vector<uint8_t> png;
+      for (int i = range.start; i < range.end; i++) {
+        int tx = i % n_x;
+        int ty = i / n_x;
+        std::string name = std::to_string(z) + "/" + std::to_string(tx) + "/" + std::to_string(ty) + ".png";
+        std::filesystem::path path = std::filesystem::path(folder) / name;
+        if (!fill_tile(level, tx, ty, tile_size, lut, minVar, maxVar, tile)) {
+          // A tile that had data last time must not outlive it
+          std::error_code ec;
+          std::filesystem::remove(path, ec);
+          continue;
+        }
+        // The pixels and the palette decide the file, so they are all the record needs
+        FrameRecord record{fnv1a_hash(tile.data(), tile.size()), 0.0f, 0.0f, palette_hash};
+        if (manifest.is_current(key_prefix + name, record)) {
+          continue;
+        }
+        if (!encode_indexed_png(tile.data(), tile_size, tile_size, tile_size, lut, 1, kTileTransparent, png)) {
+          continue;
+        }
+        std::filesystem::create_directories(path.parent_path());
+        std::ofstream file(path, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(png.data()), png.size());
+        if (file) {
+          manifest.set(key_prefix + name, record);
+          written++;
+        }
+      }
+    });
+  }
+  return written;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "colorize.h"
+#include "render_manifest.h"
+
+// Palette entry left transparent in tiles, for the area outside the grid and
+// missing values. Tiles are coloured with a LUT of kTileTransparent entries so
+// it is never used for data.
+const int kTileTransparent = 255;
+
+// Zoom levels of a tile pyramid over a south-to-north nLat x nLon grid. The
+// deepest level shows the grid at its native resolution, anchored at the top
+// left (north-west) corner, and every level above halves it, down to level 0
+// where the whole grid fits in one tile.
+int tile_max_zoom(size_t nLat, size_t nLon, int tile_size);
+
+// Float image of one pyramid level, north up, NaN where there is no data
+struct TileLevel {
+  int width = 0;
+  int height = 0;
+  std::vector<float> values;
+};
+
+// The deepest level from the slice, and each shallower level as the 2x2 mean
+// of the one below, ignoring NaN
+TileLevel full_resolution_level(const float* slice, size_t nLat, size_t nLon);
+TileLevel reduce_level(const TileLevel& level);
+
+// Writes the slice as paletted PNG tiles <folder>/<z>/<x>/<y>.png for every
+// zoom level, encoding the tiles of a level in parallel. Tiles that are
+// entirely transparent are not written, and neither are tiles whose pixels are
+// the same as last time according to the manifest, which is keyed by
+// <key_prefix><z>/<x>/<y>.png. lut must have kTileTransparent entries.
+// Returns the number of tiles written.
+size_t write_tile_pyramid(const float* slice, size_t nLat, size_t nLon, const ColorLUT& lut, float minVar, float maxVar,
+                          int tile_size, const std::string& folder, const std::string& key_prefix, RenderManifest& manifest);